@@ -20,6 +20,8 @@ export const Test: React.FC = () => {
   useEffect(() => {
     if (!dataChannel) return;
     dataChannel.onmessage = (event) => {
+      // binary messages carry matrices for other Max objects
+      if (typeof event.data !== "string") return;
       const msg = JSON.parse(event.data) as DataChannelMessage;
       setMessages((prev) => [
         ...prev,
@@ -1,6 +1,34 @@
 import type { Client, SignalingMessage } from "./signalingClient";
 import type SignalingClient from "./signalingClient";
 
+// microseconds since the epoch, the unit of the Max side clock messages
+const wallClockUs = () =>
+  Math.round((performance.timeOrigin + performance.now()) * 1000);
+
+// ?lan pairs with the lan attribute of the Max object: no trickle ICE, the
+// offer carries the host candidates and Max answers with its own
+const lanMode = new URLSearchParams(window.location.search).has("lan");
+
+// resolves once all candidates are in the local description, host
+// candidates take a few ms; the timeout guards against a stalled gathering
+const waitForGathering = (pc: RTCPeerConnection, timeoutMs = 1000) =>
+  new Promise<void>((resolve) => {
+    if (pc.iceGatheringState === "complete") {
+      resolve();
+      return;
+    }
+    const done = () => {
+      pc.removeEventListener("icegatheringstatechange", check);
+      clearTimeout(timer);
+      resolve();
+    };
+    const check = () => {
+      if (pc.iceGatheringState === "complete") done();
+    };
+    const timer = setTimeout(done, timeoutMs);
+    pc.addEventListener("icegatheringstatechange", check);
+  });
+
 class WebRTCConnection {
   signalingClient: SignalingClient;
   setDataChannel: React.Dispatch<
@@ -72,17 +100,22 @@ class WebRTCConnection {
       console.log("----onnegotiationneeded----");
       try {
         this.makingOffer = true;
-        this.pc?.setLocalDescription().then(() => {
-          const description = this.pc?.localDescription;
-
-          const offerMsg: SignalingMessage = {
-            signalingType: "Offer",
-            target: this.target!,
-            content: description!,
-          };
-
-          this.onOfferSend(offerMsg);
-        });
+        this.pc
+          ?.setLocalDescription()
+          .then(() =>
+            lanMode && this.pc ? waitForGathering(this.pc) : undefined
+          )
+          .then(() => {
+            const description = this.pc?.localDescription;
+
+            const offerMsg: SignalingMessage = {
+              signalingType: "Offer",
+              target: this.target!,
+              content: description!,
+            };
+
+            this.onOfferSend(offerMsg);
+          });
       } catch (err) {
         console.error("[onnegotiationneeded]:", err);
       } finally {
@@ -91,7 +124,7 @@ class WebRTCConnection {
     };
 
     this.pc.onicecandidate = (evt) => {
-      if (evt.candidate) {
+      if (evt.candidate && !lanMode) {
         const candiateMsg: SignalingMessage = {
           signalingType: "Ice",
           target: this.target,
@@ -106,6 +139,21 @@ class WebRTCConnection {
       this.setDataChannel(event.channel);
     };
 
+    // answer clock pings so the Max side can measure capture to display latency
+    this.dc.addEventListener("message", (event) => {
+      if (
+        typeof event.data !== "string" ||
+        !event.data.startsWith('{"minClock":"ping"')
+      ) {
+        return;
+      }
+      const t1 = wallClockUs();
+      const { t0 } = JSON.parse(event.data);
+      this.dc?.send(
+        JSON.stringify({ minClock: "pong", t0, t1, t2: wallClockUs() })
+      );
+    });
+
     this.dc.onopen = (evt) => {
       this.signalingClient.setConnectionState((prev) => ({
         ...prev,
@@ -184,17 +232,22 @@ class WebRTCConnection {
         return this.pc?.createAnswer();
       })
       .then((answer) => {
-        return this.pc?.setLocalDescription(answer).then(() => {
-          // In the following line, the target becomes the sender and sender becomes target
-          const answerMsg: SignalingMessage = {
-            signalingType: "Answer",
-            sender: this.signalingClient.id!,
-            target: this.target!,
-            content: this.pc?.localDescription as RTCSessionDescription,
-          };
-
-          this.onAnswerSend(answerMsg);
-        });
+        return this.pc
+          ?.setLocalDescription(answer)
+          .then(() =>
+            lanMode && this.pc ? waitForGathering(this.pc) : undefined
+          )
+          .then(() => {
+            // In the following line, the target becomes the sender and sender becomes target
+            const answerMsg: SignalingMessage = {
+              signalingType: "Answer",
+              sender: this.signalingClient.id!,
+              target: this.target!,
+              content: this.pc?.localDescription as RTCSessionDescription,
+            };
+
+            this.onAnswerSend(answerMsg);
+          });
       });
   }
 
@@ -0,0 +1,51 @@
+#include "block_diff.h"
+#include <cstring>
+
+int BlockDiff::update(const uint8_t* data, int width_, int height_, int bytes_per_pixel_, int stride)
+{
+    bool geometry_changed = width_ != width || height_ != height || bytes_per_pixel_ != bytes_per_pixel;
+    if (geometry_changed) {
+        width = width_;
+        height = height_;
+        bytes_per_pixel = bytes_per_pixel_;
+        blocks_x = (width + BlockSize - 1) / BlockSize;
+        blocks_y = (height + BlockSize - 1) / BlockSize;
+        previous.resize(static_cast<size_t>(width) * bytes_per_pixel * height);
+    }
+    changed.assign(blocks_x * blocks_y, geometry_changed ? 1 : 0);
+
+    const size_t row_bytes = static_cast<size_t>(width) * bytes_per_pixel;
+    const size_t block_bytes = static_cast<size_t>(BlockSize) * bytes_per_pixel;
+
+    // row by row so both images are read in order; memcmp stops at the first
+    // difference, after which the rest of the block is only copied
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* row = data + static_cast<size_t>(y) * stride;
+        uint8_t* kept = previous.data() + y * row_bytes;
+        uint8_t* flags = changed.data() + (y / BlockSize) * blocks_x;
+        for (int bx = 0; bx < blocks_x; ++bx) {
+            const size_t offset = bx * block_bytes;
+            const size_t bytes = offset + block_bytes < row_bytes ? block_bytes : row_bytes - offset;
+            if (!flags[bx] && std::memcmp(kept + offset, row + offset, bytes) != 0) {
+                flags[bx] = 1;
+            }
+            if (flags[bx]) {
+                std::memcpy(kept + offset, row + offset, bytes);
+            }
+        }
+    }
+
+    int changed_count = 0;
+    for (uint8_t flag : changed) {
+        changed_count += flag;
+    }
+    return changed_count;
+}
+
+void BlockDiff::reset()
+{
+    width = height = bytes_per_pixel = 0;
+    blocks_x = blocks_y = 0;
+    previous.clear();
+    changed.clear();
+}
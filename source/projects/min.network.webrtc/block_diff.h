@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Tracks which square blocks of a packed image changed since the previous
+// call, so static content can skip conversion and encoding. Blocks are
+// compared byte for byte against a copy of the previous image rather than a
+// checksum, so no change is ever missed; only changed blocks are copied.
+class BlockDiff {
+public:
+    static constexpr int BlockSize = 64; // in pixels
+
+    // returns the number of changed blocks, every block counts as changed
+    // when the geometry differs from the previous call
+    int update(const uint8_t* data, int width, int height, int bytes_per_pixel, int stride);
+
+    void reset();
+
+    int imageWidth() const { return width; }
+    int imageHeight() const { return height; }
+    int blocksX() const { return blocks_x; }
+    int blocksY() const { return blocks_y; }
+    int blockCount() const { return blocks_x * blocks_y; }
+
+    // one entry per block in row-major order, non-zero when the block changed
+    const std::vector<uint8_t>& changedBlocks() const { return changed; }
+
+private:
+    int width = 0, height = 0, bytes_per_pixel = 0;
+    int blocks_x = 0, blocks_y = 0;
+    std::vector<uint8_t> previous; // packed rows
+    std::vector<uint8_t> changed;
+};
@@ -0,0 +1,127 @@
+#include "clock_sync.h"
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using nlohmann::json;
+
+int64_t ClockSync::wallUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+bool ClockSync::isClockMessage(const std::string& text)
+{
+    // checked on every DataChannel message, so no parsing here
+    return text.rfind("{\"minClock\"", 0) == 0;
+}
+
+std::string ClockSync::makePing() const
+{
+    return json { { "minClock", "ping" }, { "t0", wallUs() } }.dump();
+}
+
+std::string ClockSync::handle(const std::string& text)
+{
+    const int64_t now = wallUs();
+    json message = json::parse(text, nullptr, false);
+    if (message.is_discarded() || !message.is_object()) {
+        return {};
+    }
+
+    const std::string kind = message.value("minClock", "");
+    if (kind == "ping" && message.contains("t0")) {
+        return json {
+            { "minClock", "pong" },
+            { "t0", message["t0"] },
+            { "t1", now },
+            { "t2", wallUs() }
+        }.dump();
+    }
+
+    if (kind == "pong") {
+        // the web client has millisecond clocks with fractions
+        const int64_t t0 = static_cast<int64_t>(message.value("t0", 0.0));
+        const int64_t t1 = static_cast<int64_t>(message.value("t1", 0.0));
+        const int64_t t2 = static_cast<int64_t>(message.value("t2", 0.0));
+        const int64_t rtt = (now - t0) - (t2 - t1);
+        if (t0 <= 0 || rtt < 0) {
+            return {};
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.push_back({ rtt, ((t1 - t0) + (t2 - now)) / 2 });
+        if (samples.size() > MaxSamples) {
+            samples.pop_front();
+        }
+    }
+    return {};
+}
+
+const ClockSync::Sample* ClockSync::best() const
+{
+    auto it = std::min_element(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) {
+        return a.rtt_us < b.rtt_us;
+    });
+    return it != samples.end() ? &*it : nullptr;
+}
+
+bool ClockSync::hasOffset() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return !samples.empty();
+}
+
+int64_t ClockSync::getOffsetUs() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const Sample* sample = best();
+    return sample ? sample->offset_us : 0;
+}
+
+int64_t ClockSync::getRttUs() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const Sample* sample = best();
+    return sample ? sample->rtt_us : 0;
+}
+
+void LatencyStats::add(int64_t latency_us)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    samples.push_back(latency_us);
+    if (samples.size() > MaxSamples) {
+        samples.pop_front();
+    }
+}
+
+LatencyStats::Summary LatencyStats::summary() const
+{
+    std::vector<int64_t> sorted;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sorted.assign(samples.begin(), samples.end());
+    }
+
+    Summary summary;
+    if (sorted.empty()) {
+        return summary;
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    int64_t total = 0;
+    for (int64_t value : sorted) {
+        total += value;
+    }
+    auto percentile = [&sorted](double p) {
+        return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))] / 1000.0;
+    };
+    summary.count = sorted.size();
+    summary.mean_ms = total / 1000.0 / sorted.size();
+    summary.p50_ms = percentile(0.5);
+    summary.p95_ms = percentile(0.95);
+    summary.max_ms = sorted.back() / 1000.0;
+    return summary;
+}
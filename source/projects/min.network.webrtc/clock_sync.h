@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+
+// Offset between our wall clock and a peer's, from ping/pong text messages on
+// the DataChannel. As in NTP, of the recent exchanges the one with the
+// shortest round trip gives the offset. Both sides answer pings, the web
+// client included.
+//
+//   ping {"minClock":"ping","t0":..}
+//   pong {"minClock":"pong","t0":..,"t1":..,"t2":..}   t1, t2 on the peer's clock
+class ClockSync {
+public:
+    // microseconds since the epoch
+    static int64_t wallUs();
+    static bool isClockMessage(const std::string& text);
+
+    std::string makePing() const;
+    // the reply for a ping, empty for a pong or anything unreadable
+    std::string handle(const std::string& text);
+
+    bool hasOffset() const;
+    int64_t getOffsetUs() const; // peer clock minus ours
+    int64_t getRttUs() const;
+
+private:
+    static constexpr size_t MaxSamples = 8;
+
+    struct Sample {
+        int64_t rtt_us;
+        int64_t offset_us;
+    };
+    const Sample* best() const; // with mutex held
+
+    mutable std::mutex mutex;
+    std::deque<Sample> samples;
+};
+
+// Per frame latencies of the last MaxSamples frames, summarised as percentiles.
+class LatencyStats {
+public:
+    struct Summary {
+        size_t count = 0;
+        double mean_ms = 0;
+        double p50_ms = 0;
+        double p95_ms = 0;
+        double max_ms = 0;
+    };
+
+    void add(int64_t latency_us);
+    Summary summary() const;
+
+private:
+    static constexpr size_t MaxSamples = 512;
+
+    mutable std::mutex mutex;
+    std::deque<int64_t> samples;
+};
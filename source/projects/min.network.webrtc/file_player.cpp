@@ -0,0 +1,163 @@
+#include "file_player.h"
+#include "h264_utils.h"
+#include <algorithm>
+
+static constexpr AVRational RtpTimeBase { 1, 90000 };
+
+FilePlayer::FilePlayer(FrameCallback on_frame_, LogCallback on_log_)
+    : on_frame(on_frame_)
+    , on_log(on_log_)
+{
+}
+
+FilePlayer::~FilePlayer()
+{
+    stop();
+}
+
+void FilePlayer::start(const std::string& path, bool loop_)
+{
+    stop();
+    loop = loop_;
+    stopping = false;
+    playing = true;
+    thread = std::thread(&FilePlayer::run, this, path);
+}
+
+void FilePlayer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    playing = false;
+}
+
+bool FilePlayer::waitUntil(std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return !cv.wait_until(lock, deadline, [this] { return stopping; });
+}
+
+void FilePlayer::run(std::string path)
+{
+    AVFormatContext* fmt_ctx = nullptr;
+    AVBSFContext* bsf = nullptr;
+    AVPacket* pkt = av_packet_alloc();
+    int stream_index = -1;
+    AVStream* stream = nullptr;
+
+    auto fail = [&](const std::string& message) {
+        on_log("play: " + message + " (" + path + ")");
+    };
+
+    if (avformat_open_input(&fmt_ctx, path.c_str(), nullptr, nullptr) < 0) {
+        fail("cannot open file");
+    } else if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+        fail("cannot read stream info");
+    } else if ((stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0)) < 0) {
+        fail("no video stream");
+    } else if (fmt_ctx->streams[stream_index]->codecpar->codec_id != AV_CODEC_ID_H264) {
+        fail("video is not H264, passthrough needs H264");
+    } else {
+        stream = fmt_ctx->streams[stream_index];
+        // MP4/MKV store length prefixed NAL units, RTP packetizer wants start codes
+        const AVBitStreamFilter* filter = av_bsf_get_by_name("h264_mp4toannexb");
+        if (!filter || av_bsf_alloc(filter, &bsf) < 0) {
+            fail("h264_mp4toannexb unavailable");
+            stream = nullptr;
+        } else {
+            avcodec_parameters_copy(bsf->par_in, stream->codecpar);
+            bsf->time_base_in = stream->time_base;
+            if (av_bsf_init(bsf) < 0) {
+                fail("cannot init h264_mp4toannexb");
+                stream = nullptr;
+            }
+        }
+    }
+
+    if (stream) {
+        on_log("playing " + path);
+
+        // frame length used to continue the timeline after a loop
+        int64_t frame_ticks = 3000;
+        if (stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) {
+            frame_ticks = av_rescale_q(1, av_make_q(stream->avg_frame_rate.den, stream->avg_frame_rate.num), RtpTimeBase);
+        }
+
+        const auto start_time = std::chrono::steady_clock::now();
+        int64_t first_ts = AV_NOPTS_VALUE;
+        int64_t loop_offset = 0; // in 90kHz ticks
+        int64_t last_ts = 0;
+        bool sent_since_seek = false;
+        bool running = true;
+
+        while (running) {
+            int ret = av_read_frame(fmt_ctx, pkt);
+            if (ret == AVERROR_EOF || (ret < 0 && ret != AVERROR(EAGAIN))) {
+                // an empty or unreadable file would otherwise spin here
+                if (!loop || !sent_since_seek) {
+                    break;
+                }
+                sent_since_seek = false;
+                av_seek_frame(fmt_ctx, stream_index, 0, AVSEEK_FLAG_BACKWARD);
+                av_bsf_flush(bsf);
+                loop_offset = last_ts + frame_ticks;
+                first_ts = AV_NOPTS_VALUE;
+                continue;
+            }
+            if (ret < 0) {
+                continue;
+            }
+            if (pkt->stream_index != stream_index) {
+                av_packet_unref(pkt);
+                continue;
+            }
+
+            if (av_bsf_send_packet(bsf, pkt) < 0) {
+                av_packet_unref(pkt);
+                continue;
+            }
+
+            while (running && av_bsf_receive_packet(bsf, pkt) == 0) {
+                // pace by decode order, stamp with presentation time
+                int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+                int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : dts;
+                if (dts == AV_NOPTS_VALUE) {
+                    dts = pts = 0;
+                }
+                if (first_ts == AV_NOPTS_VALUE) {
+                    first_ts = dts;
+                }
+
+                const int64_t dts_ticks = loop_offset + av_rescale_q(dts - first_ts, bsf->time_base_out, RtpTimeBase);
+                const int64_t pts_ticks = loop_offset + av_rescale_q(pts - first_ts, bsf->time_base_out, RtpTimeBase);
+                last_ts = std::max(last_ts, pts_ticks);
+
+                auto due = start_time + std::chrono::microseconds(dts_ticks * 1000 / 90);
+                if (!waitUntil(due)) {
+                    running = false;
+                } else {
+                    bool keyframe = (pkt->flags & AV_PKT_FLAG_KEY) || h264::isKeyframe(pkt->data, pkt->size);
+                    on_frame(pkt->data, static_cast<size_t>(pkt->size), pts_ticks, keyframe);
+                    sent_since_seek = true;
+                }
+                av_packet_unref(pkt);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                running = false;
+            }
+        }
+    }
+
+    av_bsf_free(&bsf);
+    avformat_close_input(&fmt_ctx);
+    av_packet_free(&pkt);
+    playing = false;
+}
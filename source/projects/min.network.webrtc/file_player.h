@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <libavcodec/bsf.h>
+#include <libavformat/avformat.h>
+}
+
+// Demuxes the H264 track of a media file and hands out Annex-B access units
+// in decode order, paced against the wall clock by their timestamps. Nothing
+// is decoded. When looping the timeline continues across the wrap.
+class FilePlayer {
+public:
+    // pts in 90kHz ticks, keyframe units carry SPS/PPS in band
+    using FrameCallback = std::function<void(const uint8_t* data, size_t size, int64_t pts, bool keyframe)>;
+    using LogCallback = std::function<void(const std::string&)>;
+
+    FilePlayer(FrameCallback on_frame, LogCallback on_log);
+    ~FilePlayer();
+
+    void start(const std::string& path, bool loop);
+    void stop();
+    bool isPlaying() const { return playing; }
+    void setLoop(bool enabled) { loop = enabled; }
+
+private:
+    void run(std::string path);
+    // false when the thread should end
+    bool waitUntil(std::chrono::steady_clock::time_point deadline);
+
+    FrameCallback on_frame;
+    LogCallback on_log;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::atomic<bool> playing { false };
+    std::atomic<bool> loop { true };
+};
@@ -0,0 +1,42 @@
+#include "finaliser.h"
+
+Finaliser::Finaliser()
+    : thread(&Finaliser::run, this)
+{
+}
+
+Finaliser::~Finaliser()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+void Finaliser::push(std::shared_ptr<void> object)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(object));
+    }
+    cv.notify_one();
+}
+
+void Finaliser::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cv.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        auto object = std::move(queue.front());
+        queue.pop_front();
+        // the destructor runs without the lock, so retire() never waits on it
+        lock.unlock();
+        object.reset();
+        lock.lock();
+    }
+}
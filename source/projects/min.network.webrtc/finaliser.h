@@ -0,0 +1,34 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Destroys objects with blocking destructors, such as recorders that join
+// their writer thread and write a trailer, on a thread of its own so network
+// and Max threads never wait for the disk. The destructor waits until
+// everything handed over is gone.
+class Finaliser {
+public:
+    Finaliser();
+    ~Finaliser();
+
+    template <typename T>
+    void retire(std::unique_ptr<T> object)
+    {
+        if (object) {
+            push(std::shared_ptr<void>(std::move(object)));
+        }
+    }
+
+private:
+    void push(std::shared_ptr<void> object);
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<void>> queue;
+    bool stopping = false;
+    std::thread thread;
+};
@@ -0,0 +1,172 @@
+#include "frame_dump.h"
+#include "logger.h"
+#include <cerrno>
+#include <cstring>
+
+static void put_u32(uint8_t* p, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(p[i]) << (8 * i);
+    }
+    return value;
+}
+
+static constexpr size_t RecordHeaderSize = 16;
+
+FrameDumpWriter::FrameDumpWriter(const std::string& path_, size_t max_queued_bytes_)
+    : path(path_)
+    , max_queued_bytes(max_queued_bytes_)
+{
+    writer = std::thread(&FrameDumpWriter::run, this);
+}
+
+FrameDumpWriter::~FrameDumpWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+    }
+    if (dropped_frames > 0) {
+        WLOG_WARN("[Dump] %s: %llu frames dropped", path.c_str(), static_cast<unsigned long long>(dropped_frames.load()));
+    }
+}
+
+void FrameDumpWriter::push(const uint8_t* data, size_t size, uint32_t timestamp, int64_t arrival_us)
+{
+    if (size == 0 || size > frame_dump::MaxRecordSize) {
+        return;
+    }
+
+    frame_dump::Record record { std::vector<uint8_t>(data, data + size), timestamp, arrival_us };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queued_bytes + size > max_queued_bytes) {
+            ++dropped_frames;
+            return;
+        }
+        queued_bytes += size;
+        queue.push_back(std::move(record));
+    }
+    cv.notify_one();
+}
+
+void FrameDumpWriter::run()
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        WLOG_ERROR("[Dump] cannot open %s: %s", path.c_str(), strerror(errno));
+    } else {
+        uint8_t version[4];
+        put_u32(version, frame_dump::Version);
+        fwrite(frame_dump::Magic, 1, sizeof(frame_dump::Magic), file);
+        fwrite(version, 1, sizeof(version), file);
+    }
+
+    std::deque<frame_dump::Record> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty() && stopping) {
+                break;
+            }
+            batch.swap(queue);
+            queued_bytes = 0;
+        }
+
+        for (const auto& record : batch) {
+            if (!file) {
+                break;
+            }
+            uint8_t header[RecordHeaderSize];
+            put_u32(header, static_cast<uint32_t>(record.data.size()));
+            put_u32(header + 4, record.timestamp);
+            put_u32(header + 8, static_cast<uint32_t>(static_cast<uint64_t>(record.arrival_us)));
+            put_u32(header + 12, static_cast<uint32_t>(static_cast<uint64_t>(record.arrival_us) >> 32));
+            if (fwrite(header, 1, sizeof(header), file) != sizeof(header)
+                || fwrite(record.data.data(), 1, record.data.size(), file) != record.data.size()) {
+                WLOG_ERROR("[Dump] write to %s failed", path.c_str());
+                fclose(file);
+                file = nullptr;
+            }
+        }
+        batch.clear();
+    }
+
+    if (file) {
+        fclose(file);
+    }
+}
+
+FrameDumpReader::~FrameDumpReader()
+{
+    close();
+}
+
+bool FrameDumpReader::open(const std::string& path)
+{
+    close();
+    file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t header[sizeof(frame_dump::Magic) + 4];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)
+        || memcmp(header, frame_dump::Magic, sizeof(frame_dump::Magic)) != 0
+        || get_u32(header + sizeof(frame_dump::Magic)) != frame_dump::Version) {
+        close();
+        return false;
+    }
+    first_record = ftell(file);
+    if (fseek(file, 0, SEEK_END) != 0 || (file_size = ftell(file)) < first_record) {
+        close();
+        return false;
+    }
+    fseek(file, first_record, SEEK_SET);
+    return true;
+}
+
+void FrameDumpReader::close()
+{
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+void FrameDumpReader::rewind()
+{
+    if (file) {
+        fseek(file, first_record, SEEK_SET);
+    }
+}
+
+bool FrameDumpReader::next(frame_dump::Record& record)
+{
+    uint8_t header[RecordHeaderSize];
+    if (!file || fread(header, 1, sizeof(header), file) != sizeof(header)) {
+        return false;
+    }
+    record.timestamp = get_u32(header + 4);
+    record.arrival_us = static_cast<int64_t>(get_u32(header + 8) | static_cast<uint64_t>(get_u32(header + 12)) << 32);
+    const uint32_t size = get_u32(header);
+    const long remaining = file_size - ftell(file);
+    if (size > frame_dump::MaxRecordSize || remaining < 0 || size > static_cast<unsigned long>(remaining)) {
+        return false;
+    }
+    record.data.resize(size);
+    return fread(record.data.data(), 1, record.data.size(), file) == record.data.size();
+}
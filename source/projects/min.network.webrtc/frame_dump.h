@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Depacketized frames of one incoming track, as the decoder gets them, kept in
+// a binary file so decoder issues can be replayed offline (see webrtc_replay).
+//
+//   file:   "MNWDUMP1" | u32 version
+//   record: u32 size | u32 rtp timestamp | i64 arrival us | size bytes
+//
+// All integers little endian, arrival on the steady clock of the recording host.
+namespace frame_dump {
+
+constexpr char Magic[8] = { 'M', 'N', 'W', 'D', 'U', 'M', 'P', '1' };
+constexpr uint32_t Version = 1;
+// far above any coded frame, a bigger size means a corrupt record
+constexpr uint32_t MaxRecordSize = 64 << 20;
+
+struct Record {
+    std::vector<uint8_t> data;
+    uint32_t timestamp = 0;
+    int64_t arrival_us = 0;
+};
+
+}
+
+// push() only queues, the file is written on a thread of its own. Frames are
+// dropped when the disk falls behind by more than max_queued_bytes, a replay
+// then shows the gap like packet loss would.
+class FrameDumpWriter {
+public:
+    FrameDumpWriter(const std::string& path, size_t max_queued_bytes = 64 << 20);
+    ~FrameDumpWriter();
+
+    void push(const uint8_t* data, size_t size, uint32_t timestamp, int64_t arrival_us);
+
+    const std::string& getPath() const { return path; }
+    uint64_t getDroppedFrames() const { return dropped_frames; }
+
+private:
+    void run();
+
+    std::string path;
+    size_t max_queued_bytes;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<frame_dump::Record> queue;
+    size_t queued_bytes = 0;
+    bool stopping = false;
+    std::atomic<uint64_t> dropped_frames { 0 };
+    std::thread writer;
+};
+
+class FrameDumpReader {
+public:
+    ~FrameDumpReader();
+
+    bool open(const std::string& path);
+    void close();
+    void rewind();
+
+    // false at the end of the file, on a truncated record or on a size over
+    // MaxRecordSize or past the end of the file
+    bool next(frame_dump::Record& record);
+
+private:
+    FILE* file = nullptr;
+    long first_record = 0;
+    long file_size = 0;
+};
@@ -0,0 +1,38 @@
+#include "frame_pacer.h"
+
+void FramePacer::setMaxFps(double fps)
+{
+    interval_us = fps > 0.0 ? static_cast<int64_t>(1000000.0 / fps) : 0;
+}
+
+double FramePacer::getMaxFps() const
+{
+    int64_t interval = interval_us;
+    return interval > 0 ? 1000000.0 / static_cast<double>(interval) : 0.0;
+}
+
+bool FramePacer::admit(int64_t now_us)
+{
+    const int64_t interval = interval_us;
+    if (interval <= 0) {
+        return true;
+    }
+
+    // a little slack so a source running right at the cap isn't halved by jitter
+    if (now_us < next_due_us - interval / 8) {
+        return false;
+    }
+
+    // after an idle period restart the schedule instead of letting a burst through
+    if (now_us - next_due_us > interval) {
+        next_due_us = now_us + interval;
+    } else {
+        next_due_us += interval;
+    }
+    return true;
+}
+
+void FramePacer::reset()
+{
+    next_due_us = 0;
+}
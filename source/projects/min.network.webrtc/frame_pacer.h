@@ -0,0 +1,21 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Caps the outgoing frame rate. Frames that arrive before their slot are
+// dropped by the caller before any conversion or encoding happens.
+class FramePacer {
+public:
+    // fps <= 0 disables the cap
+    void setMaxFps(double fps);
+    double getMaxFps() const;
+
+    // true when a frame captured at now_us (monotonic clock) should be sent
+    bool admit(int64_t now_us);
+
+    void reset();
+
+private:
+    std::atomic<int64_t> interval_us { 0 };
+    int64_t next_due_us = 0;
+};
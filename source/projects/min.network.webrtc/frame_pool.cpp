@@ -0,0 +1,191 @@
+#include "frame_pool.h"
+#include <chrono>
+#include <iterator>
+#include <new>
+
+void FramePool::AlignedDelete::operator()(uint8_t* bytes) const
+{
+    ::operator delete[](bytes, std::align_val_t(Alignment));
+}
+
+FramePool::Buffer::Buffer(FramePool* pool, Bytes bytes, size_t size)
+    : pool(pool)
+    , bytes(std::move(bytes))
+    , size(size)
+{
+}
+
+FramePool::Buffer::Buffer(Buffer&& other) noexcept
+    : pool(other.pool)
+    , bytes(std::move(other.bytes))
+    , size(other.size)
+{
+    other.pool = nullptr;
+    other.size = 0;
+}
+
+FramePool::Buffer& FramePool::Buffer::operator=(Buffer&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        bytes = std::move(other.bytes);
+        size = other.size;
+        other.pool = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+FramePool::Buffer::~Buffer()
+{
+    release();
+}
+
+void FramePool::Buffer::release()
+{
+    if (pool && bytes) {
+        pool->giveBack(std::move(bytes), size);
+    }
+    pool = nullptr;
+    size = 0;
+}
+
+FramePool& FramePool::instance()
+{
+    // never destroyed, decoders may outlive static destruction order
+    static FramePool* pool = new FramePool();
+    return *pool;
+}
+
+// 64KB minimum, above that quarter steps between powers of two so rounding
+// wastes at most 25%
+size_t FramePool::sizeClass(size_t bytes)
+{
+    constexpr size_t MinClass = 64 * 1024;
+    if (bytes <= MinClass) {
+        return MinClass;
+    }
+    size_t power = MinClass;
+    while (power * 2 <= bytes) {
+        power *= 2;
+    }
+    const size_t step = power / 4;
+    return (bytes + step - 1) / step * step;
+}
+
+int64_t FramePool::nowUs()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+size_t FramePool::limit(Priority priority) const
+{
+    if (budget == 0 || priority == Priority::High) {
+        return SIZE_MAX;
+    }
+    return priority == Priority::Low ? static_cast<size_t>(budget * LowShare) : budget;
+}
+
+FramePool::Buffer FramePool::acquire(size_t bytes, Priority priority)
+{
+    const size_t size = sizeClass(bytes);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    expire(nowUs());
+    auto it = free_lists.find(size);
+    if (it != free_lists.end() && !it->second.empty()) {
+        // the most recently given back is the most likely to still be in cache
+        auto cached = std::move(it->second.back().bytes);
+        it->second.pop_back();
+        cached_bytes -= size;
+        return Buffer(this, std::move(cached), size);
+    }
+
+    if (budget > 0 && priority != Priority::High) {
+        trim(size);
+        if (allocated_bytes + size > limit(priority)) {
+            return {};
+        }
+    }
+
+    allocated_bytes += size;
+    return Buffer(this, Bytes(static_cast<uint8_t*>(::operator new[](size, std::align_val_t(Alignment)))), size);
+}
+
+bool FramePool::hasRoom(size_t bytes, Priority priority)
+{
+    const size_t size = sizeClass(bytes);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = free_lists.find(size);
+    if (it != free_lists.end() && !it->second.empty()) {
+        return true;
+    }
+    // cached buffers of other classes would be trimmed to make room
+    return allocated_bytes - cached_bytes + size <= limit(priority);
+}
+
+void FramePool::giveBack(Bytes bytes, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (budget > 0 && allocated_bytes > budget) {
+        // over budget after a High request, shrink rather than cache
+        allocated_bytes -= size;
+        return;
+    }
+    const int64_t now = nowUs();
+    free_lists[size].push_back({ std::move(bytes), now });
+    cached_bytes += size;
+    expire(now);
+}
+
+void FramePool::expire(int64_t now_us)
+{
+    for (auto it = free_lists.begin(); it != free_lists.end();) {
+        auto& list = it->second;
+        size_t expired = 0;
+        while (expired < list.size() && now_us - list[expired].since_us > MaxIdleUs) {
+            ++expired;
+        }
+        list.erase(list.begin(), list.begin() + expired);
+        allocated_bytes -= expired * it->first;
+        cached_bytes -= expired * it->first;
+        it = list.empty() ? free_lists.erase(it) : std::next(it);
+    }
+}
+
+void FramePool::trim(size_t wanted)
+{
+    for (auto it = free_lists.begin(); it != free_lists.end() && allocated_bytes + wanted > budget;) {
+        auto& list = it->second;
+        while (!list.empty() && allocated_bytes + wanted > budget) {
+            list.erase(list.begin());
+            allocated_bytes -= it->first;
+            cached_bytes -= it->first;
+        }
+        it = list.empty() ? free_lists.erase(it) : std::next(it);
+    }
+}
+
+void FramePool::setBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = bytes;
+    if (budget > 0) {
+        trim(0);
+    }
+}
+
+size_t FramePool::getBudget() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return budget;
+}
+
+size_t FramePool::getAllocatedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocated_bytes;
+}
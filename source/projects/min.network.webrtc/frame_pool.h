@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Process wide pool of frame buffers shared by all decoders. Requests are
+// rounded up to a size class so a stream that changes resolution a little
+// reuses the buffer it has, and buffers given back are handed to the next
+// request of the same class instead of being freed. Cached buffers unused for
+// MaxIdleUs are freed, so size classes a stream has left do not pile up.
+//
+// A memory budget caps the bytes held by the pool, in use or cached. Past the
+// budget requests are refused by priority, low first, so the caller can drop
+// to a cheaper decode mode instead of growing.
+class FramePool {
+public:
+    enum class Priority {
+        Low, // refused once the pool is at LowShare of the budget
+        Normal, // refused once the budget is reached
+        High // always served
+    };
+
+    // of every buffer, enough for any SIMD the decoders and swscale use
+    static constexpr size_t Alignment = 64;
+
+    struct AlignedDelete {
+        void operator()(uint8_t* bytes) const;
+    };
+    using Bytes = std::unique_ptr<uint8_t[], AlignedDelete>;
+
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other) noexcept;
+        Buffer& operator=(Buffer&& other) noexcept;
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        ~Buffer();
+
+        uint8_t* data() const { return bytes.get(); }
+        size_t capacity() const { return size; }
+        explicit operator bool() const { return bytes != nullptr; }
+
+    private:
+        friend class FramePool;
+        Buffer(FramePool* pool, Bytes bytes, size_t size);
+        void release();
+
+        FramePool* pool = nullptr;
+        Bytes bytes;
+        size_t size = 0;
+    };
+
+    static FramePool& instance();
+
+    // an empty buffer when the budget does not allow it
+    Buffer acquire(size_t bytes, Priority priority);
+
+    // whether acquire would serve the request now, without taking anything
+    bool hasRoom(size_t bytes, Priority priority);
+
+    // 0 disables the budget
+    void setBudget(size_t bytes);
+    size_t getBudget() const;
+    size_t getAllocatedBytes() const;
+
+    static size_t sizeClass(size_t bytes);
+
+private:
+    FramePool() = default;
+    struct Cached {
+        Bytes bytes;
+        int64_t since_us; // when it was given back
+    };
+
+    void giveBack(Bytes bytes, size_t size);
+    // frees cached buffers until allocated_bytes + wanted fits the budget, or the cache is empty
+    void trim(size_t wanted);
+    void expire(int64_t now_us);
+    size_t limit(Priority priority) const;
+    static int64_t nowUs();
+
+    // fraction of the budget low priority requests may use
+    static constexpr double LowShare = 0.75;
+    static constexpr int64_t MaxIdleUs = 10000000;
+
+    mutable std::mutex mutex;
+    std::map<size_t, std::vector<Cached>> free_lists; // by size class, oldest first
+    size_t budget = 0;
+    size_t allocated_bytes = 0; // in use plus cached
+    size_t cached_bytes = 0;
+};
@@ -0,0 +1,374 @@
+#include "h264_utils.h"
+#include <cstring>
+
+namespace h264 {
+
+static const uint8_t CaptureTimeUuid[16] = {
+    0x6d, 0x69, 0x6e, 0x2e, 0x6e, 0x65, 0x74, 0x77, // "min.netw"
+    0x6f, 0x72, 0x6b, 0x2e, 0x63, 0x74, 0x69, 0x6d // "ork.ctim"
+};
+static constexpr uint8_t UserDataUnregistered = 5;
+
+std::vector<Nal> split(const uint8_t* data, size_t size)
+{
+    std::vector<Nal> nals;
+    size_t i = 0;
+    size_t start = SIZE_MAX;
+
+    while (i + 3 <= size) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            if (start != SIZE_MAX) {
+                // trailing zero belongs to a 4 byte start code
+                size_t end = i;
+                while (end > start && data[end - 1] == 0) {
+                    --end;
+                }
+                if (end > start) {
+                    nals.push_back({ data + start, end - start, static_cast<uint8_t>(data[start] & 0x1F), static_cast<uint8_t>((data[start] >> 5) & 0x03) });
+                }
+            }
+            i += 3;
+            start = i;
+        } else {
+            ++i;
+        }
+    }
+
+    if (start != SIZE_MAX && start < size) {
+        nals.push_back({ data + start, size - start, static_cast<uint8_t>(data[start] & 0x1F), static_cast<uint8_t>((data[start] >> 5) & 0x03) });
+    }
+    return nals;
+}
+
+bool isKeyframe(const uint8_t* data, size_t size)
+{
+    for (const auto& nal : split(data, size)) {
+        if (nal.type == IdrSlice) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// reads exp-Golomb codes from a NAL payload, skipping emulation prevention bytes
+class BitReader {
+public:
+    BitReader(const uint8_t* data, size_t size)
+        : data(data)
+        , size(size)
+    {
+    }
+
+    int bit()
+    {
+        if (bit_pos == 0) {
+            if (pos >= size) {
+                overrun = true;
+                return -1;
+            }
+            if (zeros >= 2 && data[pos] == 0x03) {
+                zeros = 0;
+                if (++pos >= size) {
+                    overrun = true;
+                    return -1;
+                }
+            }
+            zeros = data[pos] == 0 ? zeros + 1 : 0;
+        }
+        int value = (data[pos] >> (7 - bit_pos)) & 1;
+        if (++bit_pos == 8) {
+            bit_pos = 0;
+            ++pos;
+        }
+        return value;
+    }
+
+    // -1 past the end
+    int64_t ue()
+    {
+        int leading = 0;
+        int b;
+        while ((b = bit()) == 0) {
+            if (++leading > 31) {
+                return -1;
+            }
+        }
+        if (b < 0) {
+            return -1;
+        }
+        int64_t value = 0;
+        for (int i = 0; i < leading; ++i) {
+            if ((b = bit()) < 0) {
+                return -1;
+            }
+            value = (value << 1) | b;
+        }
+        return (int64_t(1) << leading) - 1 + value;
+    }
+
+    int64_t se()
+    {
+        const int64_t code = ue();
+        if (code < 0) {
+            return 0;
+        }
+        return code & 1 ? (code + 1) / 2 : -(code / 2);
+    }
+
+    // n <= 32, -1 past the end
+    int64_t bits(int n)
+    {
+        int64_t value = 0;
+        for (int i = 0; i < n; ++i) {
+            const int b = bit();
+            if (b < 0) {
+                return -1;
+            }
+            value = (value << 1) | b;
+        }
+        return value;
+    }
+
+    // false once a read ran past the end, every value since is garbage
+    bool ok() const { return !overrun; }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+    int bit_pos = 0;
+    int zeros = 0;
+    bool overrun = false;
+};
+
+static void skipScalingList(BitReader& reader, int size)
+{
+    int64_t last = 8;
+    int64_t next = 8;
+    for (int j = 0; j < size && reader.ok(); ++j) {
+        if (next != 0) {
+            next = (last + reader.se() + 256) % 256;
+        }
+        last = next == 0 ? last : next;
+    }
+}
+
+// seq_parameter_set_data up to the frame cropping, 7.3.2.1.1
+static bool parseSpsSize(const Nal& nal, int& width, int& height)
+{
+    BitReader reader(nal.data + 1, nal.size - 1);
+    const int64_t profile = reader.bits(8);
+    reader.bits(16); // constraint flags, level
+    reader.ue(); // seq_parameter_set_id
+
+    int64_t chroma_format = 1;
+    bool separate_planes = false;
+    switch (profile) {
+    case 100:
+    case 110:
+    case 122:
+    case 244:
+    case 44:
+    case 83:
+    case 86:
+    case 118:
+    case 128:
+    case 138:
+    case 139:
+    case 134:
+    case 135:
+        chroma_format = reader.ue();
+        if (chroma_format == 3) {
+            separate_planes = reader.bit() == 1;
+        }
+        reader.ue(); // bit_depth_luma_minus8
+        reader.ue(); // bit_depth_chroma_minus8
+        reader.bit(); // qpprime_y_zero_transform_bypass_flag
+        if (reader.bit() == 1) {
+            for (int i = 0; i < (chroma_format != 3 ? 8 : 12) && reader.ok(); ++i) {
+                if (reader.bit() == 1) {
+                    skipScalingList(reader, i < 6 ? 16 : 64);
+                }
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    reader.ue(); // log2_max_frame_num_minus4
+    const int64_t poc_type = reader.ue();
+    if (poc_type == 0) {
+        reader.ue(); // log2_max_pic_order_cnt_lsb_minus4
+    } else if (poc_type == 1) {
+        reader.bit(); // delta_pic_order_always_zero_flag
+        reader.se(); // offset_for_non_ref_pic
+        reader.se(); // offset_for_top_to_bottom_field
+        const int64_t cycle = reader.ue();
+        for (int64_t i = 0; i < cycle && reader.ok(); ++i) {
+            reader.se();
+        }
+    }
+    reader.ue(); // max_num_ref_frames
+    reader.bit(); // gaps_in_frame_num_value_allowed_flag
+    const int64_t width_mbs = reader.ue() + 1;
+    const int64_t height_units = reader.ue() + 1;
+    const int64_t frame_mbs_only = reader.bit();
+    if (frame_mbs_only == 0) {
+        reader.bit(); // mb_adaptive_frame_field_flag
+    }
+    reader.bit(); // direct_8x8_inference_flag
+
+    int64_t crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    if (reader.bit() == 1) {
+        crop_left = reader.ue();
+        crop_right = reader.ue();
+        crop_top = reader.ue();
+        crop_bottom = reader.ue();
+    }
+    if (!reader.ok() || chroma_format < 0 || chroma_format > 3 || width_mbs > 1024 || height_units > 1024) {
+        return false;
+    }
+
+    const int64_t chroma_array_type = separate_planes ? 0 : chroma_format;
+    const int64_t crop_x = chroma_array_type == 1 || chroma_array_type == 2 ? 2 : 1;
+    const int64_t crop_y = (chroma_array_type == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    const int64_t w = width_mbs * 16 - crop_x * (crop_left + crop_right);
+    const int64_t h = height_units * 16 * (2 - frame_mbs_only) - crop_y * (crop_top + crop_bottom);
+    if (w <= 0 || h <= 0) {
+        return false;
+    }
+    width = static_cast<int>(w);
+    height = static_cast<int>(h);
+    return true;
+}
+
+bool spsSize(const uint8_t* data, size_t size, int& width, int& height)
+{
+    for (const auto& nal : split(data, size)) {
+        if (nal.type == Sps && nal.size > 4) {
+            return parseSpsSize(nal, width, height);
+        }
+    }
+    return false;
+}
+
+std::vector<uint8_t> parameterSets(const uint8_t* data, size_t size)
+{
+    static const uint8_t start_code[] = { 0, 0, 0, 1 };
+    std::vector<uint8_t> out;
+    for (const auto& nal : split(data, size)) {
+        if (nal.type == Sps || nal.type == Pps) {
+            out.insert(out.end(), start_code, start_code + 4);
+            out.insert(out.end(), nal.data, nal.data + nal.size);
+        }
+    }
+    return out;
+}
+
+// payload bytes to NAL bytes, no 00 00 0x (x <= 3) may appear inside a NAL
+static void appendEscaped(std::vector<uint8_t>& out, const uint8_t* data, size_t size)
+{
+    int zeros = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (zeros >= 2 && data[i] <= 0x03) {
+            out.push_back(0x03);
+            zeros = 0;
+        }
+        out.push_back(data[i]);
+        zeros = data[i] == 0 ? zeros + 1 : 0;
+    }
+}
+
+std::vector<uint8_t> captureTimeSei(int64_t wall_us)
+{
+    uint8_t payload[2 + sizeof(CaptureTimeUuid) + 8];
+    payload[0] = UserDataUnregistered;
+    payload[1] = sizeof(CaptureTimeUuid) + 8;
+    std::memcpy(payload + 2, CaptureTimeUuid, sizeof(CaptureTimeUuid));
+    for (int i = 0; i < 8; ++i) {
+        payload[2 + sizeof(CaptureTimeUuid) + i] = static_cast<uint8_t>(static_cast<uint64_t>(wall_us) >> (56 - 8 * i));
+    }
+
+    std::vector<uint8_t> nal = { 0, 0, 0, 1, Sei };
+    appendEscaped(nal, payload, sizeof(payload));
+    nal.push_back(0x80); // rbsp trailing bits
+    return nal;
+}
+
+void insertCaptureTime(std::vector<uint8_t>& access_unit, int64_t wall_us)
+{
+    for (const auto& nal : split(access_unit.data(), access_unit.size())) {
+        if (nal.type != NonIdrSlice && nal.type != IdrSlice) {
+            continue;
+        }
+        size_t at = nal.data - access_unit.data() - 3;
+        if (at > 0 && access_unit[at - 1] == 0) {
+            --at;
+        }
+        const auto sei = captureTimeSei(wall_us);
+        access_unit.insert(access_unit.begin() + at, sei.begin(), sei.end());
+        return;
+    }
+}
+
+bool readCaptureTime(const uint8_t* data, size_t size, int64_t& wall_us)
+{
+    std::vector<uint8_t> rbsp;
+    for (const auto& nal : split(data, size)) {
+        if (nal.type != Sei) {
+            continue;
+        }
+        rbsp.clear();
+        int zeros = 0;
+        for (size_t i = 1; i < nal.size; ++i) {
+            if (zeros >= 2 && nal.data[i] == 0x03) {
+                zeros = 0;
+                continue;
+            }
+            rbsp.push_back(nal.data[i]);
+            zeros = nal.data[i] == 0 ? zeros + 1 : 0;
+        }
+
+        // an SEI NAL may hold several messages
+        size_t pos = 0;
+        while (pos < rbsp.size() && rbsp[pos] != 0x80) {
+            int type = 0;
+            while (pos < rbsp.size() && rbsp[pos] == 0xFF) {
+                type += 255;
+                ++pos;
+            }
+            if (pos >= rbsp.size()) {
+                break;
+            }
+            type += rbsp[pos++];
+            size_t payload_size = 0;
+            while (pos < rbsp.size() && rbsp[pos] == 0xFF) {
+                payload_size += 255;
+                ++pos;
+            }
+            if (pos >= rbsp.size()) {
+                break;
+            }
+            payload_size += rbsp[pos++];
+            if (pos + payload_size > rbsp.size()) {
+                break;
+            }
+
+            const uint8_t* payload = rbsp.data() + pos;
+            if (type == UserDataUnregistered && payload_size >= sizeof(CaptureTimeUuid) + 8
+                && std::memcmp(payload, CaptureTimeUuid, sizeof(CaptureTimeUuid)) == 0) {
+                uint64_t value = 0;
+                for (int i = 0; i < 8; ++i) {
+                    value = (value << 8) | payload[sizeof(CaptureTimeUuid) + i];
+                }
+                wall_us = static_cast<int64_t>(value);
+                return true;
+            }
+            pos += payload_size;
+        }
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Helpers for Annex-B H264 access units as produced by the encoder and the
+// H264RtpDepacketizer (NAL units separated by 00 00 01 / 00 00 00 01).
+namespace h264 {
+
+enum NalType : uint8_t {
+    NonIdrSlice = 1,
+    IdrSlice = 5,
+    Sei = 6,
+    Sps = 7,
+    Pps = 8,
+    Aud = 9
+};
+
+struct Nal {
+    const uint8_t* data; // first byte is the NAL header, start code excluded
+    size_t size;
+    uint8_t type;
+    uint8_t ref_idc;
+};
+
+std::vector<Nal> split(const uint8_t* data, size_t size);
+
+bool isKeyframe(const uint8_t* data, size_t size);
+
+// coded picture size from the SPS of the access unit, after cropping; false
+// when there is none or it does not parse
+bool spsSize(const uint8_t* data, size_t size, int& width, int& height);
+
+// SPS and PPS of the access unit, each prefixed with a 4 byte start code
+std::vector<uint8_t> parameterSets(const uint8_t* data, size_t size);
+
+// Capture time carried in a user_data_unregistered SEI, as microseconds of the
+// sender's wall clock. Decoders that do not know the UUID skip it.
+// The SEI NAL with a 4 byte start code:
+std::vector<uint8_t> captureTimeSei(int64_t wall_us);
+// inserts the SEI in front of the first slice of the access unit
+void insertCaptureTime(std::vector<uint8_t>& access_unit, int64_t wall_us);
+bool readCaptureTime(const uint8_t* data, size_t size, int64_t& wall_us);
+
+}
@@ -0,0 +1,179 @@
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+
+using namespace std::chrono_literals;
+
+static int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+bool LogSite::admit(int& suppressed_out)
+{
+    const int64_t now = now_us();
+    int64_t start = window_start_us.load(std::memory_order_relaxed);
+    if (now - start >= WindowUs && window_start_us.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+        count.store(0, std::memory_order_relaxed);
+    }
+
+    if (count.fetch_add(1, std::memory_order_relaxed) < MaxPerWindow) {
+        suppressed_out = suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+Logger& Logger::instance()
+{
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger()
+    : slots(new Slot[Capacity])
+{
+    for (size_t i = 0; i < Capacity; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    thread = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger()
+{
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (file) {
+        fclose(file);
+    }
+}
+
+void Logger::setLevel(LogLevel level)
+{
+    threshold.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+// bounded multi-producer queue, each slot carries the sequence number of the
+// position that may use it next
+void Logger::write(LogLevel level, const void* owner, int suppressed, const char* format, ...)
+{
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots[pos & (Capacity - 1)];
+        const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->owner = owner;
+    slot->suppressed = suppressed;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, MaxMessage, format, args);
+    va_end(args);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+int Logger::addSink(const void* owner, Sink sink)
+{
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    const int id = next_sink_id++;
+    sinks.push_back({ id, owner, std::move(sink) });
+    return id;
+}
+
+void Logger::removeSink(int id)
+{
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    sinks.erase(std::remove_if(sinks.begin(), sinks.end(), [id](const SinkEntry& entry) { return entry.id == id; }), sinks.end());
+}
+
+void Logger::setFile(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+    if (!path.empty()) {
+        file = fopen(path.c_str(), "a");
+    }
+}
+
+void Logger::run()
+{
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    while (!stopping) {
+        // producers never signal, a short poll keeps them wait free
+        wake.wait_for(lock, 20ms);
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+    lock.unlock();
+    flush();
+}
+
+void Logger::flush()
+{
+    static const char* const names[] = { "", "error", "warning", "info", "debug" };
+
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    const uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost > 0 && !sinks.empty()) {
+        sinks.front().sink(LogLevel::Warning, "[log] " + std::to_string(lost) + " messages dropped, ring full");
+    }
+
+    std::string line;
+    while (true) {
+        Slot& slot = slots[dequeue_pos & (Capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+            break;
+        }
+
+        line.assign(slot.text);
+        if (slot.suppressed > 0) {
+            line += " (" + std::to_string(slot.suppressed) + " similar suppressed)";
+        }
+        const LogLevel level = slot.level;
+        const void* owner = slot.owner;
+        slot.sequence.store(dequeue_pos + Capacity, std::memory_order_release);
+        ++dequeue_pos;
+
+        if (file) {
+            fprintf(file, "[%s] %s\n", names[static_cast<int>(level)], line.c_str());
+        }
+        for (auto& entry : sinks) {
+            if (entry.owner == owner || (!owner && &entry == &sinks.front())) {
+                entry.sink(level, line);
+                if (owner) {
+                    break;
+                }
+            }
+        }
+    }
+    if (file) {
+        fflush(file);
+    }
+}
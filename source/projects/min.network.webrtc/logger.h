@@ -0,0 +1,123 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class LogLevel {
+    Off,
+    Error,
+    Warning,
+    Info,
+    Debug
+};
+
+// Keeps one call site from flooding the log: at most MaxPerWindow messages
+// per window, the count of the ones dropped is attached to the next one let through.
+class LogSite {
+public:
+    static constexpr int MaxPerWindow = 5;
+    static constexpr int64_t WindowUs = 1000000;
+
+    bool admit(int& suppressed_out);
+
+private:
+    std::atomic<int64_t> window_start_us { 0 };
+    std::atomic<int> count { 0 };
+    std::atomic<int> suppressed { 0 };
+};
+
+// Process wide logger. Producers format into a slot of a fixed lock-free ring
+// and return, a background thread hands the lines to the sinks. When the ring
+// is full the message is dropped rather than blocking a media thread.
+class Logger {
+public:
+    using Sink = std::function<void(LogLevel level, const std::string& line)>;
+
+    static Logger& instance();
+
+    static bool enabled(LogLevel level)
+    {
+        return static_cast<int>(level) <= threshold.load(std::memory_order_relaxed);
+    }
+    static void setLevel(LogLevel level);
+
+    // owner routes the line to the sink registered for it, nullptr goes to the
+    // oldest sink so shared code is shown once
+    void write(LogLevel level, const void* owner, int suppressed, const char* format, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 5, 6)))
+#endif
+        ;
+
+    // sinks are called on the flusher thread, removeSink waits for a call in progress
+    int addSink(const void* owner, Sink sink);
+    void removeSink(int id);
+
+    // every line is also appended to path, an empty path closes the file
+    void setFile(const std::string& path);
+
+    ~Logger();
+
+private:
+    Logger();
+    void run();
+    void flush();
+
+    static constexpr size_t Capacity = 1024; // power of two
+    static constexpr size_t MaxMessage = 240;
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        LogLevel level;
+        const void* owner;
+        int suppressed;
+        char text[MaxMessage];
+    };
+
+    static inline std::atomic<int> threshold { static_cast<int>(LogLevel::Info) };
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> enqueue_pos { 0 };
+    size_t dequeue_pos = 0; // flusher thread only
+    std::atomic<uint64_t> dropped { 0 };
+
+    struct SinkEntry {
+        int id;
+        const void* owner;
+        Sink sink;
+    };
+    std::mutex sink_mutex;
+    std::vector<SinkEntry> sinks;
+    int next_sink_id = 1;
+    FILE* file = nullptr;
+
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread thread;
+};
+
+// owner as for Logger::write, nullptr for shared code
+#define WLOG_TO(owner, level, ...)                                                    \
+    do {                                                                              \
+        if (Logger::enabled(level)) {                                                 \
+            static LogSite wlog_site;                                                 \
+            int wlog_suppressed = 0;                                                  \
+            if (wlog_site.admit(wlog_suppressed))                                     \
+                Logger::instance().write(level, owner, wlog_suppressed, __VA_ARGS__); \
+        }                                                                             \
+    } while (0)
+
+#define WLOG(level, ...) WLOG_TO(nullptr, level, __VA_ARGS__)
+
+#define WLOG_ERROR(...) WLOG(LogLevel::Error, __VA_ARGS__)
+#define WLOG_WARN(...) WLOG(LogLevel::Warning, __VA_ARGS__)
+#define WLOG_INFO(...) WLOG(LogLevel::Info, __VA_ARGS__)
+#define WLOG_DEBUG(...) WLOG(LogLevel::Debug, __VA_ARGS__)
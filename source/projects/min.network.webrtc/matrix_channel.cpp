@@ -0,0 +1,402 @@
+#include "matrix_channel.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+#include <zstd.h>
+
+namespace matrix_channel {
+
+static constexpr size_t MatrixHeaderSize = 16;
+// a sanity limit against corrupt headers, far above any matrix sent interactively
+static constexpr size_t MaxBytes = size_t(1) << 31;
+
+static void put_le(uint8_t* p, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i) {
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+    return value;
+}
+
+size_t typeSize(Type type)
+{
+    switch (type) {
+    case Type::Char:
+        return 1;
+    case Type::Long:
+    case Type::Float32:
+        return 4;
+    case Type::Float64:
+        return 8;
+    }
+    return 0;
+}
+
+size_t Info::byteSize() const
+{
+    size_t size = cellBytes();
+    for (int d = 0; d < dimcount; ++d) {
+        size *= static_cast<size_t>(dim[d]);
+    }
+    return size;
+}
+
+bool Info::valid() const
+{
+    if (typeSize(type) == 0 || planecount < 1 || planecount > 255 || dimcount < 1 || dimcount > MaxDims) {
+        return false;
+    }
+    size_t size = cellBytes();
+    for (int d = 0; d < dimcount; ++d) {
+        if (dim[d] < 1) {
+            return false;
+        }
+        size *= static_cast<size_t>(dim[d]);
+        if (size > MaxBytes) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Info::sameLayout(const Info& other) const
+{
+    return type == other.type && planecount == other.planecount && dimcount == other.dimcount
+        && std::equal(dim, dim + dimcount, other.dim);
+}
+
+// calls fn(offset) for the start of every dim[0] row, in packed order
+template <class Fn>
+static void for_each_row(const Info& info, const int64_t* dimstride, Fn fn)
+{
+    int32_t index[MaxDims] = {};
+    const size_t rows = info.byteSize() / (info.cellBytes() * info.dim[0]);
+    for (size_t r = 0; r < rows; ++r) {
+        int64_t offset = 0;
+        for (int d = 1; d < info.dimcount; ++d) {
+            offset += index[d] * dimstride[d];
+        }
+        fn(offset);
+        for (int d = 1; d < info.dimcount; ++d) {
+            if (++index[d] < info.dim[d]) {
+                break;
+            }
+            index[d] = 0;
+        }
+    }
+}
+
+static bool is_packed(const Info& info, const int64_t* dimstride)
+{
+    int64_t expected = static_cast<int64_t>(info.cellBytes());
+    for (int d = 0; d < info.dimcount; ++d) {
+        if (dimstride[d] != expected) {
+            return false;
+        }
+        expected *= info.dim[d];
+    }
+    return true;
+}
+
+void pack(const Info& info, const uint8_t* source, const int64_t* dimstride, std::vector<uint8_t>& packed)
+{
+    packed.resize(info.byteSize());
+    if (is_packed(info, dimstride)) {
+        std::memcpy(packed.data(), source, packed.size());
+        return;
+    }
+    // rows are padded, jit.matrix aligns them to 16 bytes
+    const size_t row_bytes = info.cellBytes() * info.dim[0];
+    uint8_t* out = packed.data();
+    for_each_row(info, dimstride, [&](int64_t offset) {
+        std::memcpy(out, source + offset, row_bytes);
+        out += row_bytes;
+    });
+}
+
+void unpack(const Info& info, const uint8_t* packed, uint8_t* destination, const int64_t* dimstride)
+{
+    if (is_packed(info, dimstride)) {
+        std::memcpy(destination, packed, info.byteSize());
+        return;
+    }
+    const size_t row_bytes = info.cellBytes() * info.dim[0];
+    for_each_row(info, dimstride, [&](int64_t offset) {
+        std::memcpy(destination + offset, packed, row_bytes);
+        packed += row_bytes;
+    });
+}
+
+bool isMatrixMessage(const std::byte* data, size_t size)
+{
+    return size >= ChunkHeaderSize && get_le(reinterpret_cast<const uint8_t*>(data), 4) == Magic;
+}
+
+std::vector<std::vector<std::byte>> chunks(const Encoded& encoded, size_t max_message)
+{
+    std::vector<std::vector<std::byte>> messages;
+    const size_t payload = max_message > ChunkHeaderSize ? max_message - ChunkHeaderSize : 0;
+    if (payload == 0) {
+        return messages;
+    }
+    const size_t count = std::max<size_t>(1, (encoded.bytes.size() + payload - 1) / payload);
+    if (count > UINT16_MAX) {
+        WLOG_WARN("[Matrix] %zu bytes do not fit in %d messages", encoded.bytes.size(), UINT16_MAX);
+        return messages;
+    }
+
+    messages.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const size_t begin = i * payload;
+        const size_t size = std::min(payload, encoded.bytes.size() - begin);
+        std::vector<std::byte> message(ChunkHeaderSize + size);
+        auto* header = reinterpret_cast<uint8_t*>(message.data());
+        put_le(header, Magic, 4);
+        put_le(header + 4, encoded.seq, 4);
+        put_le(header + 8, i, 2);
+        put_le(header + 10, count, 2);
+        put_le(header + 12, encoded.stream, 2);
+        header[14] = static_cast<uint8_t>(encoded.inlet);
+        std::memcpy(header + ChunkHeaderSize, encoded.bytes.data() + begin, size);
+        messages.push_back(std::move(message));
+    }
+    return messages;
+}
+
+}
+
+using namespace matrix_channel;
+
+MatrixSender::MatrixSender(int stream_, int inlet_, EncodedCallback on_encoded_)
+    : stream(stream_)
+    , inlet(inlet_)
+    , on_encoded(std::move(on_encoded_))
+{
+    zstd_ctx = ZSTD_createCCtx();
+    worker = std::thread(&MatrixSender::run, this);
+}
+
+MatrixSender::~MatrixSender()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    ZSTD_freeCCtx(static_cast<ZSTD_CCtx*>(zstd_ctx));
+}
+
+void MatrixSender::submit(const Info& info, const uint8_t* data, const int64_t* dimstride, bool delta)
+{
+    if (!data || !info.valid()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.info = info;
+        pending.info.stream = stream;
+        pending.info.inlet = inlet;
+        pack(info, data, dimstride, pending.data);
+        pending_delta = delta;
+        has_pending = true;
+    }
+    cv.notify_one();
+}
+
+void MatrixSender::requestKey()
+{
+    key_requested = true;
+}
+
+void MatrixSender::run()
+{
+    Matrix working;
+    while (true) {
+        bool delta;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || has_pending; });
+            if (stopping) {
+                break;
+            }
+            // swap so neither side reallocates in steady state
+            std::swap(pending, working);
+            has_pending = false;
+            delta = pending_delta;
+        }
+        encode(working, delta, key_requested.exchange(false));
+    }
+}
+
+void MatrixSender::encode(Matrix& matrix, bool delta, bool key)
+{
+    const size_t size = matrix.data.size();
+    const bool use_delta = delta && !key && has_previous && previous.info.sameLayout(matrix.info);
+    const uint8_t* body = matrix.data.data();
+    if (use_delta) {
+        scratch.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            scratch[i] = matrix.data[i] ^ previous.data[i];
+        }
+        body = scratch.data();
+    }
+
+    const Info& info = matrix.info;
+    const size_t header_size = MatrixHeaderSize + 4 * info.dimcount;
+    Encoded encoded;
+    encoded.seq = seq++;
+    encoded.stream = stream;
+    encoded.inlet = inlet;
+    encoded.key = !use_delta;
+
+    uint8_t flags = use_delta ? Delta : 0;
+    const size_t bound = ZSTD_compressBound(size);
+    encoded.bytes.resize(header_size + bound);
+    const size_t compressed = ZSTD_compressCCtx(static_cast<ZSTD_CCtx*>(zstd_ctx), encoded.bytes.data() + header_size, bound, body, size, 1);
+    if (!ZSTD_isError(compressed) && compressed < size) {
+        flags |= Compressed;
+        encoded.bytes.resize(header_size + compressed);
+    } else {
+        // incompressible, noise or already compressed data
+        std::memcpy(encoded.bytes.data() + header_size, body, size);
+        encoded.bytes.resize(header_size + size);
+    }
+
+    uint8_t* header = encoded.bytes.data();
+    header[0] = Version;
+    header[1] = flags;
+    header[2] = static_cast<uint8_t>(info.type);
+    header[3] = static_cast<uint8_t>(info.planecount);
+    header[4] = static_cast<uint8_t>(info.dimcount);
+    header[5] = header[6] = header[7] = 0;
+    put_le(header + 8, size, 8);
+    for (int d = 0; d < info.dimcount; ++d) {
+        put_le(header + MatrixHeaderSize + 4 * d, static_cast<uint32_t>(info.dim[d]), 4);
+    }
+
+    on_encoded(encoded);
+
+    std::swap(previous, matrix);
+    has_previous = true;
+}
+
+MatrixReceiver::~MatrixReceiver()
+{
+    ZSTD_freeDCtx(static_cast<ZSTD_DCtx*>(zstd_ctx));
+}
+
+bool MatrixReceiver::accept(const std::byte* data, size_t size)
+{
+    if (!isMatrixMessage(data, size)) {
+        return false;
+    }
+    const auto* header = reinterpret_cast<const uint8_t*>(data);
+    const uint32_t seq = static_cast<uint32_t>(get_le(header + 4, 4));
+    const uint16_t index = static_cast<uint16_t>(get_le(header + 8, 2));
+    const uint16_t count = static_cast<uint16_t>(get_le(header + 10, 2));
+    const int id = static_cast<int>(get_le(header + 12, 2));
+
+    auto& stream = streams[id];
+    if (index == 0) {
+        stream.seq = seq;
+        stream.inlet = header[14];
+        stream.count = count;
+        stream.next_index = 0;
+        stream.assembly.clear();
+    } else if (seq != stream.seq || index != stream.next_index) {
+        // the start is missing, wait for the next matrix
+        stream.count = 0;
+        return false;
+    }
+    if (index >= stream.count) {
+        return false;
+    }
+
+    stream.assembly.insert(stream.assembly.end(), header + ChunkHeaderSize, header + size);
+    if (++stream.next_index < stream.count) {
+        return false;
+    }
+    stream.count = 0;
+    return decode(stream, id);
+}
+
+bool MatrixReceiver::decode(Stream& stream, int id)
+{
+    const std::vector<uint8_t>& bytes = stream.assembly;
+    if (bytes.size() < MatrixHeaderSize || bytes[0] != Version) {
+        WLOG_WARN("[Matrix] unsupported matrix message");
+        return false;
+    }
+
+    const uint8_t flags = bytes[1];
+    Info info;
+    info.type = static_cast<Type>(bytes[2]);
+    info.planecount = bytes[3];
+    info.dimcount = bytes[4];
+    info.stream = id;
+    info.inlet = stream.inlet;
+    const size_t size = get_le(bytes.data() + 8, 8);
+    const size_t header_size = MatrixHeaderSize + 4 * info.dimcount;
+    if (info.dimcount > MaxDims || bytes.size() < header_size) {
+        WLOG_WARN("[Matrix] truncated matrix header");
+        return false;
+    }
+    for (int d = 0; d < info.dimcount; ++d) {
+        info.dim[d] = static_cast<int32_t>(get_le(bytes.data() + MatrixHeaderSize + 4 * d, 4));
+    }
+    if (!info.valid() || info.byteSize() != size) {
+        WLOG_WARN("[Matrix] invalid matrix layout");
+        return false;
+    }
+
+    const uint8_t* body = bytes.data() + header_size;
+    size_t body_size = bytes.size() - header_size;
+    if (flags & Compressed) {
+        if (!zstd_ctx) {
+            zstd_ctx = ZSTD_createDCtx();
+        }
+        scratch.resize(size);
+        const size_t decompressed = ZSTD_decompressDCtx(static_cast<ZSTD_DCtx*>(zstd_ctx), scratch.data(), size, body, body_size);
+        if (ZSTD_isError(decompressed) || decompressed != size) {
+            WLOG_WARN("[Matrix] corrupt compressed matrix");
+            stream.has_previous = false;
+            return false;
+        }
+        body = scratch.data();
+        body_size = size;
+    }
+    if (body_size != size) {
+        WLOG_WARN("[Matrix] matrix size mismatch");
+        stream.has_previous = false;
+        return false;
+    }
+
+    Matrix& matrix = stream.previous;
+    if (flags & Delta) {
+        // the sender only sends deltas to peers that have the previous matrix
+        if (!stream.has_previous || !matrix.info.sameLayout(info)) {
+            WLOG_WARN("[Matrix] delta without its previous matrix");
+            return false;
+        }
+        for (size_t i = 0; i < size; ++i) {
+            matrix.data[i] ^= body[i];
+        }
+    } else {
+        matrix.info = info;
+        matrix.data.assign(body, body + size);
+    }
+    stream.has_previous = true;
+    completed = &matrix;
+    return true;
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Lossless matrices of any type and dimension over the DataChannel, for data
+// that must not go through the video codec (depth maps, masks, control data).
+//
+// A matrix is packed without row padding, optionally XORed against the
+// previous one of the stream (unchanged cells become zero bytes), compressed
+// with zstd level 1 when that makes it smaller, and split into binary messages
+// that fit the channel:
+//
+//   chunk:  u32 magic | u32 seq | u16 index | u16 count | u16 stream | u8 inlet | 1 reserved | payload
+//   matrix: u8 version | u8 flags | u8 type | u8 planecount | u8 dimcount | 3 reserved
+//           | u64 packed size | i32 dim[dimcount] | body
+//
+// The matrix bytes are the payloads of chunks 0 .. count-1 in order, all
+// integers little endian. Channels are reliable and ordered, so a delta only
+// needs the receiver to have seen the previous matrix; the sender tracks that
+// per peer and sends a full matrix to peers that have not. The stream id is
+// unique in the sender's session and keys the delta state, the inlet only
+// names the matrix on the receiving side.
+namespace matrix_channel {
+
+constexpr uint32_t Magic = 0x4d574e4d; // "MNWM"
+constexpr uint8_t Version = 1;
+constexpr int MaxDims = 32; // JIT_MATRIX_MAX_DIMCOUNT
+constexpr size_t ChunkHeaderSize = 16;
+constexpr int MaxStream = 65535; // the stream id is two bytes
+constexpr int MaxInlet = 255;
+
+enum Flags : uint8_t {
+    Compressed = 1,
+    Delta = 2
+};
+
+// the Jitter cell types
+enum class Type : uint8_t {
+    Char = 0,
+    Long = 1, // int32
+    Float32 = 2,
+    Float64 = 3
+};
+
+size_t typeSize(Type type);
+
+struct Info {
+    Type type = Type::Char;
+    int planecount = 1;
+    int dimcount = 0;
+    int32_t dim[MaxDims] = {};
+    int stream = 0; // the sending track, 0 to MaxStream
+    int inlet = 0; // the sending object's inlet, 0 to MaxInlet
+
+    size_t cellBytes() const { return typeSize(type) * planecount; }
+    size_t byteSize() const;
+    bool valid() const;
+    bool sameLayout(const Info& other) const;
+};
+
+struct Matrix {
+    Info info;
+    std::vector<uint8_t> data; // packed, dim[0] varies fastest
+};
+
+// between packed data and a matrix with byte strides per dimension, stride[0] is the cell size
+void pack(const Info& info, const uint8_t* source, const int64_t* dimstride, std::vector<uint8_t>& packed);
+void unpack(const Info& info, const uint8_t* packed, uint8_t* destination, const int64_t* dimstride);
+
+bool isMatrixMessage(const std::byte* data, size_t size);
+
+struct Encoded {
+    std::vector<uint8_t> bytes; // the matrix, still to be cut into chunks
+    uint32_t seq;
+    int stream;
+    int inlet;
+    bool key; // no delta, any peer can take it
+};
+
+// the binary messages for an encoded matrix, each at most max_message bytes
+std::vector<std::vector<std::byte>> chunks(const Encoded& encoded, size_t max_message);
+
+}
+
+// Encodes the matrices of one outgoing stream on a thread of its own. Like
+// TrackEncoder only the latest matrix is kept while the thread is busy.
+class MatrixSender {
+public:
+    // called on the sender thread
+    using EncodedCallback = std::function<void(const matrix_channel::Encoded& encoded)>;
+
+    // stream is the id on the wire, 0 to matrix_channel::MaxStream; inlet
+    // travels with it for the receiver's matrix name
+    MatrixSender(int stream, int inlet, EncodedCallback on_encoded);
+    ~MatrixSender();
+
+    // copies the matrix on the caller's thread; delta sends changes against the previous one
+    void submit(const matrix_channel::Info& info, const uint8_t* data, const int64_t* dimstride, bool delta);
+
+    // the next matrix goes out whole, for peers that missed the previous one
+    void requestKey();
+
+private:
+    void run();
+    void encode(matrix_channel::Matrix& matrix, bool delta, bool key);
+
+    const int stream;
+    const int inlet;
+    EncodedCallback on_encoded;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    bool has_pending = false;
+    bool pending_delta = false;
+    matrix_channel::Matrix pending;
+    std::atomic<bool> key_requested { true };
+    std::thread worker;
+
+    // sender thread only
+    matrix_channel::Matrix previous;
+    bool has_previous = false;
+    uint32_t seq = 0;
+    std::vector<uint8_t> scratch;
+    void* zstd_ctx = nullptr;
+};
+
+// Reassembles the matrices of one peer, fed from the channel's message
+// callback which libdatachannel never runs concurrently for a channel.
+class MatrixReceiver {
+public:
+    ~MatrixReceiver();
+
+    // true when the message completed a matrix, then available from matrix()
+    bool accept(const std::byte* data, size_t size);
+    const matrix_channel::Matrix& matrix() const { return *completed; }
+
+private:
+    struct Stream {
+        uint32_t seq = 0;
+        int inlet = 0;
+        uint16_t next_index = 0;
+        uint16_t count = 0;
+        std::vector<uint8_t> assembly;
+        matrix_channel::Matrix previous;
+        bool has_previous = false;
+    };
+
+    bool decode(Stream& stream, int index);
+
+    std::map<int, Stream> streams;
+    const matrix_channel::Matrix* completed = nullptr;
+    std::vector<uint8_t> scratch;
+    void* zstd_ctx = nullptr;
+};
@@ -1,5 +1,10 @@
 #include "c74_min.h"
 #include "webrtc_client.h"
+#include "signaling_server.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
 
 using namespace c74;
 using namespace c74::min;
@@ -11,11 +16,19 @@ public:
     MIN_TAGS { "video, utilities, developer" };
     MIN_RELATED { "jitter" };
 
+    // false while the members are built: the attribute setters run then with
+    // their defaults, which must not override settings shared by every object
+    bool m_constructed = false;
+
     inlet<> input_matrix { this, "(matrix) Input", "matrix" };
+    // one more per extra outgoing track, created from the tracks argument
+    std::vector<std::unique_ptr<inlet<>>> m_track_inlets;
     // inlet<> input_signal { this, "(signal) Input", "signal" }; // TODO
 
     // outlet<> output_signal { this, "(signal) Output", "signal" }; // TODO
     outlet<> output_dict { this, "(dict) Output", "dictionary" };
+    outlet<> output_matrix { this, "(matrix) Remote video, one jit_matrix per new frame named after the peer", "matrix" };
+    outlet<> output_data { this, "(matrix) Matrices peers send with transport data, named <peer>.data, <peer>.data<n> from their inlet n", "matrix" };
 
     argument<symbol> host_arg
     {
@@ -33,6 +46,267 @@ public:
         }
     };
 
+    argument<int> tracks_arg
+    {
+        this, "tracks", "Number of matrix inlets, each sent as its own video track over the same connection", MIN_ARGUMENT_FUNCTION
+        {
+            m_track_count = arg;
+        }
+    };
+
+    attribute<number> fps
+    {
+        this, "fps", 0.0,
+            description { "Maximum send frame rate, faster input is dropped before encoding. 0, the default, sends every frame." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_client) {
+                    m_client->set_max_fps(args[0], m_listener);
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<bool> skip_static
+    {
+        this, "skip_static", true,
+            description { "Skip encoding of unchanged matrices, the last picture is repeated once per second." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_client) {
+                    m_client->set_static_skip(args[0], m_listener);
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<symbol> transport
+    {
+        this, "transport", "video",
+            description { "How input matrices are sent. video encodes them as H264, data sends any type and dimension losslessly over the DataChannel, compressed, for depth maps, masks and control data." },
+            range { "video", "data" }
+    };
+
+    attribute<bool> delta
+    {
+        this, "delta", true,
+            description { "With transport data, send only what changed since the previous matrix. Cheaper for slowly changing data." }
+    };
+
+    attribute<bool> loop
+    {
+        this, "loop", true,
+            description { "Restart a played file when it ends." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_client) {
+                    m_client->set_loop(args[0]);
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<symbol> colormode
+    {
+        this, "colormode", "argb",
+            description { "Layout of 4 plane char input: argb, ayuv (jit.argb2ayuv) or uyvy (jit.argb2uyvy, half width)." },
+            range { "argb", "ayuv", "uyvy" }
+    };
+
+    attribute<numbers> send_dim
+    {
+        this, "send_dim", { 0.0, 0.0 },
+            description { "Encoded width and height. 0 0 sends at input size, a single 0 keeps the aspect ratio." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_client && args.size() >= 2) {
+                    m_client->set_send_dim(args[0], args[1], m_listener);
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<symbol> scale_quality
+    {
+        this, "scale_quality", "fast",
+            description { "Filter used when send_dim differs from the input size." },
+            range { "fast", "bilinear", "bicubic", "area", "lanczos" },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_client) {
+                    m_client->set_scale_quality(to_scale_quality(args[0]), m_listener);
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<bool> intra_refresh
+    {
+        this, "intra_refresh", false,
+            description { "Refresh the picture gradually with capped frame sizes instead of sending a large keyframe every second, for a flat latency. Keyframes are still sent to a joining peer or on request." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_client) {
+                    m_client->set_intra_refresh(args[0], m_listener);
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<number> send_rate
+    {
+        this, "send_rate", 10.0,
+            description { "Link rate in Mbit/s that video frames are paced at per peer, so a keyframe does not hold up the frames after it. A peer whose link falls behind loses frames up to the next keyframe without holding up the others. 0 sends unpaced. Shared by a session." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                double rate = std::max(0.0, static_cast<double>(args[0]));
+                if (m_constructed) {
+                    m_client->set_send_rate(rate * 1e6);
+                }
+                return { rate };
+            }
+        }
+    };
+
+    attribute<bool> lan
+    {
+        this, "lan", false,
+            description { "Fast connect when every peer is on the same LAN: host candidates only, all connections on lan_port, and the answer carries the candidates so no ICE messages follow it. Open the web page with ?lan so it waits for its candidates too. Applies to peers joining afterwards. Shared by a session." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_constructed) {
+                    m_client->set_lan_mode(args[0], static_cast<uint16_t>(static_cast<int>(lan_port)));
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<int> lan_port
+    {
+        this, "lan_port", 50000,
+            description { "UDP port all connections share in lan mode." },
+            range { 1, 65535 },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                int port = std::clamp(static_cast<int>(args[0]), 1, 65535);
+                if (m_constructed) {
+                    m_client->set_lan_mode(lan, static_cast<uint16_t>(port));
+                }
+                return { port };
+            }
+        }
+    };
+
+    attribute<symbol> decode_quality
+    {
+        this, "decode_quality", "full",
+            description { "Decode cost of incoming video: full, reduced (no deblocking, half size) or preview (lowres decode, quarter size). peer_quality overrides it per peer. Shared by a session." },
+            range { "full", "reduced", "preview" },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_constructed) {
+                    m_client->set_decode_quality(to_decode_quality(args[0]));
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<number> memory_budget
+    {
+        this, "memory_budget", 0,
+            description { "Megabytes for decoded frames, shared by every webrtc object. Past it low priority peers drop to a cheaper decode_quality first. 0 for no limit." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                double megabytes = std::max(0.0, static_cast<double>(args[0]));
+                if (m_constructed) {
+                    WebRTCClient::set_memory_budget(static_cast<size_t>(megabytes * 1024 * 1024));
+                }
+                return { megabytes };
+            }
+        }
+    };
+
+    attribute<symbol> loglevel
+    {
+        this, "loglevel", "info",
+            description { "Console and logfile verbosity, shared by every webrtc object. Repeated messages from the same place are limited to a few per second." },
+            range { "off", "error", "warning", "info", "debug" },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                symbol level = args[0];
+                if (m_constructed) {
+                    Logger::setLevel(to_log_level(level));
+                }
+                return args;
+            }
+        }
+    };
+
+    attribute<int> prewarm
+    {
+        this, "prewarm", 2,
+            description { "Peer connections and decoders kept ready while connected, so a joining browser gets video without waiting for them to be built. 0 builds them on join. Shared by a session." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                int count = std::max(0, static_cast<int>(args[0]));
+                if (m_constructed) {
+                    m_client->set_warm_pool(count);
+                }
+                return { count };
+            }
+        }
+    };
+
+    attribute<symbol> session
+    {
+        this, "session", "",
+            description { "Objects with the same session name share one WebSocket and one connection per browser, each adding its own tracks. Remote video and matrices come out of the first of them, the others can read the named matrices. Empty for a private connection." },
+            setter
+        {
+            MIN_FUNCTION
+            {
+                if (m_client) {
+                    attach(args[0]);
+                }
+                return args;
+            }
+        }
+    };
+
     webrtc(const atoms& args = {})
     {
         // initialize the webrtc client with the host, name, and room
@@ -42,46 +316,36 @@ public:
         if (args.size() > 1) {
             m_name = args[1];
         }
+        if (args.size() > 2) {
+            m_track_count = std::max(1, static_cast<int>(args[2]));
+        }
+        for (int i = 1; i < m_track_count; ++i) {
+            std::string label = "(matrix) Input for track " + std::to_string(i);
+            m_track_inlets.push_back(std::make_unique<inlet<>>(this, label.c_str(), "matrix"));
+        }
 
         // init WebRTCClient
-        m_client = std::make_unique<WebRTCClient>(
-            // callback log from WebRTCClient
-            [this](const std::string& webrtc_log) {
-                cout << webrtc_log << c74::min::endl;
-            },
-            // callback datachannel message from WebRTCClient
-            [this](const std::string& dc_message) {
-                pending_message = dc_message;
-                deferrer.set();
-            },
-            // callack argb from WebRTCClient's h264 decoder
-            [this](const std::string& remote_username, const uint8_t* argb, size_t size, int width, int height) {
-                if (size == 0) {
-                    return;
-                }
+        attach(session);
+        m_constructed = true;
+    };
 
-                symbol matrix_name(remote_username);
-                void* remote_matrix = max::jit_object_findregistered(matrix_name);
+    ~webrtc()
+    {
+        m_server.reset();
 
-                if (remote_matrix) {
-                    auto out_savelock = max::jit_object_method(remote_matrix, max::_jit_sym_lock, reinterpret_cast<void*>(1));
-                    max::t_jit_matrix_info info;
-                    max::jit_matrix_info_default(&info);
-                    info.dimcount = 2;
-                    info.dim[0] = width;
-                    info.dim[1] = height;
-                    info.planecount = 4;
-                    info.type = max::_jit_sym_char;
-                    max::jit_object_method(remote_matrix, max::_jit_sym_setinfo_ex, &info);
-                    max::jit_object_method(remote_matrix, max::_jit_sym_data, argb);
-                    // max::jit_object_method(remote_matrix, max::_jit_sym_matrix_calc); // doesn't work...
-                    // max::object_method(remote_matrix, max::gensym("bang")); // doesn't work...
-                    max::jit_object_method(remote_matrix, max::_jit_sym_lock, out_savelock);
-                }
-            });
-    };
+        // no more frames after this
+        m_client->remove_listener(m_listener);
+        m_client.reset();
 
-    ~webrtc() {
+        lock lock { m_matrix_mutex };
+        for (auto& [name, remote] : m_remote_matrices) {
+            free_matrix(remote);
+        }
+        m_remote_matrices.clear();
+        for (auto& [name, remote] : m_data_matrices) {
+            free_matrix(remote);
+        }
+        m_data_matrices.clear();
     };
 
     // A min::queue creates an element that,
@@ -93,25 +357,102 @@ public:
         {
 
             if (!pending_message.empty()) {
-                lock lock { m_mutex };
+                std::string message;
+                {
+                    lock lock { m_mutex };
+                    message = pending_message;
+                }
+                send_dictionary(message);
+            }
 
-                max::t_dictionary* t_dict = nullptr;
-                char* errstr = nullptr;
-                max::dictobj_dictionaryfromstring(&t_dict, pending_message.c_str(), 1, errstr);
+            return {};
+        }
+    };
 
-                if (errstr != NULL) {
-                    return {};
-                }
+    // announces the matrices written since the last run, the queue coalesces
+    // so a peer is output at most once per tick however fast frames arrive
+    queue<> frame_announcer
+    {
+        this,
+            MIN_FUNCTION
+        {
+            std::vector<symbol> updated;
+            {
+                lock lock { m_matrix_mutex };
+                updated.swap(m_updated_matrices);
+            }
+            for (auto& name : updated) {
+                output_matrix.send("jit_matrix", name);
+            }
+            return {};
+        }
+    };
 
-                max::t_symbol* dict_name = max::dictobj_namefromptr(t_dict);
-                t_dict = max::dictobj_register(t_dict, &dict_name);
-                // max::object_free(t_dict);
-                // max::dictionary_clear(t_dict);
-                lock.unlock();
-                output_dict.send("dictionary", dict_name->s_name);
-                max::dictobj_release(t_dict);
+    queue<> data_announcer
+    {
+        this,
+            MIN_FUNCTION
+        {
+            std::vector<symbol> updated;
+            {
+                lock lock { m_matrix_mutex };
+                updated.swap(m_updated_data);
+            }
+            for (auto& name : updated) {
+                output_data.send("jit_matrix", name);
             }
+            return {};
+        }
+    };
 
+    // log lines arrive on the Logger thread, the console is written from here
+    queue<> log_printer
+    {
+        this,
+            MIN_FUNCTION
+        {
+            std::deque<std::string> lines;
+            {
+                lock lock { m_log_mutex };
+                lines.swap(m_log_lines);
+            }
+            for (auto& line : lines) {
+                cout << line << c74::min::endl;
+            }
+            return {};
+        }
+    };
+
+    // creates the matrices frames have been waiting for and writes the latest
+    // frame of each into it
+    queue<> matrix_creator
+    {
+        this,
+            MIN_FUNCTION
+        {
+            lock lock { m_matrix_mutex };
+            for (auto& [name, pending] : m_pending_frames) {
+                auto& remote = m_remote_matrices[name];
+                remote.owned = create_matrix(name);
+                copy_frame(name, remote, pending.argb.data(), pending.width, pending.height);
+            }
+            for (auto& [name, pending] : m_pending_data) {
+                auto& remote = m_data_matrices[name];
+                remote.owned = create_matrix(name);
+                copy_data(name, remote, pending);
+            }
+            const bool frames = !m_pending_frames.empty();
+            const bool data = !m_pending_data.empty();
+            m_pending_frames.clear();
+            m_pending_data.clear();
+            lock.unlock();
+
+            if (frames) {
+                frame_announcer.set();
+            }
+            if (data) {
+                data_announcer.set();
+            }
             return {};
         }
     };
@@ -138,6 +479,169 @@ public:
         }
     };
 
+    message<threadsafe::no> serve
+    {
+        this, "serve", "Host the signaling room in Max instead of wsserver.ts: serve <port> [cert.pem key.pem], serve 0 picks a free port, serve with no port stops. Connect browsers and this object to ws://<host>:<port>/ws.", MIN_FUNCTION
+        {
+            if (args.empty()) {
+                m_server.reset();
+                return {};
+            }
+
+            if (!m_server) {
+                m_server = std::make_unique<SignalingServer>();
+            }
+
+            SignalingServer::Options options;
+            options.port = static_cast<uint16_t>(std::max(0, static_cast<int>(args[0])));
+            if (args.size() >= 3) {
+                char native_path[max::MAX_PATH_CHARS];
+                symbol cert = args[1];
+                max::path_nameconform(cert.c_str(), native_path, max::PATH_STYLE_NATIVE, max::PATH_TYPE_ABSOLUTE);
+                options.cert_pem_file = native_path;
+                symbol key = args[2];
+                max::path_nameconform(key.c_str(), native_path, max::PATH_STYLE_NATIVE, max::PATH_TYPE_ABSOLUTE);
+                options.key_pem_file = native_path;
+            }
+            if (!m_server->start(options)) {
+                m_server.reset();
+            }
+            return {};
+        }
+    };
+
+    message<threadsafe::no> record
+    {
+        this, "record", "Record sent and received video without re-encoding: record <file.mp4|file.mkv>, record with no file stops.", MIN_FUNCTION
+        {
+            if (!m_client) {
+                return {};
+            }
+            if (args.empty()) {
+                m_client->stop_recording();
+                return {};
+            }
+
+            symbol filename = args[0];
+            char native_path[max::MAX_PATH_CHARS];
+            max::path_nameconform(filename.c_str(), native_path, max::PATH_STYLE_NATIVE, max::PATH_TYPE_ABSOLUTE);
+            m_client->start_recording(native_path);
+            return {};
+        }
+    };
+
+    message<threadsafe::no> dump
+    {
+        this, "dump", "Dump each received stream before decoding, for offline replay with webrtc_replay: dump <file.mnwd> writes file-<peer>.mnwd, dump with no file stops.", MIN_FUNCTION
+        {
+            if (!m_client) {
+                return {};
+            }
+            if (args.empty()) {
+                m_client->set_frame_dump({});
+                return {};
+            }
+
+            symbol filename = args[0];
+            char native_path[max::MAX_PATH_CHARS];
+            max::path_nameconform(filename.c_str(), native_path, max::PATH_STYLE_NATIVE, max::PATH_TYPE_ABSOLUTE);
+            m_client->set_frame_dump(native_path);
+            return {};
+        }
+    };
+
+    message<threadsafe::no> play
+    {
+        this, "play", "Send an H264 file to the peers without re-encoding: play <file.mp4|file.mkv|file.h264>, play with no file stops. Incoming matrices are ignored while playing.", MIN_FUNCTION
+        {
+            if (!m_client) {
+                return {};
+            }
+            if (args.empty()) {
+                m_client->stop_file();
+                return {};
+            }
+
+            symbol filename = args[0];
+            char native_path[max::MAX_PATH_CHARS];
+            max::path_nameconform(filename.c_str(), native_path, max::PATH_STYLE_NATIVE, max::PATH_TYPE_ABSOLUTE);
+            m_client->play_file(native_path, loop);
+            return {};
+        }
+    };
+
+    message<threadsafe::no> peer_quality
+    {
+        this, "peer_quality", "Decode quality for one peer: peer_quality <name> <full|reduced|preview>.", MIN_FUNCTION
+        {
+            if (!m_client || args.size() < 2) {
+                return {};
+            }
+            symbol remote_name = args[0];
+            m_client->set_peer_decode_quality(remote_name, to_decode_quality(args[1]));
+            return {};
+        }
+    };
+
+    message<threadsafe::no> peer_priority
+    {
+        this, "peer_priority", "Which peers give way when memory_budget is reached: peer_priority <name> <low|normal|high>.", MIN_FUNCTION
+        {
+            if (!m_client || args.size() < 2) {
+                return {};
+            }
+            symbol remote_name = args[0];
+            symbol level = args[1];
+            FramePool::Priority priority = FramePool::Priority::Normal;
+            if (level == symbol("low")) {
+                priority = FramePool::Priority::Low;
+            } else if (level == symbol("high")) {
+                priority = FramePool::Priority::High;
+            }
+            m_client->set_peer_priority(remote_name, priority);
+            return {};
+        }
+    };
+
+    message<threadsafe::no> shm
+    {
+        this, "shm", "Also publish decoded peer video to POSIX shared memory for other local processes: shm <prefix> gives one ring per peer named /<prefix>.<peer>, cut to 31 characters with a hash of the full name when longer (the ring name is logged), shm with no prefix stops.", MIN_FUNCTION
+        {
+            if (m_client) {
+                m_client->set_shm_output(args.empty() ? std::string() : std::string(symbol(args[0])));
+            }
+            return {};
+        }
+    };
+
+    message<threadsafe::no> logfile
+    {
+        this, "logfile", "Also append log lines to a file: logfile <file>, logfile with no file closes it.", MIN_FUNCTION
+        {
+            if (args.empty()) {
+                Logger::instance().setFile("");
+                return {};
+            }
+
+            symbol filename = args[0];
+            char native_path[max::MAX_PATH_CHARS];
+            max::path_nameconform(filename.c_str(), native_path, max::PATH_STYLE_NATIVE, max::PATH_TYPE_ABSOLUTE);
+            Logger::instance().setFile(native_path);
+            return {};
+        }
+    };
+
+    message<threadsafe::no> stats
+    {
+        this, "stats", "Output a dictionary of join timings per peer (ms from the offer to connected, first keyframe sent and first frame shown) and the warm pool.", MIN_FUNCTION
+        {
+            if (m_client) {
+                send_dictionary(m_client->get_stats());
+            }
+            return {};
+        }
+    };
+
     message<> bang
     {
         this, "bang", "Post the greeting.",
@@ -160,38 +664,424 @@ public:
                 max::t_jit_matrix_info matrix_info;
                 void* matrix_data = nullptr;
 
+                auto savelock = max::object_method(jit_matrix, max::_jit_sym_lock, reinterpret_cast<void*>(1));
                 max::object_method(jit_matrix, max::_jit_sym_getinfo, &matrix_info);
                 max::object_method(jit_matrix, max::_jit_sym_getdata, &matrix_data);
 
-                long width = matrix_info.dim[0];
-                long height = matrix_info.dim[1];
-                long planes = matrix_info.planecount;
-                long size = matrix_info.size;
-                // uint8_t* argb_data = static_cast<uint8_t*>(matrix_data);
-
-                if (matrix_data && size > 0) {
-                    m_client->capture_matrix(
-                        static_cast<uint8_t*>(matrix_data),
-                        static_cast<int>(width),
-                        static_cast<int>(height),
-                        static_cast<int>(planes));
+                InputFrame input {};
+                if (transport.get() == symbol("data")) {
+                    matrix_channel::Info info;
+                    int64_t dimstride[matrix_channel::MaxDims];
+                    if (matrix_data && matrix_info.size > 0 && data_info(matrix_info, info, dimstride)) {
+                        m_client->send_matrix(info, static_cast<const uint8_t*>(matrix_data), dimstride, m_first_track + inlet, static_cast<int>(inlet), delta);
+                    }
+                } else if (matrix_data && matrix_info.size > 0 && matrix_info.dimcount >= 2 && input_format(matrix_info, input)) {
+                    m_unsupported_type = nullptr;
+                    input.data = static_cast<const uint8_t*>(matrix_data);
+                    input.height = static_cast<int>(matrix_info.dim[1]);
+                    input.stride = static_cast<int>(matrix_info.dimstride[1]);
+                    m_client->capture_matrix(input, m_first_track + inlet);
                 }
+                max::object_method(jit_matrix, max::_jit_sym_lock, savelock);
             }
             return {};
         }
     };
 
 private:
+    // joins the named session, or a private client for an empty name
+    void attach(const symbol& name)
+    {
+        if (m_client) {
+            m_client->remove_listener(m_listener);
+        }
+        m_client = WebRTCClient::acquire_session(name.empty() ? std::string() : std::string(name));
+
+        auto attachment = m_client->add_listener(
+            {
+                // callback log from WebRTCClient
+                [this](const std::string& webrtc_log) {
+                    {
+                        lock lock { m_log_mutex };
+                        // the console fell far behind, the oldest lines give way
+                        if (m_log_lines.size() >= MaxPendingLogLines) {
+                            m_log_lines.pop_front();
+                        }
+                        m_log_lines.push_back(webrtc_log);
+                    }
+                    log_printer.set();
+                },
+                // callback datachannel message from WebRTCClient
+                [this](const std::string& dc_message) {
+                    pending_message = dc_message;
+                    deferrer.set();
+                },
+                // callack argb from WebRTCClient's h264 decoder
+                [this](const std::string& remote_username, const uint8_t* argb, size_t size, int width, int height) {
+                    write_remote_frame(remote_username, argb, size, width, height);
+                },
+                // matrices from the DataChannel
+                [this](const std::string& remote_username, const matrix_channel::Matrix& matrix) {
+                    write_remote_data(remote_username, matrix);
+                },
+            },
+            m_track_count);
+        m_listener = attachment.id;
+        m_first_track = attachment.first_track;
+
+        m_client->set_max_fps(fps, m_listener);
+        m_client->set_static_skip(skip_static, m_listener);
+        numbers dim = send_dim;
+        if (dim.size() >= 2) {
+            m_client->set_send_dim(static_cast<int>(dim[0]), static_cast<int>(dim[1]), m_listener);
+        }
+        m_client->set_scale_quality(to_scale_quality(scale_quality), m_listener);
+        m_client->set_intra_refresh(intra_refresh, m_listener);
+
+        // the session's own settings come from its owner, or from a later set on
+        // any of its objects; one joining must not undo them with its defaults
+        if (attachment.owner) {
+            m_client->set_send_rate(send_rate * 1e6);
+            m_client->set_lan_mode(lan, static_cast<uint16_t>(static_cast<int>(lan_port)));
+            m_client->set_decode_quality(to_decode_quality(decode_quality));
+            m_client->set_warm_pool(prewarm);
+        }
+    }
+
+    // JSON text out of the dictionary outlet
+    void send_dictionary(const std::string& text)
+    {
+        max::t_dictionary* t_dict = nullptr;
+        char* errstr = nullptr;
+        max::dictobj_dictionaryfromstring(&t_dict, text.c_str(), 1, errstr);
+
+        if (errstr != NULL) {
+            return;
+        }
+
+        max::t_symbol* dict_name = max::dictobj_namefromptr(t_dict);
+        t_dict = max::dictobj_register(t_dict, &dict_name);
+        output_dict.send("dictionary", dict_name->s_name);
+        max::dictobj_release(t_dict);
+    }
+
+    // A matrix written from network threads, created and registered on the
+    // main thread. A name another jit.matrix already holds is written through
+    // that one, looked up on every write since its owner may free it
+    struct RemoteMatrix {
+        void* owned = nullptr; // from jit_object_new, the only pointer freed here
+        int width = 0;
+        int height = 0;
+    };
+
+    struct PendingFrame {
+        std::vector<uint8_t> argb;
+        int width = 0;
+        int height = 0;
+    };
+
+    // main thread only
+    static void* create_matrix(const std::string& name)
+    {
+        if (max::jit_object_findregistered(symbol(name))) {
+            return nullptr;
+        }
+        max::t_jit_matrix_info info;
+        max::jit_matrix_info_default(&info);
+        info.type = max::_jit_sym_char;
+        info.planecount = 4;
+        info.dimcount = 2;
+        info.dim[0] = 1;
+        info.dim[1] = 1;
+        void* matrix = max::jit_object_new(max::_jit_sym_jit_matrix, &info);
+        if (matrix) {
+            max::jit_object_register(matrix, symbol(name));
+        }
+        return matrix;
+    }
+
+    static void free_matrix(RemoteMatrix& remote)
+    {
+        if (remote.owned) {
+            max::jit_object_unregister(remote.owned);
+            max::jit_object_free(remote.owned);
+            remote.owned = nullptr;
+        }
+    }
+
+    static void* matrix_of(const RemoteMatrix& remote, const std::string& name)
+    {
+        return remote.owned ? remote.owned : max::jit_object_findregistered(symbol(name));
+    }
+
+    // under m_matrix_mutex
+    void copy_frame(const std::string& name, RemoteMatrix& remote, const uint8_t* argb, int width, int height)
+    {
+        void* matrix = matrix_of(remote, name);
+        if (!matrix) {
+            return;
+        }
+
+        auto savelock = max::jit_object_method(matrix, max::_jit_sym_lock, reinterpret_cast<void*>(1));
+        max::t_jit_matrix_info info;
+        max::jit_object_method(matrix, max::_jit_sym_getinfo, &info);
+        if (remote.width != width || remote.height != height || info.dim[0] != width || info.dim[1] != height) {
+            info.type = max::_jit_sym_char;
+            info.planecount = 4;
+            info.dimcount = 2;
+            info.dim[0] = width;
+            info.dim[1] = height;
+            max::jit_object_method(matrix, max::_jit_sym_setinfo, &info);
+            max::jit_object_method(matrix, max::_jit_sym_getinfo, &info);
+            remote.width = width;
+            remote.height = height;
+        }
+
+        // rows in the matrix may be padded, copy them one by one
+        uint8_t* data = nullptr;
+        max::jit_object_method(matrix, max::_jit_sym_getdata, &data);
+        if (data && info.dim[0] == width && info.dim[1] == height) {
+            const size_t row_bytes = static_cast<size_t>(width) * 4;
+            for (int y = 0; y < height; ++y) {
+                std::memcpy(data + y * info.dimstride[1], argb + y * row_bytes, row_bytes);
+            }
+        }
+        max::jit_object_method(matrix, max::_jit_sym_lock, savelock);
+
+        // a handful of peers at most, a linear search is fine
+        symbol announced(name);
+        if (std::find(m_updated_matrices.begin(), m_updated_matrices.end(), announced) == m_updated_matrices.end()) {
+            m_updated_matrices.push_back(announced);
+        }
+    }
+
+    // runs on the decoder thread
+    void write_remote_frame(const std::string& remote_username, const uint8_t* argb, size_t size, int width, int height)
+    {
+        if (size < static_cast<size_t>(width) * height * 4 || width <= 0 || height <= 0) {
+            return;
+        }
+
+        lock lock { m_matrix_mutex };
+        auto it = m_remote_matrices.find(remote_username);
+        if (it == m_remote_matrices.end()) {
+            // Jitter objects are created on the main thread, the frame waits for it
+            auto& pending = m_pending_frames[remote_username];
+            pending.argb.assign(argb, argb + static_cast<size_t>(width) * height * 4);
+            pending.width = width;
+            pending.height = height;
+            lock.unlock();
+            matrix_creator.set();
+            return;
+        }
+        copy_frame(remote_username, it->second, argb, width, height);
+        lock.unlock();
+        frame_announcer.set();
+    }
+
+    // under m_matrix_mutex; the matrix follows the sent layout
+    void copy_data(const std::string& name, RemoteMatrix& remote, const matrix_channel::Matrix& matrix)
+    {
+        void* target = matrix_of(remote, name);
+        if (!target) {
+            return;
+        }
+
+        max::t_symbol* types[] = { max::_jit_sym_char, max::_jit_sym_long, max::_jit_sym_float32, max::_jit_sym_float64 };
+        const matrix_channel::Info& sent = matrix.info;
+        auto savelock = max::jit_object_method(target, max::_jit_sym_lock, reinterpret_cast<void*>(1));
+        max::t_jit_matrix_info info;
+        max::jit_object_method(target, max::_jit_sym_getinfo, &info);
+        max::t_symbol* type = types[static_cast<int>(sent.type)];
+        bool same = info.type == type && info.planecount == sent.planecount && info.dimcount == sent.dimcount;
+        for (int d = 0; same && d < sent.dimcount; ++d) {
+            same = info.dim[d] == sent.dim[d];
+        }
+        if (!same) {
+            info.type = type;
+            info.planecount = sent.planecount;
+            info.dimcount = sent.dimcount;
+            for (int d = 0; d < sent.dimcount; ++d) {
+                info.dim[d] = sent.dim[d];
+            }
+            max::jit_object_method(target, max::_jit_sym_setinfo, &info);
+            max::jit_object_method(target, max::_jit_sym_getinfo, &info);
+        }
+
+        uint8_t* data = nullptr;
+        max::jit_object_method(target, max::_jit_sym_getdata, &data);
+        if (data && info.dimcount == sent.dimcount) {
+            int64_t dimstride[matrix_channel::MaxDims];
+            for (int d = 0; d < sent.dimcount; ++d) {
+                dimstride[d] = info.dimstride[d];
+            }
+            matrix_channel::unpack(sent, matrix.data.data(), data, dimstride);
+        }
+        max::jit_object_method(target, max::_jit_sym_lock, savelock);
+
+        symbol announced(name);
+        if (std::find(m_updated_data.begin(), m_updated_data.end(), announced) == m_updated_data.end()) {
+            m_updated_data.push_back(announced);
+        }
+    }
+
+    // runs on the DataChannel thread
+    void write_remote_data(const std::string& remote_username, const matrix_channel::Matrix& matrix)
+    {
+        std::string name = remote_username + ".data";
+        if (matrix.info.inlet > 0) {
+            name += std::to_string(matrix.info.inlet);
+        }
+
+        lock lock { m_matrix_mutex };
+        auto it = m_data_matrices.find(name);
+        if (it == m_data_matrices.end()) {
+            // every matrix counts, so the latest one waits for the main thread
+            m_pending_data[name] = matrix;
+            lock.unlock();
+            matrix_creator.set();
+            return;
+        }
+        copy_data(name, it->second, matrix);
+        lock.unlock();
+        data_announcer.set();
+    }
+
+    // any Jitter matrix for transport data
+    static bool data_info(const max::t_jit_matrix_info& jit_info, matrix_channel::Info& info, int64_t* dimstride)
+    {
+        if (jit_info.type == max::_jit_sym_char) {
+            info.type = matrix_channel::Type::Char;
+        } else if (jit_info.type == max::_jit_sym_long) {
+            info.type = matrix_channel::Type::Long;
+        } else if (jit_info.type == max::_jit_sym_float32) {
+            info.type = matrix_channel::Type::Float32;
+        } else if (jit_info.type == max::_jit_sym_float64) {
+            info.type = matrix_channel::Type::Float64;
+        } else {
+            return false;
+        }
+        info.planecount = static_cast<int>(jit_info.planecount);
+        info.dimcount = static_cast<int>(std::min<long>(jit_info.dimcount, matrix_channel::MaxDims));
+        for (int d = 0; d < info.dimcount; ++d) {
+            info.dim[d] = static_cast<int32_t>(jit_info.dim[d]);
+            dimstride[d] = jit_info.dimstride[d];
+        }
+        return info.valid();
+    }
+
+    static LogLevel to_log_level(const symbol& name)
+    {
+        if (name == symbol("off"))
+            return LogLevel::Off;
+        if (name == symbol("error"))
+            return LogLevel::Error;
+        if (name == symbol("warning"))
+            return LogLevel::Warning;
+        if (name == symbol("debug"))
+            return LogLevel::Debug;
+        return LogLevel::Info;
+    }
+
+    static DecodeQuality to_decode_quality(const symbol& name)
+    {
+        if (name == symbol("reduced"))
+            return DecodeQuality::Reduced;
+        if (name == symbol("preview"))
+            return DecodeQuality::Preview;
+        return DecodeQuality::Full;
+    }
+
+    static ScaleQuality to_scale_quality(const symbol& name)
+    {
+        if (name == symbol("bilinear"))
+            return ScaleQuality::Bilinear;
+        if (name == symbol("bicubic"))
+            return ScaleQuality::Bicubic;
+        if (name == symbol("area"))
+            return ScaleQuality::Area;
+        if (name == symbol("lanczos"))
+            return ScaleQuality::Lanczos;
+        return ScaleQuality::Fast;
+    }
+
+    // maps the matrix layout onto an encoder input format, false for unsupported matrices
+    bool input_format(const max::t_jit_matrix_info& info, InputFrame& input)
+    {
+        const long planes = info.planecount;
+        input.width = static_cast<int>(info.dim[0]);
+
+        if (info.type == max::_jit_sym_char) {
+            if (planes == 4) {
+                if (colormode.get() == symbol("ayuv")) {
+                    input.format = InputFormat::AYUV;
+                } else if (colormode.get() == symbol("uyvy")) {
+                    // each cell carries two pixels
+                    input.format = InputFormat::UYVY;
+                    input.width *= 2;
+                } else {
+                    input.format = InputFormat::ARGB;
+                }
+                return true;
+            }
+            if (planes == 2) {
+                input.format = InputFormat::UYVY;
+                return true;
+            }
+            if (planes == 1) {
+                input.format = InputFormat::Gray;
+                return true;
+            }
+        } else if (info.type == max::_jit_sym_float32) {
+            if (planes == 4) {
+                input.format = InputFormat::ARGBFloat;
+                return true;
+            }
+            if (planes == 1) {
+                input.format = InputFormat::GrayFloat;
+                return true;
+            }
+        }
+
+        // reported once until the format changes, not on every frame
+        if (planes != m_unsupported_planes || info.type != m_unsupported_type) {
+            m_unsupported_planes = planes;
+            m_unsupported_type = info.type;
+            WLOG_WARN("unsupported matrix: %ld plane %s", planes, info.type->s_name);
+        }
+        return false;
+    }
+
     // Max members
     c74::min::mutex m_mutex;
     symbol m_host { "ws://localhost:5173/ws" };
     symbol m_name { "Max#0" };
+    int m_track_count = 1;
 
     // WebRTCClient members
-    std::unique_ptr<WebRTCClient> m_client;
+    std::shared_ptr<WebRTCClient> m_client;
+    std::unique_ptr<SignalingServer> m_server;
+    int m_listener = 0;
+    int m_first_track = 0;
+    long m_unsupported_planes = 0;
+    max::t_symbol* m_unsupported_type = nullptr;
 
     std::string pending_message;
 
+    c74::min::mutex m_log_mutex;
+    std::deque<std::string> m_log_lines;
+    static constexpr size_t MaxPendingLogLines = 200;
+
+    // remote video, guarded by m_matrix_mutex
+    c74::min::mutex m_matrix_mutex;
+    std::unordered_map<std::string, RemoteMatrix> m_remote_matrices;
+    std::unordered_map<std::string, PendingFrame> m_pending_frames;
+    std::vector<symbol> m_updated_matrices;
+    // matrices from the DataChannel, by registered name
+    std::unordered_map<std::string, RemoteMatrix> m_data_matrices;
+    std::unordered_map<std::string, matrix_channel::Matrix> m_pending_data;
+    std::vector<symbol> m_updated_data;
+
     // message<> maxclass_setup
     // {
     //     this, "maxclass_setup",
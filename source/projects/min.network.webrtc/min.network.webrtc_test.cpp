@@ -37,3 +37,392 @@ SCENARIO("object produces correct output")
 		// }
 	}
 }
+
+#include "clock_sync.h"
+#include "h264_utils.h"
+#include "matrix_channel.h"
+#include "peer_sender.h"
+#include "shm_ring.h"
+#include <unistd.h>
+
+SCENARIO("the capture time SEI round trips through an access unit")
+{
+	// an IDR slice with bytes that look like start codes once escaped
+	const std::vector<uint8_t> slice { 0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x00, 0x00, 0x03, 0x01, 0x10 };
+
+	GIVEN("capture times with runs of zero bytes and with all bits set")
+	{
+		const std::vector<int64_t> times { 0, 1, int64_t(0x0000000100000000), 1700000000123456, INT64_MAX };
+
+		THEN("the SEI goes in front of the slice and reads back unchanged")
+		{
+			for (int64_t wall_us : times) {
+				std::vector<uint8_t> unit = slice;
+				h264::insertCaptureTime(unit, wall_us);
+				auto nals = h264::split(unit.data(), unit.size());
+				REQUIRE(nals.size() == 2);
+				REQUIRE(nals[0].type == h264::Sei);
+				REQUIRE(nals[1].type == h264::IdrSlice);
+
+				int64_t read = -1;
+				REQUIRE(h264::readCaptureTime(unit.data(), unit.size(), read));
+				REQUIRE(read == wall_us);
+			}
+		}
+	}
+
+	GIVEN("an access unit without the SEI")
+	{
+		int64_t read = -1;
+		REQUIRE_FALSE(h264::readCaptureTime(slice.data(), slice.size(), read));
+	}
+}
+
+SCENARIO("the SPS reader finds the cropped picture size")
+{
+	GIVEN("a baseline SPS for 1920x1088 cropped to 1080 lines")
+	{
+		const std::vector<uint8_t> sps { 0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x28, 0xda, 0x01, 0xe0, 0x08, 0x9f, 0x95 };
+		int width = 0;
+		int height = 0;
+		REQUIRE(h264::spsSize(sps.data(), sps.size(), width, height));
+		REQUIRE(width == 1920);
+		REQUIRE(height == 1080);
+
+		WHEN("it is cut short")
+		{
+			THEN("parsing fails instead of reading past the end")
+			{
+				REQUIRE_FALSE(h264::spsSize(sps.data(), 11, width, height));
+			}
+		}
+	}
+}
+
+// a pong as the peer would answer a ping sent at t0, its clock offset_us ahead
+static std::string pong(int64_t t0, int64_t one_way_us, int64_t offset_us)
+{
+	const int64_t t1 = t0 + one_way_us + offset_us;
+	return "{\"minClock\":\"pong\",\"t0\":" + std::to_string(t0) + ",\"t1\":" + std::to_string(t1) + ",\"t2\":" + std::to_string(t1) + "}";
+}
+
+SCENARIO("the clock offset comes from the exchange with the shortest round trip")
+{
+	GIVEN("a peer whose clock is one second ahead")
+	{
+		ClockSync clock;
+		const int64_t offset = 1000000;
+		REQUIRE_FALSE(clock.hasOffset());
+
+		WHEN("a symmetric exchange of 10 ms completes")
+		{
+			clock.handle(pong(ClockSync::wallUs() - 10000, 5000, offset));
+
+			THEN("the offset is found within the time the test took")
+			{
+				REQUIRE(clock.hasOffset());
+				REQUIRE(std::abs(clock.getOffsetUs() - offset) < 5000);
+				REQUIRE(clock.getRttUs() >= 10000);
+			}
+
+			AND_WHEN("a slow, lopsided exchange follows")
+			{
+				clock.handle(pong(ClockSync::wallUs() - 400000, 390000, offset));
+
+				THEN("the fast one still decides")
+				{
+					REQUIRE(std::abs(clock.getOffsetUs() - offset) < 5000);
+					REQUIRE(clock.getRttUs() < 400000);
+				}
+			}
+		}
+
+		WHEN("a ping arrives")
+		{
+			THEN("it is answered with a pong carrying its t0")
+			{
+				const std::string reply = clock.handle("{\"minClock\":\"ping\",\"t0\":42}");
+				REQUIRE(ClockSync::isClockMessage(reply));
+				REQUIRE(reply.find("\"pong\"") != std::string::npos);
+				REQUIRE(reply.find("\"t0\":42") != std::string::npos);
+			}
+		}
+	}
+}
+
+// collects what a MatrixSender encodes, on the test thread
+class EncodedMatrices {
+public:
+	void operator()(const matrix_channel::Encoded& encoded)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		received.push_back(encoded);
+		cv.notify_one();
+	}
+
+	matrix_channel::Encoded next()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		REQUIRE(cv.wait_for(lock, std::chrono::seconds(5), [this] { return !received.empty(); }));
+		auto encoded = received.front();
+		received.pop_front();
+		return encoded;
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<matrix_channel::Encoded> received;
+};
+
+// feeds the chunks to the receiver, true when the last one completed the matrix
+static bool deliver(MatrixReceiver& receiver, const matrix_channel::Encoded& encoded, size_t max_message)
+{
+	auto messages = matrix_channel::chunks(encoded, max_message);
+	bool complete = false;
+	for (size_t i = 0; i < messages.size(); ++i) {
+		REQUIRE(matrix_channel::isMatrixMessage(messages[i].data(), messages[i].size()));
+		REQUIRE(messages[i].size() <= max_message);
+		complete = receiver.accept(messages[i].data(), messages[i].size());
+		REQUIRE(complete == (i + 1 == messages.size()));
+	}
+	return complete;
+}
+
+SCENARIO("matrices survive packing, chunking and XOR deltas")
+{
+	GIVEN("a 2 plane float32 matrix with padded rows")
+	{
+		matrix_channel::Info info;
+		info.type = matrix_channel::Type::Float32;
+		info.planecount = 2;
+		info.dimcount = 2;
+		info.dim[0] = 37;
+		info.dim[1] = 23;
+		// rows padded to 16 bytes, as jit.matrix does
+		const int64_t row_stride = (info.cellBytes() * info.dim[0] + 15) & ~int64_t(15);
+		const int64_t dimstride[2] = { static_cast<int64_t>(info.cellBytes()), row_stride };
+		std::vector<uint8_t> source(row_stride * info.dim[1], 0xEE);
+		auto cell = [&](int x, int y) { return reinterpret_cast<float*>(source.data() + y * row_stride + x * info.cellBytes()); };
+		for (int y = 0; y < info.dim[1]; ++y) {
+			for (int x = 0; x < info.dim[0]; ++x) {
+				cell(x, y)[0] = x * 0.5f;
+				cell(x, y)[1] = -y * 1.25f;
+			}
+		}
+
+		WHEN("packed and unpacked")
+		{
+			std::vector<uint8_t> packed;
+			matrix_channel::pack(info, source.data(), dimstride, packed);
+			REQUIRE(packed.size() == info.byteSize());
+			std::vector<uint8_t> restored(source.size(), 0xEE);
+			matrix_channel::unpack(info, packed.data(), restored.data(), dimstride);
+
+			THEN("the cells come back and the padding is left alone")
+			{
+				REQUIRE(restored == source);
+			}
+		}
+
+		WHEN("sent whole and then as a delta, in messages smaller than the matrix")
+		{
+			EncodedMatrices encoded;
+			MatrixSender sender(300, 1, std::ref(encoded));
+			MatrixReceiver receiver;
+			const size_t max_message = 1000;
+
+			sender.submit(info, source.data(), dimstride, true);
+			auto first = encoded.next();
+			REQUIRE(first.key);
+			REQUIRE(first.stream == 300);
+			REQUIRE(first.inlet == 1);
+			REQUIRE(deliver(receiver, first, max_message));
+
+			cell(5, 7)[0] = 1e6f;
+			cell(36, 22)[1] = 3.0f;
+			sender.submit(info, source.data(), dimstride, true);
+			auto second = encoded.next();
+			REQUIRE_FALSE(second.key);
+			REQUIRE(deliver(receiver, second, max_message));
+
+			THEN("the receiver rebuilds the latest matrix")
+			{
+				const auto& matrix = receiver.matrix();
+				REQUIRE(matrix.info.sameLayout(info));
+				REQUIRE(matrix.info.stream == 300);
+				REQUIRE(matrix.info.inlet == 1);
+				std::vector<uint8_t> packed;
+				matrix_channel::pack(info, source.data(), dimstride, packed);
+				REQUIRE(matrix.data == packed);
+			}
+		}
+	}
+}
+
+SCENARIO("a peer's frames leave at its link rate")
+{
+	rtc::PeerConnection pc;
+	// never opened, so frames are counted as sent without reaching the network
+	auto track = pc.addTrack(rtc::Description::Video("test"));
+	auto frame = std::make_shared<const std::vector<uint8_t>>(10000, 0);
+
+	GIVEN("a sender paced at 100 kB/s")
+	{
+		PeerSender sender(800000, [](int) {});
+
+		WHEN("a second of video is pushed at once")
+		{
+			for (int i = 0; i < 10; ++i) {
+				sender.push({ track, frame, static_cast<uint32_t>(i * 3000), 0, i == 0 });
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+			THEN("only what the bucket allows has left after 300 ms")
+			{
+				auto stats = sender.getStats();
+				REQUIRE(stats.sent_frames >= 1);
+				REQUIRE(stats.sent_frames <= 5);
+				REQUIRE(stats.dropped_frames == 0);
+				REQUIRE(stats.queued_frames >= 4);
+			}
+		}
+
+		WHEN("more than the queue holds is pushed")
+		{
+			for (int i = 0; i < 40; ++i) {
+				sender.push({ track, frame, static_cast<uint32_t>(i * 3000), 0, i == 0 });
+			}
+			auto dropped = sender.getStats().dropped_frames;
+
+			THEN("the overflow is dropped and later frames wait for a keyframe")
+			{
+				REQUIRE(dropped > 0);
+				sender.push({ track, frame, 40 * 3000, 0, false });
+				REQUIRE(sender.getStats().dropped_frames == dropped + 1);
+			}
+		}
+	}
+
+	GIVEN("an unpaced sender")
+	{
+		PeerSender sender(0, [](int) {});
+		for (int i = 0; i < 10; ++i) {
+			sender.push({ track, frame, static_cast<uint32_t>(i * 3000), 0, i == 0 });
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		THEN("everything leaves right away")
+		{
+			REQUIRE(sender.getStats().sent_frames == 10);
+		}
+	}
+}
+
+SCENARIO("the packets of a frame are spread over the link rate")
+{
+	auto packets = [] {
+		rtc::message_vector messages;
+		for (int i = 0; i < 10; ++i) {
+			auto message = std::make_shared<rtc::Message>();
+			message->resize(1000);
+			messages.push_back(message);
+		}
+		return messages;
+	};
+	int sent = 0;
+	auto count = [&sent](rtc::message_ptr) { ++sent; };
+
+	GIVEN("a pacer at 100 kB/s")
+	{
+		PacketPacer pacer(800000);
+		auto messages = packets();
+		const auto start = std::chrono::steady_clock::now();
+		pacer.outgoing(messages, count);
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+
+		THEN("ten 1000 byte packets take about 90 ms and all of them are sent")
+		{
+			REQUIRE(sent == 10);
+			REQUIRE(messages.empty());
+			REQUIRE(elapsed >= std::chrono::milliseconds(80));
+		}
+	}
+
+	GIVEN("a pacer set to 0")
+	{
+		PacketPacer pacer(800000);
+		pacer.setRate(0);
+		auto messages = packets();
+		const auto start = std::chrono::steady_clock::now();
+		pacer.outgoing(messages, count);
+
+		THEN("the packets leave at once")
+		{
+			REQUIRE(sent == 10);
+			REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20));
+		}
+	}
+}
+
+SCENARIO("shared memory readers never take a torn frame for a good one")
+{
+	const std::string name = shm::ringName("mnwtest", std::to_string(getpid()));
+	const int width = 8;
+	const int height = 4;
+	std::vector<uint8_t> pixels(width * height * 4);
+
+	GIVEN("a ring of two slots with a reader")
+	{
+		SharedFrameRing ring(name, 2);
+		std::fill(pixels.begin(), pixels.end(), 1);
+		REQUIRE(ring.write(pixels.data(), width, height, 100));
+		SharedFrameReader reader;
+		REQUIRE(reader.open(name));
+
+		WHEN("the newest frame is read while nothing writes")
+		{
+			std::vector<uint8_t> seen;
+			bool good = reader.read([&](const SharedFrameReader::Frame& frame) {
+				REQUIRE(frame.format == shm::FormatARGB);
+				REQUIRE(frame.width == width);
+				REQUIRE(frame.height == height);
+				REQUIRE(frame.timestamp_us == 100);
+				seen.assign(frame.data, frame.data + frame.size);
+			},
+				0);
+
+			THEN("it is intact")
+			{
+				REQUIRE(good);
+				REQUIRE(seen == pixels);
+			}
+		}
+
+		WHEN("the writer laps the reader's slot during the read")
+		{
+			std::fill(pixels.begin(), pixels.end(), 2);
+			bool good = reader.read([&](const SharedFrameReader::Frame&) {
+				REQUIRE(ring.write(pixels.data(), width, height, 200));
+				REQUIRE(ring.write(pixels.data(), width, height, 300));
+			},
+				0);
+
+			THEN("the seqlock reports the frame as torn")
+			{
+				REQUIRE_FALSE(good);
+			}
+
+			AND_WHEN("the reader tries again")
+			{
+				int64_t timestamp = 0;
+				REQUIRE(reader.read([&](const SharedFrameReader::Frame& frame) { timestamp = frame.timestamp_us; }, 0));
+
+				THEN("it gets the newest frame")
+				{
+					REQUIRE(timestamp == 300);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,217 @@
+#include "peer_sender.h"
+#include <algorithm>
+#include <chrono>
+
+using Clock = std::chrono::steady_clock;
+
+static int64_t steadyUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// half a second of backlog at the link rate, past that the picture is too late anyway
+static constexpr double MaxQueueSeconds = 0.5;
+static constexpr size_t MinQueuedBytes = 256 * 1024;
+static constexpr size_t UnpacedQueuedBytes = 4 << 20;
+// what the bucket may save up while idle, a frame interval
+static constexpr double BurstSeconds = 0.033;
+// what a track's packets may go out back to back, a few packets at usual rates
+static constexpr double PacketBurstSeconds = 0.005;
+
+PeerSender::PeerSender(double bits_per_second, KeyframeCallback request_keyframe_)
+    : request_keyframe(std::move(request_keyframe_))
+    , rate(std::max(0.0, bits_per_second / 8))
+{
+    worker = std::thread(&PeerSender::run, this);
+}
+
+PeerSender::~PeerSender()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+size_t PeerSender::maxQueuedBytes() const
+{
+    const double bytes_per_second = rate;
+    if (bytes_per_second <= 0) {
+        return UnpacedQueuedBytes;
+    }
+    return std::max(MinQueuedBytes, static_cast<size_t>(bytes_per_second * MaxQueueSeconds));
+}
+
+void PeerSender::push(Frame frame)
+{
+    if (!frame.data || frame.data->empty() || frame.index < 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (frame.index >= static_cast<int>(needs_keyframe.size())) {
+            needs_keyframe.resize(frame.index + 1, false);
+            waiting_since_us.resize(frame.index + 1, 0);
+        }
+
+        const size_t size = frame.data->size();
+        if (needs_keyframe[frame.index] && !frame.keyframe) {
+            ++dropped_frames;
+            // no regular IDR came, with intra refresh none ever does
+            const int64_t now = steadyUs();
+            if (now - waiting_since_us[frame.index] < KeyframeWaitUs) {
+                return;
+            }
+            waiting_since_us[frame.index] = now;
+            keyframe_requests.push_back(frame.index);
+        } else {
+            // a late IDR makes room by replacing what of its track is still waiting, none of that is needed any more
+            if (frame.keyframe && queued_bytes + size > maxQueuedBytes()) {
+                for (auto it = queue.begin(); it != queue.end();) {
+                    if (it->index == frame.index) {
+                        queued_bytes -= it->data->size();
+                        ++dropped_frames;
+                        it = queue.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            if (!queue.empty() && queued_bytes + size > maxQueuedBytes()) {
+                ++dropped_frames;
+                if (!needs_keyframe[frame.index]) {
+                    needs_keyframe[frame.index] = true;
+                    waiting_since_us[frame.index] = steadyUs();
+                }
+            } else {
+                needs_keyframe[frame.index] = false;
+                queued_bytes += size;
+                queue.push_back(std::move(frame));
+            }
+        }
+    }
+    cv.notify_one();
+}
+
+void PeerSender::setRate(double bits_per_second)
+{
+    rate = std::max(0.0, bits_per_second / 8);
+    cv.notify_one();
+}
+
+PeerSender::Stats PeerSender::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return { queue.size(), queued_bytes, sent_frames, dropped_frames };
+}
+
+void PeerSender::run()
+{
+    double tokens = 0; // bytes, negative while the last frame is still draining
+    auto refilled = Clock::now();
+    std::vector<int> requests;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] { return stopping || !queue.empty() || !keyframe_requests.empty(); });
+        if (stopping) {
+            break;
+        }
+
+        if (!keyframe_requests.empty()) {
+            requests.swap(keyframe_requests);
+            lock.unlock();
+            for (int index : requests) {
+                request_keyframe(index);
+            }
+            requests.clear();
+            lock.lock();
+            continue;
+        }
+
+        const double bytes_per_second = rate;
+        if (bytes_per_second > 0) {
+            const auto now = Clock::now();
+            tokens = std::min(bytes_per_second * BurstSeconds,
+                tokens + bytes_per_second * std::chrono::duration<double>(now - refilled).count());
+            refilled = now;
+            if (tokens < 0) {
+                // woken early by a rate change, a stop or a keyframe request
+                cv.wait_for(lock, std::chrono::duration<double>(-tokens / bytes_per_second));
+                continue;
+            }
+        }
+
+        Frame frame = std::move(queue.front());
+        queue.pop_front();
+        queued_bytes -= frame.data->size();
+        lock.unlock();
+
+        // a frame may be larger than the bucket, the following ones then wait for it to drain
+        tokens -= frame.data->size();
+        if (frame.track->isOpen()) {
+            frame.track->sendFrame(reinterpret_cast<const rtc::byte*>(frame.data->data()), frame.data->size(), frame.timestamp);
+        }
+
+        lock.lock();
+        ++sent_frames;
+    }
+}
+
+PacketPacer::PacketPacer(double bits_per_second)
+    : rate(std::max(0.0, bits_per_second / 8))
+    , refilled(Clock::now())
+{
+}
+
+void PacketPacer::setRate(double bits_per_second)
+{
+    rate = std::max(0.0, bits_per_second / 8);
+    cv.notify_all();
+}
+
+void PacketPacer::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+    }
+    cv.notify_all();
+}
+
+void PacketPacer::outgoing(rtc::message_vector& messages, const rtc::message_callback& send)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto& message : messages) {
+        if (!message) {
+            continue;
+        }
+        bool paced = false;
+        while (!closed) {
+            const double bytes_per_second = rate;
+            if (bytes_per_second <= 0) {
+                paced = false;
+                break;
+            }
+            paced = true;
+            const auto now = Clock::now();
+            tokens = std::min(bytes_per_second * PacketBurstSeconds,
+                tokens + bytes_per_second * std::chrono::duration<double>(now - refilled).count());
+            refilled = now;
+            if (tokens >= 0) {
+                break;
+            }
+            // woken early by a rate change or close
+            cv.wait_for(lock, std::chrono::duration<double>(-tokens / bytes_per_second));
+        }
+        if (paced) {
+            tokens -= message->size();
+        }
+        send(std::move(message));
+    }
+    messages.clear();
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "rtc/rtc.hpp"
+
+// Sends one peer's video on a thread of its own, so packetizing and
+// encrypting for one peer never holds up the others. Frames leave the queue
+// at the peer's link rate (a token bucket), so the backlog of a slow link
+// builds up here, where whole frames can be dropped. The PacketPacer in each
+// track's chain then spreads the packets of a frame over the same rate.
+//
+// push() never blocks. A frame that does not fit the bounded queue is dropped
+// together with everything after it on that track up to the next keyframe.
+// The track then waits for the encoder's next regular IDR, or one a PLI
+// brings; only when none came within KeyframeWaitUs is a keyframe requested,
+// so one slow peer does not force IDRs on everyone.
+class PeerSender {
+public:
+    struct Frame {
+        std::shared_ptr<rtc::Track> track;
+        std::shared_ptr<const std::vector<uint8_t>> data; // shared by all peers
+        uint32_t timestamp;
+        int index; // the track's feed
+        bool keyframe;
+    };
+
+    // called on the sender thread
+    using KeyframeCallback = std::function<void(int index)>;
+
+    // longer than the encoder's regular keyframe interval
+    static constexpr int64_t KeyframeWaitUs = 1500000;
+
+    // bits_per_second <= 0 sends without pacing
+    PeerSender(double bits_per_second, KeyframeCallback request_keyframe);
+    ~PeerSender();
+
+    void push(Frame frame);
+    void setRate(double bits_per_second);
+
+    struct Stats {
+        size_t queued_frames;
+        size_t queued_bytes;
+        uint64_t sent_frames;
+        uint64_t dropped_frames;
+    };
+    Stats getStats();
+
+private:
+    void run();
+    size_t maxQueuedBytes() const;
+
+    KeyframeCallback request_keyframe;
+    std::atomic<double> rate; // bytes per second
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Frame> queue;
+    size_t queued_bytes = 0;
+    std::vector<bool> needs_keyframe; // by feed
+    std::vector<int64_t> waiting_since_us; // by feed, steady clock, since the drop or the last request
+    std::vector<int> keyframe_requests; // feeds to ask, handed to the sender thread
+    bool stopping = false;
+    uint64_t sent_frames = 0;
+    uint64_t dropped_frames = 0;
+    std::thread worker;
+};
+
+// Last handler of a video track's chain: sends the RTP packets of a frame at
+// the link rate instead of in one burst, so a keyframe does not overrun the
+// bottleneck queue. Waits on the calling thread, which is the peer's
+// PeerSender thread, so the peer's other tracks wait behind it like on the link.
+class PacketPacer : public rtc::MediaHandler {
+public:
+    // bits_per_second <= 0 sends without pacing
+    explicit PacketPacer(double bits_per_second);
+
+    void setRate(double bits_per_second);
+    // sends what is still waiting without pacing, for a track being closed
+    void close();
+
+    void outgoing(rtc::message_vector& messages, const rtc::message_callback& send) override;
+
+private:
+    std::atomic<double> rate; // bytes per second
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool closed = false;
+    double tokens = 0; // bytes, negative while the last packet is still draining
+    std::chrono::steady_clock::time_point refilled;
+};
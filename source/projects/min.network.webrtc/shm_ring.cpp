@@ -0,0 +1,274 @@
+#include "shm_ring.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "logger.h"
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <ctime>
+#elif defined(__APPLE__) && __has_include(<os/os_sync_wait_on_address.h>)
+#include <os/os_sync_wait_on_address.h>
+#include <os/clock.h>
+#define SHM_HAS_OS_SYNC 1
+#endif
+
+namespace shm {
+
+std::string ringName(const std::string& prefix, const std::string& peer)
+{
+    std::string name = "/" + prefix + "." + peer;
+    for (size_t i = 1; i < name.size(); ++i) {
+        if (!std::isalnum(static_cast<unsigned char>(name[i])) && name[i] != '-' && name[i] != '_' && name[i] != '.') {
+            name[i] = '_';
+        }
+    }
+    if (name.size() <= MaxNameLength) {
+        return name;
+    }
+    // hashed before sanitising, "a b" and "a_b" are different peers
+    uint32_t hash = 0x811c9dc5u;
+    for (char c : "/" + prefix + "." + peer) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 0x01000193u;
+    }
+    char suffix[10];
+    std::snprintf(suffix, sizeof(suffix), "-%08x", hash);
+    name.resize(MaxNameLength - 9);
+    return name + suffix;
+}
+
+size_t slotStride(uint32_t slot_bytes)
+{
+    return sizeof(SlotHeader) + ((static_cast<size_t>(slot_bytes) + 63) & ~static_cast<size_t>(63));
+}
+
+size_t mappingSize(uint32_t slot_count, uint32_t slot_bytes)
+{
+    return sizeof(RingHeader) + slot_count * slotStride(slot_bytes);
+}
+
+void wake(std::atomic<uint32_t>* word)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#elif defined(SHM_HAS_OS_SYNC)
+    if (__builtin_available(macOS 14.4, *)) {
+        os_sync_wake_by_address_all(word, sizeof(uint32_t), OS_SYNC_WAKE_BY_ADDRESS_SHARED);
+    }
+#else
+    (void)word;
+#endif
+}
+
+void wait(std::atomic<uint32_t>* word, uint32_t seen, int64_t timeout_us)
+{
+#if defined(__linux__)
+    timespec timeout { static_cast<time_t>(timeout_us / 1000000), static_cast<long>(timeout_us % 1000000) * 1000 };
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, seen, timeout_us < 0 ? nullptr : &timeout, nullptr, 0);
+    return;
+#elif defined(SHM_HAS_OS_SYNC)
+    if (__builtin_available(macOS 14.4, *)) {
+        if (timeout_us < 0) {
+            os_sync_wait_on_address(word, seen, sizeof(uint32_t), OS_SYNC_WAIT_ON_ADDRESS_SHARED);
+        } else {
+            os_sync_wait_on_address_with_timeout(word, seen, sizeof(uint32_t), OS_SYNC_WAIT_ON_ADDRESS_SHARED,
+                OS_CLOCK_MACH_ABSOLUTE_TIME, static_cast<uint64_t>(timeout_us) * 1000);
+        }
+        return;
+    }
+#endif
+    // no shared wait primitive, poll the word
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+    while (word->load(std::memory_order_acquire) == seen) {
+        if (timeout_us >= 0 && std::chrono::steady_clock::now() >= deadline) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+}
+
+SharedFrameRing::SharedFrameRing(std::string name, uint32_t slot_count)
+    : name(std::move(name))
+    , slot_count(std::max(2u, slot_count))
+{
+}
+
+SharedFrameRing::~SharedFrameRing()
+{
+    release(shm::Closed);
+}
+
+bool SharedFrameRing::create(uint32_t slot_bytes)
+{
+    // a leftover of a crashed writer would otherwise keep its old size
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        WLOG_ERROR("shm_open %s failed: %s", name.c_str(), strerror(errno));
+        return false;
+    }
+
+    const size_t size = shm::mappingSize(slot_count, slot_bytes);
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        WLOG_ERROR("ftruncate %s failed: %s", name.c_str(), strerror(errno));
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        WLOG_ERROR("mmap %s failed: %s", name.c_str(), strerror(errno));
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    mapping = memory;
+    mapping_size = size;
+    // the new object is zero filled, so the slot locks start even
+    header = new (mapping) shm::RingHeader;
+    header->slot_count = slot_count;
+    header->slot_bytes = slot_bytes;
+    header->version = shm::Version;
+    header->state.store(shm::Live, std::memory_order_relaxed);
+    header->notify.store(0, std::memory_order_relaxed);
+    header->write_seq.store(0, std::memory_order_relaxed);
+    // readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = shm::Magic;
+    return true;
+}
+
+void SharedFrameRing::release(shm::State state)
+{
+    if (!header) {
+        return;
+    }
+    header->state.store(state, std::memory_order_release);
+    header->notify.fetch_add(1, std::memory_order_release);
+    shm::wake(&header->notify);
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+    header = nullptr;
+    if (state == shm::Closed) {
+        shm_unlink(name.c_str());
+    }
+}
+
+bool SharedFrameRing::write(const uint8_t* argb, int width, int height, int64_t timestamp_us)
+{
+    const size_t size = static_cast<size_t>(width) * height * 4;
+    if (failed || size == 0 || size > UINT32_MAX) {
+        return false;
+    }
+
+    if (!header || header->slot_bytes < size) {
+        // some headroom so a slowly growing stream does not recreate every frame
+        const uint32_t slot_bytes = static_cast<uint32_t>(std::min<size_t>(UINT32_MAX, size + size / 4));
+        release(shm::Replaced);
+        if (!create(slot_bytes)) {
+            failed = true;
+            return false;
+        }
+    }
+
+    const uint64_t seq = header->write_seq.load(std::memory_order_relaxed);
+    auto* slot = reinterpret_cast<shm::SlotHeader*>(
+        static_cast<uint8_t*>(mapping) + sizeof(shm::RingHeader) + (seq % slot_count) * shm::slotStride(header->slot_bytes));
+
+    const uint32_t lock = slot->lock.load(std::memory_order_relaxed);
+    slot->lock.store(lock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->format = shm::FormatARGB;
+    slot->seq = seq;
+    slot->timestamp_us = timestamp_us;
+    slot->width = static_cast<uint32_t>(width);
+    slot->height = static_cast<uint32_t>(height);
+    slot->stride = static_cast<uint32_t>(width) * 4;
+    slot->size = static_cast<uint32_t>(size);
+    std::memcpy(reinterpret_cast<uint8_t*>(slot) + sizeof(shm::SlotHeader), argb, size);
+
+    slot->lock.store(lock + 2, std::memory_order_release);
+    header->write_seq.store(seq + 1, std::memory_order_release);
+    header->notify.fetch_add(1, std::memory_order_release);
+    shm::wake(&header->notify);
+    return true;
+}
+
+SharedFrameReader::~SharedFrameReader()
+{
+    close();
+}
+
+bool SharedFrameReader::open(const std::string& shm_name)
+{
+    close();
+    name = shm_name;
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(shm::RingHeader)) {
+        ::close(fd);
+        return false;
+    }
+    // the futex word is only read, waiting on it needs no write access
+    void* memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    auto* ring = static_cast<shm::RingHeader*>(memory);
+    if (ring->magic != shm::Magic || ring->version != shm::Version
+        || shm::mappingSize(ring->slot_count, ring->slot_bytes) > static_cast<size_t>(info.st_size)) {
+        munmap(memory, info.st_size);
+        return false;
+    }
+    mapping = memory;
+    mapping_size = info.st_size;
+    header = ring;
+    last_seq = 0;
+    return true;
+}
+
+void SharedFrameReader::close()
+{
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+    mapping = nullptr;
+    mapping_size = 0;
+    header = nullptr;
+}
+
+bool SharedFrameReader::reopenIfReplaced()
+{
+    if (header && header->state.load(std::memory_order_acquire) == shm::Live) {
+        return true;
+    }
+    return !name.empty() && open(name);
+}
+
+shm::SlotHeader* SharedFrameReader::slotAt(uint64_t seq) const
+{
+    return reinterpret_cast<shm::SlotHeader*>(
+        static_cast<uint8_t*>(mapping) + sizeof(shm::RingHeader) + (seq % header->slot_count) * shm::slotStride(header->slot_bytes));
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Decoded frames published to other processes on the host through a POSIX
+// shared memory object holding a ring of fixed size slots.
+//
+//   [RingHeader][SlotHeader|pixels][SlotHeader|pixels]...
+//
+// The single writer fills slot (seq % slot_count), each slot is a seqlock:
+// lock is odd while it is written. A reader takes the newest frame from
+// write_seq, reads it in place and checks lock again afterwards. After each
+// frame notify is bumped and waiters are woken, with a shared futex on Linux
+// and os_sync_wake_by_address on macOS 14.4+. Elsewhere readers poll notify.
+// When a frame outgrows the slots the writer marks the ring Replaced and
+// creates a bigger one under the same name, readers then reopen it.
+namespace shm {
+
+constexpr uint32_t Magic = 0x524e574d; // "MNWR"
+constexpr uint32_t Version = 1;
+constexpr uint32_t FormatARGB = 0x42475241; // 'ARGB', 4 bytes per pixel
+
+enum State : uint32_t {
+    Live = 0,
+    Replaced = 1,
+    Closed = 2
+};
+
+struct alignas(64) RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_bytes; // pixel bytes a slot holds
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> notify; // futex word
+    std::atomic<uint64_t> write_seq; // frames written, the newest is number write_seq - 1
+};
+
+struct alignas(64) SlotHeader {
+    std::atomic<uint32_t> lock;
+    uint32_t format;
+    uint64_t seq;
+    int64_t timestamp_us; // capture time on our wall clock when the sender embeds it, else arrival
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t size;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+    "shared atomics must be lock free");
+
+size_t slotStride(uint32_t slot_bytes);
+size_t mappingSize(uint32_t slot_count, uint32_t slot_bytes);
+
+// both sides, timeout_us < 0 waits forever
+void wake(std::atomic<uint32_t>* word);
+void wait(std::atomic<uint32_t>* word, uint32_t seen, int64_t timeout_us);
+
+// "/<prefix>.<peer>" with characters outside [A-Za-z0-9._-] replaced by '_'.
+// Longer than MaxNameLength it is cut and ends in '-' and the FNV-1a hash of
+// the full name in hex, so peers sharing a long prefix keep distinct rings
+constexpr size_t MaxNameLength = 31; // macOS
+std::string ringName(const std::string& prefix, const std::string& peer);
+
+}
+
+class SharedFrameRing {
+public:
+    // name is a POSIX shm name such as "/mnw.peer", at most shm::MaxNameLength characters
+    SharedFrameRing(std::string name, uint32_t slot_count = 4);
+    ~SharedFrameRing();
+
+    SharedFrameRing(const SharedFrameRing&) = delete;
+    SharedFrameRing& operator=(const SharedFrameRing&) = delete;
+
+    // one writer thread; the ring is created, or recreated bigger, on demand
+    bool write(const uint8_t* argb, int width, int height, int64_t timestamp_us);
+
+    const std::string& getName() const { return name; }
+
+private:
+    bool create(uint32_t slot_bytes);
+    void release(shm::State state);
+
+    std::string name;
+    uint32_t slot_count;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    shm::RingHeader* header = nullptr;
+    bool failed = false;
+};
+
+// For consumers: maps a ring published by SharedFrameRing.
+class SharedFrameReader {
+public:
+    struct Frame {
+        const uint8_t* data; // in the shared mapping, only valid inside the callback
+        uint32_t format;
+        int width;
+        int height;
+        int stride;
+        size_t size;
+        uint64_t seq;
+        int64_t timestamp_us;
+    };
+
+    ~SharedFrameReader();
+
+    bool open(const std::string& name);
+    void close();
+    bool isOpen() const { return header != nullptr; }
+
+    // Waits up to timeout_us for a frame newer than the last one read and hands
+    // it to fn in place. Returns true when fn saw a frame that was not
+    // overwritten meanwhile; a false after fn ran means the data may be torn.
+    template <class Fn>
+    bool read(Fn fn, int64_t timeout_us)
+    {
+        if (!reopenIfReplaced()) {
+            return false;
+        }
+        uint32_t seen = header->notify.load(std::memory_order_acquire);
+        uint64_t newest = header->write_seq.load(std::memory_order_acquire);
+        if (newest <= last_seq) {
+            shm::wait(&header->notify, seen, timeout_us);
+            newest = header->write_seq.load(std::memory_order_acquire);
+            if (newest <= last_seq) {
+                return false;
+            }
+        }
+
+        const uint64_t seq = newest - 1;
+        auto* slot = slotAt(seq);
+        const uint32_t before = slot->lock.load(std::memory_order_acquire);
+        if ((before & 1) != 0 || slot->seq != seq) {
+            return false;
+        }
+        fn(Frame {
+            reinterpret_cast<const uint8_t*>(slot) + sizeof(shm::SlotHeader),
+            slot->format,
+            static_cast<int>(slot->width),
+            static_cast<int>(slot->height),
+            static_cast<int>(slot->stride),
+            slot->size,
+            slot->seq,
+            slot->timestamp_us });
+        std::atomic_thread_fence(std::memory_order_acquire);
+        last_seq = newest;
+        return slot->lock.load(std::memory_order_relaxed) == before;
+    }
+
+private:
+    bool reopenIfReplaced();
+    shm::SlotHeader* slotAt(uint64_t seq) const;
+
+    std::string name;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    shm::RingHeader* header = nullptr;
+    uint64_t last_seq = 0;
+};
@@ -0,0 +1,361 @@
+#include "signaling_server.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <rtc/websocket.hpp>
+#include <nlohmann/json.hpp>
+#include "logger.h"
+
+using nlohmann::json;
+
+// every call site is rate limited on its own
+#define SERVER_LOG(message) WLOG_INFO("[SignalingServer]: %s", std::string(message).c_str())
+
+static std::string url_decode(const std::string& str)
+{
+    std::string out;
+    out.reserve(str.size());
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] == '%' && i + 2 < str.size() && std::isxdigit(static_cast<unsigned char>(str[i + 1])) && std::isxdigit(static_cast<unsigned char>(str[i + 2]))) {
+            out += static_cast<char>(std::stoi(str.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        } else if (str[i] == '+') {
+            out += ' ';
+        } else {
+            out += str[i];
+        }
+    }
+    return out;
+}
+
+// "/ws?id=a&username=b" -> { id: a, username: b }
+static std::unordered_map<std::string, std::string> query_params(const std::string& path)
+{
+    std::unordered_map<std::string, std::string> params;
+    size_t start = path.find('?');
+    if (start == std::string::npos) {
+        return params;
+    }
+    ++start;
+    while (start < path.size()) {
+        size_t end = path.find('&', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string pair = path.substr(start, end - start);
+        size_t eq = pair.find('=');
+        if (eq != std::string::npos) {
+            params[url_decode(pair.substr(0, eq))] = url_decode(pair.substr(eq + 1));
+        }
+        start = end + 1;
+    }
+    return params;
+}
+
+class SignalingServer::State : public std::enable_shared_from_this<State> {
+public:
+    void onClient(std::shared_ptr<rtc::WebSocket> ws);
+    void onOpen(std::shared_ptr<rtc::WebSocket> ws);
+    void onMessage(const std::string& id, const std::string& text);
+    void onClosed(const std::string& id);
+    void closeAll();
+    size_t clientCount();
+
+private:
+    struct Client {
+        std::shared_ptr<rtc::WebSocket> ws;
+        std::string address;
+        std::string username;
+        std::string role;
+        int64_t time_joined; // ms since epoch, browsers compare it for polite negotiation
+    };
+
+    json describe(const std::string& id, const Client& client) const;
+    void send(const std::shared_ptr<rtc::WebSocket>& ws, const json& message);
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Client> clients;
+    // sockets that have not finished the handshake yet, kept alive until then
+    std::vector<std::shared_ptr<rtc::WebSocket>> pending;
+};
+
+SignalingServer::SignalingServer()
+    : state(std::make_shared<State>())
+{
+}
+
+SignalingServer::~SignalingServer()
+{
+    stop();
+}
+
+bool SignalingServer::start(const Options& options)
+{
+    stop();
+
+    rtc::WebSocketServer::Configuration config;
+    config.port = options.port;
+    if (!options.bind_address.empty()) {
+        config.bindAddress = options.bind_address;
+    }
+    if (!options.cert_pem_file.empty() && !options.key_pem_file.empty()) {
+        config.enableTls = true;
+        config.certificatePemFile = options.cert_pem_file;
+        config.keyPemFile = options.key_pem_file;
+    }
+
+    try {
+        server = std::make_unique<rtc::WebSocketServer>(config);
+    } catch (const std::exception& e) {
+        SERVER_LOG("cannot listen on port " + std::to_string(options.port) + ": " + e.what());
+        return false;
+    }
+
+    std::weak_ptr<State> weak_state = state;
+    server->onClient([weak_state](std::shared_ptr<rtc::WebSocket> ws) {
+        if (auto state = weak_state.lock()) {
+            state->onClient(std::move(ws));
+        }
+    });
+
+    SERVER_LOG(std::string(config.enableTls ? "wss" : "ws") + " signaling on port " + std::to_string(server->port()));
+    return true;
+}
+
+void SignalingServer::stop()
+{
+    if (!server) {
+        return;
+    }
+    server->stop();
+    server.reset();
+    state->closeAll();
+    SERVER_LOG("signaling stopped");
+}
+
+uint16_t SignalingServer::getPort() const
+{
+    return server ? server->port() : 0;
+}
+
+size_t SignalingServer::getClientCount()
+{
+    return state->clientCount();
+}
+
+size_t SignalingServer::State::clientCount()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return clients.size();
+}
+
+void SignalingServer::State::closeAll()
+{
+    std::unordered_map<std::string, Client> closing;
+    std::vector<std::shared_ptr<rtc::WebSocket>> closing_pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing.swap(clients);
+        closing_pending.swap(pending);
+    }
+    for (auto& [id, client] : closing) {
+        client.ws->resetCallbacks();
+        client.ws->close();
+    }
+    for (auto& ws : closing_pending) {
+        ws->resetCallbacks();
+        ws->close();
+    }
+}
+
+void SignalingServer::State::onClient(std::shared_ptr<rtc::WebSocket> ws)
+{
+    std::weak_ptr<State> weak_state = shared_from_this();
+    std::weak_ptr<rtc::WebSocket> wws = ws;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(ws);
+    }
+    // path and query are known once the handshake is done
+    ws->onOpen([weak_state, wws]() {
+        auto state = weak_state.lock();
+        auto ws = wws.lock();
+        if (state && ws) {
+            state->onOpen(ws);
+        }
+    });
+    ws->onClosed([weak_state, wws]() {
+        if (auto state = weak_state.lock()) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            auto ws = wws.lock();
+            state->pending.erase(std::remove(state->pending.begin(), state->pending.end(), ws), state->pending.end());
+        }
+    });
+}
+
+json SignalingServer::State::describe(const std::string& id, const Client& client) const
+{
+    return {
+        { "id", id },
+        { "address", client.address },
+        { "properties", { { "username", client.username }, { "role", client.role }, { "timeJoined", client.time_joined } } }
+    };
+}
+
+void SignalingServer::State::send(const std::shared_ptr<rtc::WebSocket>& ws, const json& message)
+{
+    try {
+        if (ws && ws->isOpen()) {
+            ws->send(message.dump());
+        }
+    } catch (const std::exception& e) {
+        WLOG_WARN("signaling send failed: %s", e.what());
+    }
+}
+
+void SignalingServer::State::onOpen(std::shared_ptr<rtc::WebSocket> ws)
+{
+    auto params = query_params(ws->path().value_or(""));
+    const std::string id = params["id"];
+    Client client {
+        ws,
+        ws->remoteAddress().value_or(""),
+        params["username"],
+        params["role"],
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+    };
+
+    if (id.empty() || client.username.empty() || client.role.empty()) {
+        SERVER_LOG("rejecting client without id, username or role");
+        ws->close();
+        return;
+    }
+
+    std::vector<std::shared_ptr<rtc::WebSocket>> others;
+    json list = json::array();
+    std::shared_ptr<rtc::WebSocket> replaced;
+    size_t total;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.erase(std::remove(pending.begin(), pending.end(), ws), pending.end());
+        if (auto it = clients.find(id); it != clients.end()) {
+            // same id reconnecting, the new socket wins
+            replaced = it->second.ws;
+            clients.erase(it);
+        }
+        for (auto& [other_id, other] : clients) {
+            others.push_back(other.ws);
+            list.push_back(describe(other_id, other));
+        }
+        clients[id] = client;
+        total = clients.size();
+    }
+    if (replaced) {
+        replaced->resetCallbacks();
+        replaced->close();
+    }
+
+    std::weak_ptr<State> weak_state = shared_from_this();
+    std::weak_ptr<rtc::WebSocket> wws = ws;
+    ws->onMessage([weak_state, id](rtc::message_variant data) {
+        auto state = weak_state.lock();
+        if (state && std::holds_alternative<std::string>(data)) {
+            state->onMessage(id, std::get<std::string>(data));
+        }
+    });
+    ws->onClosed([weak_state, id, wws]() {
+        auto state = weak_state.lock();
+        if (!state) {
+            return;
+        }
+        // a replaced socket must not remove its successor
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            auto it = state->clients.find(id);
+            if (it == state->clients.end() || it->second.ws != wws.lock()) {
+                return;
+            }
+        }
+        state->onClosed(id);
+    });
+
+    const json description = describe(id, client);
+    for (auto& other : others) {
+        send(other, { { "signalingType", "ClientEnter" }, { "content", description } });
+    }
+    send(ws, { { "signalingType", "ClientEntered" }, { "content", description } });
+    send(ws, { { "signalingType", "Clients" }, { "content", list } });
+
+    SERVER_LOG("client " + id + " " + client.username + " " + client.address + " join, totalClient: " + std::to_string(total));
+}
+
+void SignalingServer::State::onMessage(const std::string& id, const std::string& text)
+{
+    json message;
+    try {
+        message = json::parse(text);
+    } catch (const std::exception& e) {
+        WLOG_WARN("signaling: bad message from %s: %s", id.c_str(), e.what());
+        return;
+    }
+
+    const std::string type = message.value("signalingType", "");
+    if (type != "Offer" && type != "Answer" && type != "Ice") {
+        return;
+    }
+    const std::string target = message.value("target", "");
+
+    std::shared_ptr<rtc::WebSocket> target_ws;
+    std::string sender_name;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto sender = clients.find(id);
+        auto it = clients.find(target);
+        if (sender == clients.end() || it == clients.end()) {
+            return;
+        }
+        sender_name = sender->second.username;
+        target_ws = it->second.ws;
+    }
+
+    json relayed = {
+        { "signalingType", type },
+        { "sender", id },
+        { "target", target },
+        { "content", message.value("content", json::object()) }
+    };
+    if (type != "Ice") {
+        relayed["senderName"] = sender_name;
+    }
+    WLOG_DEBUG("%s sending %s to %s", sender_name.c_str(), type.c_str(), target.c_str());
+    send(target_ws, relayed);
+}
+
+void SignalingServer::State::onClosed(const std::string& id)
+{
+    json description;
+    std::vector<std::shared_ptr<rtc::WebSocket>> others;
+    size_t total;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = clients.find(id);
+        if (it == clients.end()) {
+            return;
+        }
+        description = describe(id, it->second);
+        clients.erase(it);
+        for (auto& [other_id, other] : clients) {
+            others.push_back(other.ws);
+        }
+        total = clients.size();
+    }
+
+    // notifiy other clients this ws is exit
+    for (auto& other : others) {
+        send(other, { { "signalingType", "ClientExit" }, { "content", description } });
+    }
+    SERVER_LOG("client " + id + " disconnected, totalClient: " + std::to_string(total));
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <rtc/websocketserver.hpp>
+
+// In process replacement for wsserver.ts. Clients connect to
+// ws://host:port/ws?id=..&username=..&role=.. and get the same
+// ClientEntered/Clients/ClientEnter/ClientExit announcements, Offer/Answer/Ice
+// are relayed to their target with sender and senderName filled in.
+class SignalingServer {
+public:
+    struct Options {
+        uint16_t port = 0; // 0 picks a free port
+        std::string bind_address; // empty for all interfaces
+        std::string cert_pem_file; // both set for wss
+        std::string key_pem_file;
+    };
+
+    // log lines go through the Logger, so they reach Max on its thread
+    SignalingServer();
+    ~SignalingServer();
+
+    // false when the port cannot be bound
+    bool start(const Options& options);
+    void stop();
+    bool isRunning() const { return server != nullptr; }
+    uint16_t getPort() const;
+    size_t getClientCount();
+
+private:
+    // the client table and its handlers. Socket callbacks only hold it weakly,
+    // so one already running keeps it alive past stop() and the destructor,
+    // and later ones find it gone
+    class State;
+    std::shared_ptr<State> state;
+    std::unique_ptr<rtc::WebSocketServer> server;
+};
@@ -0,0 +1,187 @@
+#include "stream_recorder.h"
+#include "h264_utils.h"
+#include "logger.h"
+#include <algorithm>
+
+static constexpr AVRational RtpTimeBase { 1, 90000 };
+
+int64_t RtpTimestampUnwrapper::unwrap(uint32_t timestamp)
+{
+    if (!started) {
+        started = true;
+        last = timestamp;
+        value = timestamp;
+        return value;
+    }
+    // signed difference handles both wrap-around and slightly reordered frames
+    value += static_cast<int32_t>(timestamp - last);
+    last = timestamp;
+    return value;
+}
+
+StreamRecorder::StreamRecorder(const std::string& path_, size_t max_queued_frames_)
+    : path(path_)
+    , max_queued_frames(max_queued_frames_)
+{
+    writer = std::thread(&StreamRecorder::run, this);
+}
+
+StreamRecorder::~StreamRecorder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void StreamRecorder::push(const uint8_t* data, size_t size, int64_t pts, bool keyframe, int width, int height)
+{
+    if (size == 0) {
+        return;
+    }
+
+    // copy outside the lock, the critical section is only a move
+    Frame frame { std::vector<uint8_t>(data, data + size), pts, keyframe, width, height };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (producer_needs_keyframe && !keyframe) {
+            ++dropped_frames;
+            return;
+        }
+        if (queue.size() >= max_queued_frames) {
+            // anything after a gap would reference missing frames
+            ++dropped_frames;
+            producer_needs_keyframe = true;
+            return;
+        }
+        producer_needs_keyframe = false;
+        queue.push_back(std::move(frame));
+    }
+    cv.notify_one();
+}
+
+void StreamRecorder::run()
+{
+    std::deque<Frame> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty() && stopping) {
+                break;
+            }
+            batch.swap(queue);
+        }
+
+        for (const auto& frame : batch) {
+            if (failed) {
+                break;
+            }
+            if (!fmt_ctx && !open(frame)) {
+                continue;
+            }
+            write(frame);
+        }
+        batch.clear();
+    }
+    close();
+}
+
+bool StreamRecorder::open(const Frame& first)
+{
+    // the muxer needs SPS/PPS and the picture size up front
+    std::vector<uint8_t> extradata = h264::parameterSets(first.data.data(), first.data.size());
+    if (!first.keyframe || extradata.empty() || first.width <= 0 || first.height <= 0) {
+        return false;
+    }
+
+    int ret = avformat_alloc_output_context2(&fmt_ctx, nullptr, nullptr, path.c_str());
+    if (ret < 0 || !fmt_ctx) {
+        WLOG_ERROR("[Recorder] cannot create output for %s: %d", path.c_str(), ret);
+        failed = true;
+        return false;
+    }
+
+    stream = avformat_new_stream(fmt_ctx, nullptr);
+    stream->time_base = RtpTimeBase;
+    AVCodecParameters* par = stream->codecpar;
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id = AV_CODEC_ID_H264;
+    par->width = first.width;
+    par->height = first.height;
+    par->extradata = static_cast<uint8_t*>(av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+    par->extradata_size = static_cast<int>(extradata.size());
+    std::copy(extradata.begin(), extradata.end(), par->extradata);
+
+    if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&fmt_ctx->pb, path.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            WLOG_ERROR("[Recorder] cannot open %s: %d", path.c_str(), ret);
+            avformat_free_context(fmt_ctx);
+            fmt_ctx = nullptr;
+            failed = true;
+            return false;
+        }
+    }
+
+    ret = avformat_write_header(fmt_ctx, nullptr);
+    if (ret < 0) {
+        WLOG_ERROR("[Recorder] avformat_write_header failed: %d", ret);
+        avio_closep(&fmt_ctx->pb);
+        avformat_free_context(fmt_ctx);
+        fmt_ctx = nullptr;
+        failed = true;
+        return false;
+    }
+
+    pkt = av_packet_alloc();
+    first_pts = first.pts;
+    return true;
+}
+
+void StreamRecorder::write(const Frame& frame)
+{
+    if (av_new_packet(pkt, static_cast<int>(frame.data.size())) < 0) {
+        return;
+    }
+    std::copy(frame.data.begin(), frame.data.end(), pkt->data);
+
+    int64_t ts = frame.pts - first_pts;
+    // dts must strictly increase even if the source repeated a timestamp
+    if (ts <= last_dts) {
+        ts = last_dts + 1;
+    }
+    last_dts = ts;
+
+    pkt->pts = ts;
+    pkt->dts = ts;
+    pkt->stream_index = stream->index;
+    pkt->flags = frame.keyframe ? AV_PKT_FLAG_KEY : 0;
+    av_packet_rescale_ts(pkt, RtpTimeBase, stream->time_base);
+
+    int ret = av_interleaved_write_frame(fmt_ctx, pkt);
+    if (ret < 0) {
+        WLOG_WARN("[Recorder] av_interleaved_write_frame failed: %d", ret);
+    }
+    av_packet_unref(pkt);
+}
+
+void StreamRecorder::close()
+{
+    if (fmt_ctx) {
+        av_write_trailer(fmt_ctx);
+        if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&fmt_ctx->pb);
+        }
+        avformat_free_context(fmt_ctx);
+        fmt_ctx = nullptr;
+    }
+    if (pkt) {
+        av_packet_free(&pkt);
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Unwraps 32 bit RTP timestamps into a continuous 64 bit timeline.
+struct RtpTimestampUnwrapper {
+    int64_t unwrap(uint32_t timestamp);
+
+private:
+    bool started = false;
+    uint32_t last = 0;
+    int64_t value = 0;
+};
+
+// Remuxes already encoded Annex-B H264 into an MP4/MKV/MOV file (picked from
+// the extension) on a writer thread. push() never waits for the disk: when
+// the bounded queue is full frames are dropped up to the next keyframe.
+class StreamRecorder {
+public:
+    StreamRecorder(const std::string& path, size_t max_queued_frames = 120);
+    ~StreamRecorder();
+
+    // pts in 90kHz ticks; width/height of the stream, 0 when not known yet
+    void push(const uint8_t* data, size_t size, int64_t pts, bool keyframe, int width, int height);
+
+    const std::string& getPath() const { return path; }
+    uint64_t getDroppedFrames() const { return dropped_frames; }
+
+private:
+    struct Frame {
+        std::vector<uint8_t> data;
+        int64_t pts;
+        bool keyframe;
+        int width, height;
+    };
+
+    void run();
+    bool open(const Frame& first);
+    void write(const Frame& frame);
+    void close();
+
+    std::string path;
+    size_t max_queued_frames;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Frame> queue;
+    bool stopping = false;
+    bool producer_needs_keyframe = true;
+    std::atomic<uint64_t> dropped_frames { 0 };
+    std::thread writer;
+
+    // writer thread only
+    AVFormatContext* fmt_ctx = nullptr;
+    AVStream* stream = nullptr;
+    AVPacket* pkt = nullptr;
+    int64_t first_pts = -1;
+    int64_t last_dts = -1;
+    bool failed = false;
+};
@@ -0,0 +1,232 @@
+#include "track_encoder.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static int64_t steadyUs()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+TrackEncoder::TrackEncoder(int index, EncodedCallback on_encoded)
+    : index(index)
+    , on_encoded(std::move(on_encoded))
+{
+}
+
+TrackEncoder::~TrackEncoder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void TrackEncoder::start()
+{
+    std::call_once(started, [this]() {
+        thread = std::thread(&TrackEncoder::run, this);
+    });
+}
+
+bool TrackEncoder::submit(const InputFrame& input, int64_t capture_time_us)
+{
+    if (!pacer.admit(capture_time_us)) {
+        return false;
+    }
+    start();
+
+    const size_t row_bytes = static_cast<size_t>(input.width) * bytesPerPixel(input.format);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // the buffer is reused, it only grows when the input does
+        pending.data.resize(row_bytes * input.height);
+        if (static_cast<size_t>(input.stride) == row_bytes) {
+            std::memcpy(pending.data.data(), input.data, pending.data.size());
+        } else {
+            for (int y = 0; y < input.height; ++y) {
+                std::memcpy(pending.data.data() + y * row_bytes, input.data + static_cast<size_t>(y) * input.stride, row_bytes);
+            }
+        }
+        pending.input = input;
+        pending.input.data = pending.data.data();
+        pending.input.stride = static_cast<int>(row_bytes);
+        pending.capture_us = capture_time_us;
+        has_pending = true;
+    }
+    cv.notify_one();
+    return true;
+}
+
+void TrackEncoder::setMaxFps(double fps)
+{
+    pacer.setMaxFps(fps);
+    pacer.reset();
+
+    // encoder rate control still wants a nominal frame rate when the cap is off
+    std::lock_guard<std::mutex> lock(mutex);
+    settings.fps = fps > 0.0 ? static_cast<int>(fps + 0.5) : 30;
+}
+
+void TrackEncoder::setStaticSkip(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    settings.static_skip = enabled;
+}
+
+void TrackEncoder::setSendDim(int width, int height)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        settings.send_width = std::max(0, width);
+        settings.send_height = std::max(0, height);
+        // the encoded size no longer depends on the input, open the encoder now
+        // rather than on the first frame
+        prepare_requested = settings.send_width > 0 && settings.send_height > 0;
+        if (!prepare_requested) {
+            return;
+        }
+    }
+    start();
+    cv.notify_one();
+}
+
+void TrackEncoder::setScaleQuality(ScaleQuality quality)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    settings.scale_quality = quality;
+}
+
+void TrackEncoder::setIntraRefresh(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    settings.intra_refresh = enabled;
+}
+
+void TrackEncoder::requestKeyframe()
+{
+    start();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        keyframe_requested = true;
+    }
+    cv.notify_one();
+}
+
+void TrackEncoder::run()
+{
+    Settings current;
+    while (true) {
+        bool keyframe;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // a throttled keyframe request only wakes the thread once it is due
+            auto keyframe_due = [this] { return keyframe_requested && steadyUs() >= next_keyframe_us; };
+            while (!(stopping || has_pending || prepare_requested || keyframe_due())) {
+                if (keyframe_requested) {
+                    cv.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::microseconds(next_keyframe_us)));
+                } else {
+                    cv.wait(lock);
+                }
+            }
+            if (stopping) {
+                break;
+            }
+            if (prepare_requested && !has_pending) {
+                prepare_requested = false;
+                current = settings;
+                lock.unlock();
+                prepare(current);
+                continue;
+            }
+            prepare_requested = false;
+            if (has_pending) {
+                // swap so neither side reallocates in steady state
+                std::swap(pending, working);
+                has_pending = false;
+            } else {
+                // the last frame again for a keyframe request, stamped now: its
+                // capture time would add the wait since then to the SEI latency
+                working.capture_us = steadyUs();
+            }
+            // a request that is not due yet stays pending, frames until then are plain
+            keyframe = keyframe_due();
+            if (keyframe) {
+                keyframe_requested = false;
+                next_keyframe_us = steadyUs() + MinKeyframeIntervalUs;
+            }
+            current = settings;
+        }
+        // nothing captured yet, the first frame starts with an IDR anyway
+        if (!working.input.data) {
+            continue;
+        }
+        if (keyframe && encoder) {
+            encoder->forceKeyframe();
+        }
+        encode(working, current);
+    }
+    encoder.reset();
+}
+
+void TrackEncoder::prepare(const Settings& settings)
+{
+    ensureEncoder(std::max(2, settings.send_width & ~1), std::max(2, settings.send_height & ~1), settings);
+}
+
+void TrackEncoder::ensureEncoder(int width, int height, const Settings& settings)
+{
+    if (!encoder) {
+        encoder = std::make_unique<VideoEncoderLibav>(width, height, settings.fps, settings.intra_refresh);
+        encoder->setStaticSkip(settings.static_skip);
+        applied_static_skip = settings.static_skip;
+    } else if (encoder->getWidth() != width || encoder->getHeight() != height || encoder->getFps() != settings.fps
+        || encoder->getIntraRefresh() != settings.intra_refresh) {
+        encoder->reinit(width, height, settings.fps, settings.intra_refresh);
+    }
+}
+
+void TrackEncoder::encode(const Pending& frame, const Settings& settings)
+{
+    InputFrame input = frame.input;
+    const bool resized = settings.send_width > 0 || settings.send_height > 0;
+    // 4:2:0 wants even dimensions, input at its own size loses an odd last
+    // column or row instead of being resampled by one pixel
+    if (!resized && input.width >= 2 && input.height >= 2) {
+        input.width &= ~1;
+        input.height &= ~1;
+    }
+
+    int width = input.width;
+    int height = input.height;
+    if (settings.send_width > 0 && settings.send_height > 0) {
+        width = settings.send_width;
+        height = settings.send_height;
+    } else if (settings.send_width > 0) {
+        height = static_cast<int>(static_cast<int64_t>(input.height) * settings.send_width / input.width);
+        width = settings.send_width;
+    } else if (settings.send_height > 0) {
+        width = static_cast<int>(static_cast<int64_t>(input.width) * settings.send_height / input.height);
+        height = settings.send_height;
+    }
+    width = std::max(2, width & ~1);
+    height = std::max(2, height & ~1);
+
+    ensureEncoder(width, height, settings);
+    // toggling resets the change detection, so only pass it on when it changes
+    if (settings.static_skip != applied_static_skip) {
+        encoder->setStaticSkip(settings.static_skip);
+    }
+    applied_static_skip = settings.static_skip;
+    encoder->setScaleQuality(settings.scale_quality);
+
+    if (!encoder->encodeFrame(input, frame.capture_us)) {
+        return;
+    }
+    on_encoded(index, encoder->getEncodedData(), encoder->getWidth(), encoder->getHeight());
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_pacer.h"
+#include "videoencoder_libav.h"
+
+// One outgoing video track. Frames are copied in on the caller's thread and
+// encoded on a thread owned by the track, so several feeds encode in parallel.
+// Only the latest frame is kept: one that arrives while the encoder is busy
+// replaces the frame still waiting.
+class TrackEncoder {
+public:
+    // called on the encoder thread, frame data is valid until the callback returns
+    using EncodedCallback = std::function<void(int index, const EncodedFrame& frame, int width, int height)>;
+
+    TrackEncoder(int index, EncodedCallback on_encoded);
+    ~TrackEncoder();
+
+    int getIndex() const { return index; }
+
+    // false when the frame was dropped by the pacer
+    bool submit(const InputFrame& input, int64_t capture_time_us);
+
+    void setMaxFps(double fps);
+    void setStaticSkip(bool enabled);
+    // 0 keeps the input size, a single 0 keeps the input aspect ratio
+    void setSendDim(int width, int height);
+    void setScaleQuality(ScaleQuality quality);
+    void setIntraRefresh(bool enabled);
+
+    // the next frame is an IDR. When nothing new is waiting the last frame is
+    // encoded again, so a peer that just joined does not wait for the input.
+    // Requests within MinKeyframeIntervalUs of the last forced IDR are merged
+    // into one IDR when the interval is over
+    void requestKeyframe();
+
+    static constexpr int64_t MinKeyframeIntervalUs = 500000;
+
+private:
+    struct Settings {
+        int fps = 30;
+        bool static_skip = true;
+        int send_width = 0;
+        int send_height = 0;
+        ScaleQuality scale_quality = ScaleQuality::Fast;
+        bool intra_refresh = false;
+    };
+
+    struct Pending {
+        std::vector<uint8_t> data; // rows packed, stride == width * bytes per pixel
+        InputFrame input {};
+        int64_t capture_us = 0;
+    };
+
+    // the thread and the encoder are created on first use, so an idle track costs nothing
+    void start();
+    void run();
+    void prepare(const Settings& settings);
+    void ensureEncoder(int width, int height, const Settings& settings);
+    void encode(const Pending& frame, const Settings& settings);
+
+    const int index;
+    EncodedCallback on_encoded;
+    FramePacer pacer; // caller thread
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    bool has_pending = false;
+    bool keyframe_requested = false;
+    int64_t next_keyframe_us = 0; // steady clock, earliest time for a forced IDR
+    bool prepare_requested = false;
+    Pending pending;
+    Settings settings;
+
+    // encoder thread only
+    Pending working;
+    std::unique_ptr<VideoEncoderLibav> encoder;
+    bool applied_static_skip = true;
+
+    std::once_flag started;
+    std::thread thread;
+};
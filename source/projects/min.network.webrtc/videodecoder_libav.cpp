@@ -1,34 +1,83 @@
 #include "videodecoder_libav.h"
+#include <algorithm>
+#include <chrono>
+#include "h264_utils.h"
+#include "logger.h"
 
-VideoDecoderLibav::VideoDecoderLibav()
+extern "C" {
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+}
+
+static int64_t steadyUs()
 {
-    int ret;
-    // av_log_set_level(AV_LOG_DEBUG);
-    const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
 
-    if (!codec) {
-        std::cerr << "[ERROR] AV_CODEC_ID_H264 decoder not found!" << std::endl;
+// lays the planes out in one pooled buffer with aligned rows and hands it to
+// the frame, the buffer goes back to the pool with the last reference
+static int attachPooledBuffer(AVFrame* frame, int width, int height, FramePool::Priority priority)
+{
+    const auto format = static_cast<AVPixelFormat>(frame->format);
+    int linesizes[4] = { 0, 0, 0, 0 };
+    int ret = av_image_fill_linesizes(linesizes, format, width);
+    if (ret < 0) {
+        return ret;
     }
-
-    ctx = avcodec_alloc_context3(codec);
-    if (!ctx) {
-        std::cerr << "[ERROR] cannot allocate context" << std::endl;
+    for (int& linesize : linesizes) {
+        linesize = (linesize + FramePool::Alignment - 1) & ~static_cast<int>(FramePool::Alignment - 1);
     }
-
-    ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VIDEOTOOLBOX,
-        NULL, NULL, 0);
-
+    uint8_t* planes[4];
+    ret = av_image_fill_pointers(planes, format, height, nullptr, linesizes);
     if (ret < 0) {
-        std::cerr << "[ERROR] av_hwdevice_ctx_create err" << std::endl;
+        return ret;
     }
+    // decoders may read a little past the last plane
+    const size_t size = static_cast<size_t>(ret) + AV_INPUT_BUFFER_PADDING_SIZE;
 
-    ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-    ctx->thread_count = 1;
+    auto* buffer = new FramePool::Buffer(FramePool::instance().acquire(size, priority));
+    if (!*buffer) {
+        delete buffer;
+        return AVERROR(ENOMEM);
+    }
+    frame->buf[0] = av_buffer_create(
+        buffer->data(), static_cast<int>(size),
+        [](void* opaque, uint8_t*) { delete static_cast<FramePool::Buffer*>(opaque); },
+        buffer, 0);
+    if (!frame->buf[0]) {
+        delete buffer;
+        return AVERROR(ENOMEM);
+    }
+    av_image_fill_pointers(frame->data, format, height, buffer->data(), linesizes);
+    for (int i = 0; i < 4; ++i) {
+        frame->linesize[i] = linesizes[i];
+    }
+    return 0;
+}
 
-    ret = avcodec_open2(ctx, codec, nullptr);
-    if (ret < 0) {
-        std::cerr << "[ERROR] avcodec_open2 err" << std::endl;
+// Pictures the software decoder works in, references included. They are
+// always served: refusing one halfway through a GOP would break the stream,
+// the budget is enforced on the ARGB output instead
+static int getBuffer(AVCodecContext* ctx, AVFrame* frame, int flags)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    if (ctx->hw_frames_ctx || !desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) || !(ctx->codec->capabilities & AV_CODEC_CAP_DR1)) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
     }
+    int width = frame->width;
+    int height = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(ctx, &width, &height, linesize_align);
+    return attachPooledBuffer(frame, width, height, FramePool::Priority::High);
+}
+
+VideoDecoderLibav::VideoDecoderLibav(DecodeQuality quality)
+    : quality(quality)
+    , requested_quality(quality)
+{
+    // av_log_set_level(AV_LOG_DEBUG);
+    open(quality);
 
     pkt = av_packet_alloc();
     frame = av_frame_alloc();
@@ -37,27 +86,142 @@ VideoDecoderLibav::VideoDecoderLibav()
 
 VideoDecoderLibav::~VideoDecoderLibav()
 {
-    avcodec_flush_buffers(ctx);
+    close();
     sws_freeContext(sws_ctx);
     av_frame_free(&sw_frame);
     av_frame_free(&frame);
-    av_buffer_unref(&hw_device_ctx);
     av_packet_free(&pkt);
-    avcodec_free_context(&ctx);
 };
 
-// from webrtc remote video
-bool VideoDecoderLibav::decodeFrame(std::vector<std::byte> binary, uint32_t timestamp)
+void VideoDecoderLibav::open(DecodeQuality quality)
 {
+    int ret;
+    const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+
+    if (!codec) {
+        WLOG_ERROR("AV_CODEC_ID_H264 decoder not found!");
+        return;
+    }
+
+    ctx = avcodec_alloc_context3(codec);
+    if (!ctx) {
+        WLOG_ERROR("cannot allocate decoder context");
+        return;
+    }
 
+    if (quality == DecodeQuality::Full) {
+        ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VIDEOTOOLBOX,
+            NULL, NULL, 0);
+
+        if (ret < 0) {
+            WLOG_ERROR("av_hwdevice_ctx_create failed: %d", ret);
+        } else {
+            ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+        }
+        ctx->thread_count = 1;
+    } else {
+        // the skip options only apply to the software decoder, which also does
+        // not count against the limited number of hardware sessions
+        ctx->skip_loop_filter = AVDISCARD_ALL;
+        ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+        ctx->thread_count = 1;
+        ctx->get_buffer2 = getBuffer;
+        if (quality == DecodeQuality::Preview) {
+            ctx->lowres = std::min<int>(2, codec->max_lowres);
+        }
+    }
+
+    ret = avcodec_open2(ctx, codec, nullptr);
+    if (ret < 0) {
+        WLOG_ERROR("decoder avcodec_open2 failed: %d", ret);
+    }
+}
+
+void VideoDecoderLibav::close()
+{
+    if (ctx) {
+        avcodec_flush_buffers(ctx);
+    }
+    avcodec_free_context(&ctx);
+    av_buffer_unref(&hw_device_ctx);
+}
+
+void VideoDecoderLibav::setQuality(DecodeQuality quality)
+{
+    requested_quality = quality;
+}
+
+void VideoDecoderLibav::setPriority(FramePool::Priority priority)
+{
+    this->priority = priority;
+}
+
+void VideoDecoderLibav::degrade()
+{
+    if (quality == DecodeQuality::Preview) {
+        return;
+    }
+    WLOG_WARN("frame pool over budget, lowering decode quality");
+    degraded_levels = std::max(0, static_cast<int>(quality) + 1 - static_cast<int>(requested_quality.load()));
+    last_recovery_check_us = steadyUs();
+}
+
+// one level back up once the pool could hold the output of the better level
+void VideoDecoderLibav::recover()
+{
+    const int64_t now = steadyUs();
+    if (degraded_levels == 0 || now - last_recovery_check_us < RecoveryIntervalUs) {
+        return;
+    }
+    last_recovery_check_us = now;
+    // each level halves both dimensions
+    const size_t better_size = static_cast<size_t>(4) * width * height * 4;
+    if (FramePool::instance().hasRoom(better_size, priority)) {
+        WLOG_INFO("frame pool has room again, raising decode quality");
+        --degraded_levels;
+    }
+}
+
+// from webrtc remote video
+bool VideoDecoderLibav::decodeFrame(const std::vector<std::byte>& binary, uint32_t timestamp)
+{
     int ret;
-    pkt->data = reinterpret_cast<uint8_t*>(binary.data());
+    auto bytes = reinterpret_cast<const uint8_t*>(binary.data());
+
+    // reopening drops the references, so only switch where the stream restarts
+    if (h264::isKeyframe(bytes, binary.size())) {
+        recover();
+        const auto wanted = static_cast<DecodeQuality>(std::min(
+            static_cast<int>(DecodeQuality::Preview),
+            static_cast<int>(requested_quality.load()) + degraded_levels));
+        if (wanted != quality) {
+            close();
+            open(wanted);
+            quality = wanted;
+            // the output size changes with the level, a smaller one frees the memory
+            decoded_buffer = FramePool::Buffer();
+        }
+    }
+    if (!ctx) {
+        return false;
+    }
+
+    int64_t sent_capture_us;
+    if (h264::readCaptureTime(bytes, binary.size(), sent_capture_us)) {
+        capture_times.push_back({ static_cast<int64_t>(timestamp), sent_capture_us });
+        // frames the decoder dropped never come out
+        if (capture_times.size() > 16) {
+            capture_times.pop_front();
+        }
+    }
+
+    pkt->data = const_cast<uint8_t*>(bytes);
     pkt->size = static_cast<int>(binary.size());
     pkt->pts = static_cast<int64_t>(timestamp);
 
     ret = avcodec_send_packet(ctx, pkt);
     if (ret < 0) {
-        std::cerr << "avcodec_send_packet failed: " << ret << std::endl;
+        WLOG_WARN("avcodec_send_packet failed: %d", ret);
         return false;
     }
 
@@ -66,58 +230,99 @@ bool VideoDecoderLibav::decodeFrame(std::vector<std::byte> binary, uint32_t time
         av_packet_unref(pkt);
         return false;
     } else if (ret < 0) {
-        std::cerr << "avcodec_receive_frame failed: " << ret << std::endl;
+        WLOG_WARN("avcodec_receive_frame failed: %d", ret);
         return false;
     }
 
     av_packet_unref(pkt);
 
+    capture_us = -1;
+    for (auto it = capture_times.begin(); it != capture_times.end(); ++it) {
+        if (it->first == frame->pts) {
+            capture_us = it->second;
+            capture_times.erase(it);
+            break;
+        }
+    }
+
+    AVFrame* src = frame;
     if (frame->format == AV_PIX_FMT_VIDEOTOOLBOX) {
+        // sw_frame keeps its buffers between frames of the same size, the
+        // transfer only allocates when they are missing
+        if (sw_frame->buf[0] && (sw_frame->width != frame->width || sw_frame->height != frame->height)) {
+            av_frame_unref(sw_frame);
+        }
+        if (!sw_frame->buf[0]) {
+            AVPixelFormat* formats = nullptr;
+            if (av_hwframe_transfer_get_formats(frame->hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &formats, 0) >= 0) {
+                sw_frame->format = formats[0];
+                sw_frame->width = frame->width;
+                sw_frame->height = frame->height;
+                // on failure the transfer allocates on its own
+                if (attachPooledBuffer(sw_frame, frame->width, frame->height, FramePool::Priority::High) < 0) {
+                    av_frame_unref(sw_frame);
+                }
+                av_freep(&formats);
+            }
+        }
         //  transfer gpu frame to sw_frame
         ret = av_hwframe_transfer_data(sw_frame, frame, 0);
+        av_frame_unref(frame);
         if (ret < 0) {
-            std::cerr << "av_hwframe_transfer_data failed: " << ret << std::endl;
+            WLOG_WARN("av_hwframe_transfer_data failed: %d", ret);
+            av_frame_unref(sw_frame);
             return false;
         }
-    } else {
-        std::cerr << "frame->format not support" << std::endl;
-        // av_frame_ref(sw_frame, frame);
-        return false;
+        src = sw_frame;
     }
 
-    av_frame_unref(frame);
-
-    width = sw_frame->width;
-    height = sw_frame->height;
+    // lowres already shrank the picture, scale the rest of the way while converting
+    int divisor = quality == DecodeQuality::Preview ? 4 : quality == DecodeQuality::Reduced ? 2 : 1;
+    divisor = std::max(1, divisor >> ctx->lowres);
+    width = std::max(2, src->width / divisor);
+    height = std::max(2, src->height / divisor);
 
     sws_ctx = sws_getCachedContext(
         sws_ctx,
-        sw_frame->width, sw_frame->height, (AVPixelFormat)sw_frame->format,
-        sw_frame->width, sw_frame->height, AV_PIX_FMT_ARGB,
+        src->width, src->height, (AVPixelFormat)src->format,
+        width, height, AV_PIX_FMT_ARGB,
         SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
 
     if (!sws_ctx) {
-        std::cerr << "Failed to get SwsContext" << std::endl;
+        WLOG_ERROR("decoder sws_getCachedContext failed");
+        av_frame_unref(frame);
         return false;
     }
 
-    decoded_buffer.resize(4 * sw_frame->width * sw_frame->height);
+    // the pooled buffer is only replaced when the picture outgrows its size class
+    decoded_size = static_cast<size_t>(4) * width * height;
+    if (decoded_buffer.capacity() < decoded_size) {
+        decoded_buffer = FramePool::Buffer();
+        decoded_buffer = FramePool::instance().acquire(decoded_size, priority);
+        if (!decoded_buffer) {
+            decoded_size = 0;
+            av_frame_unref(frame);
+            // at preview the next frames simply try again
+            degrade();
+            return false;
+        }
+    }
     uint8_t* dst_data[4] = { decoded_buffer.data(), nullptr, nullptr, nullptr };
-    int dst_linesize[4] = { 4 * sw_frame->width, 0, 0, 0 };
+    int dst_linesize[4] = { 4 * width, 0, 0, 0 };
 
     ret = sws_scale(
         sws_ctx,
-        sw_frame->data,
-        sw_frame->linesize,
+        src->data,
+        src->linesize,
         0,
-        sw_frame->height,
+        src->height,
         dst_data,
         dst_linesize);
 
+    av_frame_unref(frame);
     if (ret < 0) {
-        std::cerr << "Failed to sws_scale" << std::endl;
+        WLOG_WARN("decoder sws_scale failed: %d", ret);
         return false;
     }
-    av_frame_unref(sw_frame);
     return true;
 };
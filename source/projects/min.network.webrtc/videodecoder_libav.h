@@ -1,7 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <vector>
 #include <iostream>
+#include "frame_pool.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -15,28 +18,64 @@ struct DecodedData {
     size_t size;
     int width;
     int height;
+    int64_t capture_us; // sender's wall clock, -1 when the stream carries no capture time
+};
+
+// how much work goes into a remote stream, lower settings are meant for thumbnails
+enum class DecodeQuality {
+    Full, // hardware decode at full size
+    Reduced, // software decode without deblocking, half size output
+    Preview // as Reduced, lowres where the codec has it, quarter size output
 };
 
 class VideoDecoderLibav {
 public:
-    VideoDecoderLibav();
+    VideoDecoderLibav(DecodeQuality quality = DecodeQuality::Full);
     ~VideoDecoderLibav();
 
-    bool decodeFrame(std::vector<std::byte> binary, uint32_t timestamp);
+    bool decodeFrame(const std::vector<std::byte>& binary, uint32_t timestamp);
 
     DecodedData getDecodedData() const
     {
-        return { decoded_buffer.data(), decoded_buffer.size(), width, height };
+        return { decoded_buffer.data(), decoded_size, width, height, capture_us };
     };
 
+    // may be called from any thread, takes effect on the next keyframe since
+    // switching between hardware and software decode reopens the codec
+    void setQuality(DecodeQuality quality);
+    DecodeQuality getQuality() const { return quality; }
+
+    // decides who gives way when the frame pool is over budget. A refused
+    // decoder steps down one quality level, and back up once the pool has
+    // room for the better level again
+    void setPriority(FramePool::Priority priority);
+
 private:
-    int width, height;
-    AVCodecContext* ctx;
-    AVBufferRef* hw_device_ctx;
-    AVPacket* pkt;
-    AVFrame* frame;
-    AVFrame* sw_frame;
-    SwsContext* sws_ctx;
-
-    std::vector<uint8_t> decoded_buffer;
+    void open(DecodeQuality quality);
+    void close();
+    void degrade();
+    void recover();
+
+    int width = 0, height = 0;
+    DecodeQuality quality;
+    std::atomic<DecodeQuality> requested_quality;
+    // levels below requested_quality forced by the frame pool, decoder thread only
+    int degraded_levels = 0;
+    int64_t last_recovery_check_us = 0;
+    static constexpr int64_t RecoveryIntervalUs = 2000000;
+    AVCodecContext* ctx = nullptr;
+    AVBufferRef* hw_device_ctx = nullptr;
+    AVPacket* pkt = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* sw_frame = nullptr;
+    SwsContext* sws_ctx = nullptr;
+
+    std::atomic<FramePool::Priority> priority { FramePool::Priority::Normal };
+    // ARGB output; the codec's own frames come from the pool too, see getBuffer
+    FramePool::Buffer decoded_buffer;
+    size_t decoded_size = 0;
+
+    // capture times of packets not yet output, by pts
+    std::deque<std::pair<int64_t, int64_t>> capture_times;
+    int64_t capture_us = -1;
 };
@@ -1,18 +1,62 @@
 #include "videoencoder_libav.h"
+#include "h264_utils.h"
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 // Example
 // https://github.com/libav/libav/blob/master/doc/examples/encode_video.c
 // https://gist.github.com/sdumetz/961585ea70f82e4fb27aadf66b2c9cb2
 
-VideoEncoderLibav::VideoEncoderLibav(int width_, int height_)
+int bytesPerPixel(InputFormat format)
 {
-    // Mac Only
-    codec = avcodec_find_encoder_by_name("h264_videotoolbox");
-    if (!codec) {
-        std::cerr << "[ERROR] h264_videotoolbox encoder not found!" << std::endl;
+    switch (format) {
+    case InputFormat::ARGB:
+    case InputFormat::AYUV:
+    case InputFormat::GrayFloat:
+        return 4;
+    case InputFormat::UYVY:
+        return 2;
+    case InputFormat::Gray:
+        return 1;
+    case InputFormat::ARGBFloat:
+        return 16;
     }
+    return 4;
+}
+
+static uint8_t floatToByte(float v)
+{
+    v = v * 255.0f + 0.5f;
+    return static_cast<uint8_t>(v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v));
+}
+
+const AVCodec* VideoEncoderLibav::findCodec()
+{
+    static const AVCodec* const found = []() -> const AVCodec* {
+        for (const char* name : { "h264_videotoolbox", "libx264" }) {
+            if (const AVCodec* codec = avcodec_find_encoder_by_name(name)) {
+                WLOG_INFO("using %s encoder", name);
+                return codec;
+            }
+        }
+        const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+        if (codec) {
+            WLOG_INFO("using %s encoder", codec->name);
+        } else {
+            WLOG_ERROR("no H264 encoder found!");
+        }
+        return codec;
+    }();
+    return found;
+}
+
+VideoEncoderLibav::VideoEncoderLibav(int width_, int height_, int fps_, bool intra_refresh_)
+{
+    codec = findCodec();
     // av_log_set_level(AV_LOG_DEBUG);
-    init(width_, height_);
+    init(width_, height_, fps_, intra_refresh_);
 }
 
 VideoEncoderLibav::~VideoEncoderLibav()
@@ -20,42 +64,58 @@ VideoEncoderLibav::~VideoEncoderLibav()
     cleanup();
 }
 
-void VideoEncoderLibav::init(int width_, int height_)
+void VideoEncoderLibav::init(int width_, int height_, int fps_, bool intra_refresh_)
 {
     width = width_;
     height = height_;
-
-    int fps = 25;
-
-    // using CPU
-    sws_ctx = sws_getContext(
-        width, height, AV_PIX_FMT_ARGB,
-        width, height, AV_PIX_FMT_YUV420P,
-        SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
-
-    sws_frame = av_frame_alloc();
-    sws_frame->format = AV_PIX_FMT_ARGB;
-    sws_frame->width = width;
-    sws_frame->height = height;
-
-    av_frame_get_buffer(sws_frame, 0);
+    fps = fps_ > 0 ? fps_ : 30;
+    intra_refresh = intra_refresh_;
 
     // using GPU
     ctx = avcodec_alloc_context3(codec);
     ctx->width = width;
     ctx->height = height;
-    ctx->time_base = AVRational { 1, fps };
+    // pts are capture timestamps, framerate is only a hint for rate control
+    ctx->time_base = AVRational { 1, ClockRate };
     ctx->framerate = AVRational { fps, 1 };
     ctx->pix_fmt = AV_PIX_FMT_YUV420P;
     ctx->color_range = AVCOL_RANGE_MPEG;
 
     ctx->thread_count = 1;
-    ctx->gop_size = fps;
+    // IDRs are forced by capture time in encodeFrame, a frame count would
+    // stretch the GOP whenever frames are dropped or skipped as static
+    ctx->gop_size = fps * 60;
     ctx->max_b_frames = 0;
     ctx->bit_rate = 800000;
     ctx->rc_buffer_size = 0;
 
+    // the options only exist on some encoders, the others ignore them
     av_opt_set(ctx->priv_data, "realtime", "1", 0);
+    av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(ctx->priv_data, "preset", "veryfast", 0);
+    // a forced I frame must be an IDR for a peer that joins on it
+    av_opt_set(ctx->priv_data, "forced-idr", "1", 0);
+    // peers are offered profile-level-id 42e01f, constrained baseline, while
+    // libx264 would default to high
+    av_opt_set(ctx->priv_data, "profile", "baseline", 0);
+#ifdef AV_PROFILE_H264_CONSTRAINED_BASELINE
+    ctx->profile = AV_PROFILE_H264_CONSTRAINED_BASELINE;
+#else
+    ctx->profile = FF_PROFILE_H264_CONSTRAINED_BASELINE;
+#endif
+
+    if (intra_refresh) {
+        // a VBV of one frame at the target rate keeps every frame near the average
+        ctx->rc_max_rate = ctx->bit_rate;
+        ctx->rc_buffer_size = static_cast<int>(ctx->bit_rate / fps);
+        // no timed IDRs in this mode, other encoders have no gradual refresh
+        // so they rely on PLI alone
+        if (codec && strcmp(codec->name, "libx264") == 0) {
+            // the refresh sweeps the picture once per gop_size frames
+            av_opt_set_int(ctx->priv_data, "intra-refresh", 1, 0);
+            ctx->gop_size = fps;
+        }
+    }
 
     avcodec_open2(ctx, codec, nullptr);
 
@@ -67,6 +127,11 @@ void VideoEncoderLibav::init(int width_, int height_)
     av_frame_get_buffer(frame, 0);
 
     pkt = av_packet_alloc();
+
+    // a fresh frame holds no picture to repeat
+    block_diff.reset();
+    last_encoded_us = -1;
+    last_keyframe_us = -1;
 }
 
 void VideoEncoderLibav::cleanup()
@@ -75,63 +140,307 @@ void VideoEncoderLibav::cleanup()
         av_packet_free(&pkt);
     if (frame)
         av_frame_free(&frame);
-    if (sws_frame)
-        av_frame_free(&sws_frame);
     if (sws_ctx)
         sws_freeContext(sws_ctx);
     if (ctx)
         avcodec_free_context(&ctx);
     pkt = nullptr;
     frame = nullptr;
-    sws_frame = nullptr;
     sws_ctx = nullptr;
     ctx = nullptr;
 }
 
-void VideoEncoderLibav::reinit(int new_width, int new_height)
+void VideoEncoderLibav::reinit(int new_width, int new_height, int new_fps, bool new_intra_refresh)
 {
     cleanup();
-    init(new_width, new_height);
+    init(new_width, new_height, new_fps, new_intra_refresh);
+}
+
+// capture times come from the steady clock, receivers compare against wall clocks
+int64_t VideoEncoderLibav::toWallUs(int64_t steady_us)
+{
+    using namespace std::chrono;
+    const int64_t steady_now = duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    const int64_t wall_now = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    return wall_now - (steady_now - steady_us);
 }
 
 int VideoEncoderLibav::getWidth() const { return width; }
 int VideoEncoderLibav::getHeight() const { return height; }
-void VideoEncoderLibav::encodeFrame(uint8_t* data)
+int VideoEncoderLibav::getFps() const { return fps; }
+
+int VideoEncoderLibav::scaleFlags(ScaleQuality quality)
 {
-    int ret;
+    switch (quality) {
+    case ScaleQuality::Fast:
+        return SWS_FAST_BILINEAR;
+    case ScaleQuality::Bilinear:
+        return SWS_BILINEAR;
+    case ScaleQuality::Bicubic:
+        return SWS_BICUBIC;
+    case ScaleQuality::Area:
+        return SWS_AREA;
+    case ScaleQuality::Lanczos:
+        return SWS_LANCZOS;
+    }
+    return SWS_FAST_BILINEAR;
+}
 
-    static int64_t pts_counter = 0;
-    frame->pts = pts_counter++;
+void VideoEncoderLibav::setScaleQuality(ScaleQuality quality)
+{
+    // sws_getCachedContext picks up the new flags on the next frame
+    scale_quality = quality;
+}
+void VideoEncoderLibav::setStaticSkip(bool enabled)
+{
+    static_skip = enabled;
+    block_diff.reset();
+    if (frame) {
+        av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    }
+}
 
-    ret = av_image_fill_arrays(
-        sws_frame->data,
-        sws_frame->linesize,
-        data,
-        AV_PIX_FMT_ARGB,
-        width,
-        height,
-        1);
+// Changed blocks get a quality boost over the static background. Encoders
+// without ROI support ignore the side data.
+void VideoEncoderLibav::updateRegionsOfInterest(int changed_count)
+{
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
 
-    if (ret < 0) {
-        std::cerr << "av_image_fill_arrays failed: " << ret << std::endl;
+    // nothing to tell apart when everything or nothing moved
+    if (changed_count == 0 || changed_count == block_diff.blockCount()) {
         return;
     }
 
-    // argb->yuv420
-    ret = sws_scale(
+    const auto& changed = block_diff.changedBlocks();
+    const int bs = BlockDiff::BlockSize;
+    rois.clear();
+
+    // blocks are in input pixels, regions in encoded pixels
+    const double sx = static_cast<double>(width) / block_diff.imageWidth();
+    const double sy = static_cast<double>(height) / block_diff.imageHeight();
+
+    for (int by = 0; by < block_diff.blocksY(); ++by) {
+        int bx = 0;
+        while (bx < block_diff.blocksX()) {
+            if (!changed[by * block_diff.blocksX() + bx]) {
+                ++bx;
+                continue;
+            }
+            // merge runs of changed blocks on a row into one region
+            int run_end = bx;
+            while (run_end + 1 < block_diff.blocksX() && changed[by * block_diff.blocksX() + run_end + 1]) {
+                ++run_end;
+            }
+
+            AVRegionOfInterest roi {};
+            roi.self_size = sizeof(AVRegionOfInterest);
+            roi.left = static_cast<int>(bx * bs * sx);
+            roi.right = std::min(static_cast<int>((run_end + 1) * bs * sx + 0.5), width);
+            roi.top = static_cast<int>(by * bs * sy);
+            roi.bottom = std::min(static_cast<int>((by + 1) * bs * sy + 0.5), height);
+            roi.qoffset = AVRational { -1, 5 };
+            rois.push_back(roi);
+
+            bx = run_end + 1;
+        }
+    }
+
+    AVFrameSideData* sd = av_frame_new_side_data(
+        frame,
+        AV_FRAME_DATA_REGIONS_OF_INTEREST,
+        rois.size() * sizeof(AVRegionOfInterest));
+    if (sd) {
+        std::copy(rois.begin(), rois.end(), reinterpret_cast<AVRegionOfInterest*>(sd->data));
+    }
+}
+
+// AYUV has no swscale format, it is converted by hand at output resolution
+void VideoEncoderLibav::convertAYUV(const uint8_t* src, int src_stride)
+{
+    const int chroma_w = (width + 1) / 2;
+    const int chroma_h = (height + 1) / 2;
+
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* row = src + static_cast<size_t>(y) * src_stride;
+        uint8_t* luma = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < width; ++x) {
+            luma[x] = row[4 * x + 1];
+        }
+    }
+    // average each 2x2 quad down to one chroma sample
+    for (int cy = 0; cy < chroma_h; ++cy) {
+        const uint8_t* row0 = src + static_cast<size_t>(2 * cy) * src_stride;
+        const uint8_t* row1 = 2 * cy + 1 < height ? row0 + src_stride : row0;
+        uint8_t* u = frame->data[1] + cy * frame->linesize[1];
+        uint8_t* v = frame->data[2] + cy * frame->linesize[2];
+        for (int cx = 0; cx < chroma_w; ++cx) {
+            const int x0 = 4 * (2 * cx);
+            const int x1 = 2 * cx + 1 < width ? x0 + 4 : x0;
+            u[cx] = static_cast<uint8_t>((row0[x0 + 2] + row0[x1 + 2] + row1[x0 + 2] + row1[x1 + 2] + 2) >> 2);
+            v[cx] = static_cast<uint8_t>((row0[x0 + 3] + row0[x1 + 3] + row1[x0 + 3] + row1[x1 + 3] + 2) >> 2);
+        }
+    }
+}
+
+// scales and converts into frame in one swscale pass
+bool VideoEncoderLibav::scale(const uint8_t* const src[], const int src_stride[], int src_w, int src_h, AVPixelFormat src_fmt)
+{
+    sws_ctx = sws_getCachedContext(
         sws_ctx,
-        sws_frame->data,
-        sws_frame->linesize,
-        0,
-        height,
-        frame->data,
-        frame->linesize);
+        src_w, src_h, src_fmt,
+        width, height, AV_PIX_FMT_YUV420P,
+        scaleFlags(scale_quality), nullptr, nullptr, nullptr);
+
+    if (!sws_ctx) {
+        WLOG_ERROR("encoder sws_getCachedContext failed");
+        return false;
+    }
 
+    int ret = sws_scale(sws_ctx, src, src_stride, 0, src_h, frame->data, frame->linesize);
     if (ret < 0) {
-        std::cerr << "sws_scale failed: " << ret << std::endl;
-        return;
+        WLOG_WARN("encoder sws_scale failed: %d", ret);
+        return false;
+    }
+    return true;
+}
+
+bool VideoEncoderLibav::convertInput(const InputFrame& input)
+{
+    const uint8_t* src = input.data;
+    int src_stride = input.stride;
+    InputFormat format = input.format;
+    const int in_w = input.width;
+    const int in_h = input.height;
+    const bool scaled = in_w != width || in_h != height;
+
+    // float input is quantised once, then takes the 8 bit path
+    if (format == InputFormat::ARGBFloat || format == InputFormat::GrayFloat) {
+        const int channels = format == InputFormat::ARGBFloat ? 4 : 1;
+        float_scratch.resize(static_cast<size_t>(channels) * in_w * in_h);
+        for (int y = 0; y < in_h; ++y) {
+            const float* row = reinterpret_cast<const float*>(src + static_cast<size_t>(y) * src_stride);
+            uint8_t* dst = float_scratch.data() + static_cast<size_t>(y) * channels * in_w;
+            for (int x = 0; x < channels * in_w; ++x) {
+                dst[x] = floatToByte(row[x]);
+            }
+        }
+        src = float_scratch.data();
+        src_stride = channels * in_w;
+        format = format == InputFormat::ARGBFloat ? InputFormat::ARGB : InputFormat::Gray;
+    }
+
+    if (format == InputFormat::Gray && !scaled) {
+        const int chroma_w = (width + 1) / 2;
+        const int chroma_h = (height + 1) / 2;
+        av_image_copy_plane(frame->data[0], frame->linesize[0], src, src_stride, width, height);
+        for (int y = 0; y < chroma_h; ++y) {
+            std::memset(frame->data[1] + y * frame->linesize[1], 128, chroma_w);
+            std::memset(frame->data[2] + y * frame->linesize[2], 128, chroma_w);
+        }
+        return true;
+    }
+
+    if (format == InputFormat::AYUV) {
+        if (!scaled) {
+            convertAYUV(src, src_stride);
+            return true;
+        }
+        // swscale takes packed input as RGB and would convert it to YUV, so the
+        // bytes are split into 4:4:4 planes first, which it only resamples
+        const size_t plane = static_cast<size_t>(in_w) * in_h;
+        scale_scratch.resize(3 * plane);
+        uint8_t* ys = scale_scratch.data();
+        uint8_t* us = ys + plane;
+        uint8_t* vs = us + plane;
+        for (int y = 0; y < in_h; ++y) {
+            const uint8_t* row = src + static_cast<size_t>(y) * src_stride;
+            const size_t offset = static_cast<size_t>(y) * in_w;
+            for (int x = 0; x < in_w; ++x) {
+                ys[offset + x] = row[4 * x + 1];
+                us[offset + x] = row[4 * x + 2];
+                vs[offset + x] = row[4 * x + 3];
+            }
+        }
+        const uint8_t* planes[4] = { ys, us, vs, nullptr };
+        const int strides[4] = { in_w, in_w, in_w, 0 };
+        return scale(planes, strides, in_w, in_h, AV_PIX_FMT_YUV444P);
+    }
+
+    // one pass does scaling and colour conversion together
+    AVPixelFormat src_fmt = AV_PIX_FMT_ARGB;
+    if (format == InputFormat::UYVY) {
+        src_fmt = AV_PIX_FMT_UYVY422;
+    } else if (format == InputFormat::Gray) {
+        src_fmt = AV_PIX_FMT_GRAY8;
+    }
+
+    const uint8_t* planes[4] = { src, nullptr, nullptr, nullptr };
+    const int strides[4] = { src_stride, 0, 0, 0 };
+    return scale(planes, strides, in_w, in_h, src_fmt);
+}
+
+bool VideoEncoderLibav::encodeFrame(const InputFrame& input, int64_t capture_time_us)
+{
+    int ret;
+    bool got_packet = false;
+    encoded_data.clear();
+
+    // one IDR per interval of capture time, however many frames were skipped
+    if (!intra_refresh && (last_keyframe_us < 0 || capture_time_us - last_keyframe_us >= KeyframeIntervalUs)) {
+        force_keyframe = true;
+    }
+
+    bool repeat = false;
+    int changed = 0;
+    if (static_skip) {
+        changed = block_diff.update(input.data, input.width, input.height, bytesPerPixel(input.format), input.stride);
+        if (changed == 0 && last_encoded_us >= 0) {
+            if (!force_keyframe && capture_time_us - last_encoded_us < StaticRepeatIntervalUs) {
+                return false;
+            }
+            // frame still holds the last converted picture, only re-encode it
+            repeat = true;
+        }
+    }
+
+    if (first_capture_us < 0) {
+        first_capture_us = capture_time_us;
+    }
+
+    int64_t pts = av_rescale_q(
+        capture_time_us - first_capture_us,
+        AVRational { 1, 1000000 },
+        AVRational { 1, ClockRate });
+
+    // two captures within the same tick would otherwise be rejected by the encoder
+    if (pts <= last_pts) {
+        pts = last_pts + 1;
+    }
+
+    // the encoder may still hold a reference to the previous picture
+    ret = av_frame_make_writable(frame);
+    if (ret < 0) {
+        WLOG_WARN("av_frame_make_writable failed: %d", ret);
+        return false;
+    }
+
+    if (!repeat && !convertInput(input)) {
+        return false;
+    }
+
+    if (static_skip) {
+        updateRegionsOfInterest(changed);
     }
 
+    last_pts = pts;
+    last_encoded_us = capture_time_us;
+    frame->pts = pts;
+    frame->pict_type = force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    if (force_keyframe) {
+        last_keyframe_us = capture_time_us;
+    }
+    force_keyframe = false;
+
     // std::cout << "[Encoder] frame format=" << frame->format
     // 		  << ", width=" << frame->width
     // 		  << ", height=" << frame->height << std::endl;
@@ -139,22 +448,29 @@ void VideoEncoderLibav::encodeFrame(uint8_t* data)
 
     ret = avcodec_send_frame(ctx, frame);
     if (ret < 0) {
-        std::cerr << "avcodec_send_frame failed: " << ret << std::endl;
-        return;
+        WLOG_WARN("avcodec_send_frame failed: %d", ret);
+        return false;
     }
 
     while (ret >= 0) {
         ret = avcodec_receive_packet(ctx, pkt);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            return;
+            return got_packet;
         }
         if (ret < 0) {
-            std::cerr << "avcodec_receive_packet failed: " << ret << std::endl;
-            return;
+            WLOG_WARN("avcodec_receive_packet failed: %d", ret);
+            return got_packet;
         }
 
         encoded_data.assign(pkt->data, pkt->data + pkt->size);
+        // the packet may be an earlier frame than the one just sent, its pts leads back to the capture time
+        const int64_t packet_capture_us = first_capture_us + av_rescale_q(pkt->pts, AVRational { 1, ClockRate }, AVRational { 1, 1000000 });
+        h264::insertCaptureTime(encoded_data, toWallUs(packet_capture_us));
+        encoded_pts = pkt->pts;
+        encoded_keyframe = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+        got_packet = true;
 
         av_packet_unref(pkt);
     }
+    return got_packet;
 }
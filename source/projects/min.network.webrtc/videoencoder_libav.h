@@ -1,6 +1,8 @@
 #pragma once
 #include <iostream>
 #include <cstdint>
+#include <vector>
+#include "block_diff.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -11,41 +13,126 @@ extern "C" {
 #include <libavutil/opt.h>
 #include <libswscale/swscale.h>
 }
+// layouts the encoder ingests without an ARGB round-trip
+enum class InputFormat {
+    ARGB, // 4 plane char
+    AYUV, // 4 plane char, as produced by jit.argb2ayuv
+    UYVY, // packed 4:2:2, one U/V and one Y byte per pixel
+    Gray, // 1 plane char, luma only
+    ARGBFloat, // 4 plane float32 in 0..1
+    GrayFloat // 1 plane float32 in 0..1
+};
+
+struct InputFrame {
+    const uint8_t* data;
+    int width; // in pixels
+    int height;
+    int stride; // bytes per row, including any padding
+    InputFormat format;
+};
+
+int bytesPerPixel(InputFormat format);
+
+// swscale filter used when the send size differs from the input size
+enum class ScaleQuality {
+    Fast,
+    Bilinear,
+    Bicubic,
+    Area,
+    Lanczos
+};
+
 struct EncodedFrame {
     const uint8_t* data;
     size_t size;
-    int64_t pts;
+    int64_t pts; // in ClockRate ticks, usable as RTP timestamp
+    bool keyframe;
 };
 
 class VideoEncoderLibav {
 public:
-    VideoEncoderLibav(int width, int height);
+    // time base of the encoder, matches the H264 RTP clock so pts can be sent as is
+    static constexpr int ClockRate = 90000;
+
+    // width and height are the encoded size, input frames of any size are scaled to it.
+    // intra_refresh replaces the IDR of every GOP with a column of intra blocks
+    // moving across the picture, and caps every frame to the average size, so
+    // the bitrate has no per GOP spikes. IDRs then only come from forceKeyframe()
+    VideoEncoderLibav(int width, int height, int fps = 30, bool intra_refresh = false);
+
+    // looked up once per process: h264_videotoolbox, then libx264, then any
+    // H264 encoder. nullptr when there is none
+    static const AVCodec* findCodec();
     ~VideoEncoderLibav();
 
     int getWidth() const;
     int getHeight() const;
+    int getFps() const;
+    bool getIntraRefresh() const { return intra_refresh; }
 
-    void encodeFrame(uint8_t* data);
+    // capture_time_us comes from a monotonic clock, frames may arrive at a variable rate.
+    // Each packet carries its capture time as an SEI, see h264::captureTimeSei
+    // returns true when a new packet is ready in getEncodedData()
+    bool encodeFrame(const InputFrame& input, int64_t capture_time_us);
 
     EncodedFrame getEncodedData() const
     {
-        return { encoded_data.data(), encoded_data.size(), frame->pts };
+        return { encoded_data.data(), encoded_data.size(), encoded_pts, encoded_keyframe };
     }
 
     // if the incoming dim changed then it has to reinit the context
-    void reinit(int width, int height);
+    void reinit(int width, int height, int fps, bool intra_refresh);
+
+    void setScaleQuality(ScaleQuality quality);
+
+    // skip unchanged input, re-encoding the previous picture once per repeat interval
+    void setStaticSkip(bool enabled);
+
+    // the next encodeFrame produces an IDR, even for unchanged input
+    void forceKeyframe() { force_keyframe = true; }
 
 private:
     int width, height;
+    int fps;
+    bool intra_refresh = false;
+
+    // per encoder timeline, kept across reinit so timestamps stay monotonic
+    int64_t first_capture_us = -1;
+    int64_t last_pts = -1;
+    int64_t encoded_pts = 0;
+    bool encoded_keyframe = false;
+    static int64_t toWallUs(int64_t steady_us);
+    bool force_keyframe = false;
+    static constexpr int64_t KeyframeIntervalUs = 1000000;
+    int64_t last_keyframe_us = -1;
+
+    // static frame detection
+    static constexpr int64_t StaticRepeatIntervalUs = 1000000;
+    bool static_skip = true;
+    BlockDiff block_diff;
+    int64_t last_encoded_us = -1;
+    std::vector<AVRegionOfInterest> rois;
+
+    void updateRegionsOfInterest(int changed_count);
+
+    // writes the input into frame at encoded size, formats that map onto yuv420p
+    // bypass swscale when no scaling is needed
+    bool convertInput(const InputFrame& input);
+    void convertAYUV(const uint8_t* src, int src_stride);
+    bool scale(const uint8_t* const src[], const int src_stride[], int src_w, int src_h, AVPixelFormat src_fmt);
+    static int scaleFlags(ScaleQuality quality);
+
+    ScaleQuality scale_quality = ScaleQuality::Fast;
+    std::vector<uint8_t> float_scratch;
+    std::vector<uint8_t> scale_scratch;
 
     const AVCodec* codec = nullptr;
     AVCodecContext* ctx = nullptr;
     SwsContext* sws_ctx = nullptr;
     AVFrame* frame = nullptr;
-    AVFrame* sws_frame = nullptr;
     AVPacket* pkt = nullptr;
     std::vector<uint8_t> encoded_data;
 
-    void init(int width, int height);
+    void init(int width, int height, int fps, bool intra_refresh);
     void cleanup();
 };
@@ -1,10 +1,16 @@
 #include "webrtc_client.h"
+#include <algorithm>
+#include "h264_utils.h"
 
 using nlohmann::json;
 using namespace std;
 using namespace rtc;
 using namespace std::chrono_literals;
 
+// to the Max console of this client's objects, queued for the logger thread;
+// like WLOG every call site has a rate limit of its own
+#define CLIENT_LOG(message) WLOG_TO(this, LogLevel::Info, "[WebRTCClient]: %s", std::string(message).c_str())
+
 static std::string generate_random_id()
 {
     static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -36,70 +42,335 @@ std::string urlEncode(const std::string& str)
 template <class T>
 weak_ptr<T> make_weak_ptr(shared_ptr<T> ptr) { return ptr; }
 
+static int64_t steady_us()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// the pacer add_video_track put at the end of the track's chain
+static std::shared_ptr<PacketPacer> track_pacer(const std::shared_ptr<rtc::Track>& track)
+{
+    for (auto handler = track->getMediaHandler(); handler; handler = handler->next()) {
+        if (auto pacer = std::dynamic_pointer_cast<PacketPacer>(handler)) {
+            return pacer;
+        }
+    }
+    return nullptr;
+}
+
+// process wide setup, done by the first connect rather than by every object
+static void init_once()
+{
+    static std::once_flag once;
+    std::call_once(once, []() {
+        rtcInitLogger(RTC_LOG_INFO, nullptr);
+        rtc::Preload();
+    });
+}
+
+// kept cheap, a patch may hold many objects that never connect. The WebSocket
+// and the warm pool thread are created by connect()
+WebRTCClient::WebRTCClient()
+{
+    m_log_sink = Logger::instance().addSink(this, [this](LogLevel, const string& line) {
+        notify_log(line);
+    });
+
+    localID = generate_random_id();
+}
+
 WebRTCClient::WebRTCClient(
     function<void(const string&)> log_callback,
     function<void(const string&)> dc_callback,
-    function<void(
-        const std::string& remote_username,
-        const uint8_t* argb,
-        size_t size,
-        int width,
-        int height)> video_data_callback)
+    VideoCallback video_data_callback,
+    int track_count)
+    : WebRTCClient()
+{
+    add_listener({ log_callback, dc_callback, video_data_callback }, track_count);
+}
 
-    : log_callback(log_callback)
-    , dc_callback(dc_callback)
-    , video_data_callback(video_data_callback)
+std::shared_ptr<WebRTCClient> WebRTCClient::acquire_session(const std::string& session)
 {
+    if (session.empty()) {
+        return make_shared<WebRTCClient>();
+    }
 
-    rtcInitLogger(RTC_LOG_INFO, nullptr);
+    static mutex registry_mutex;
+    static unordered_map<string, weak_ptr<WebRTCClient>> registry;
 
-    // init ws
-    localID = generate_random_id();
-    rtc::WebSocket::Configuration config;
-    config.disableTlsVerification = true;
-    ws = std::make_shared<rtc::WebSocket>(config);
+    lock_guard<mutex> lock(registry_mutex);
+    if (auto client = registry[session].lock()) {
+        return client;
+    }
+    auto client = make_shared<WebRTCClient>();
+    registry[session] = client;
+
+    // drop entries of sessions that ended
+    for (auto it = registry.begin(); it != registry.end();) {
+        it = it->second.expired() ? registry.erase(it) : std::next(it);
+    }
+    return client;
 }
 
-WebRTCClient::~WebRTCClient()
+WebRTCClient::Attachment WebRTCClient::add_listener(Listener listener, int track_count)
 {
-    disconnect();
-    m_encoder.reset();
+    track_count = std::max(1, track_count);
+
+    Attachment attachment;
+    int end = 0;
+    vector<shared_ptr<rtc::PeerConnection>> renegotiate;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        // slots of removed listeners are taken over first, their tracks are
+        // still in every connection, so a session change renegotiates nothing
+        const int slots = static_cast<int>(m_encoders.size());
+        int run = 0;
+        int first = -1;
+        for (int i = 0; i < slots && first < 0; ++i) {
+            run = m_encoders[i] ? 0 : run + 1;
+            if (run == track_count) {
+                first = i - track_count + 1;
+            }
+        }
+        // otherwise a free tail is extended
+        attachment.first_track = first >= 0 ? first : slots - run;
+        attachment.track_count = track_count;
+        end = attachment.first_track + track_count;
+        if (end > slots) {
+            m_encoders.resize(end);
+        }
+        for (int i = attachment.first_track; i < end; ++i) {
+            m_encoders[i] = make_unique<TrackEncoder>(i, [this](int index, const EncodedFrame& encoded, int width, int height) {
+                send_encoded(index, encoded, width, height);
+            });
+        }
+
+        // peers that are already connected get the new tracks in a fresh offer
+        for (auto& [user_id, conn] : peerConnectionMap) {
+            if (end <= slots) {
+                break;
+            }
+            for (int i = slots; i < end; ++i) {
+                conn.video_tracks.push_back(add_video_track(conn.pc, i));
+            }
+            renegotiate.push_back(conn.pc);
+        }
+    }
+    // tracks that join a recording get files of their own, slots that are
+    // taken over keep theirs
+    string record_path;
+    vector<int> unrecorded;
+    {
+        lock_guard<mutex> lock(m_record_mutex);
+        if (static_cast<int>(m_send_recorders.size()) < end) {
+            m_send_recorders.resize(end);
+        }
+        record_path = m_record_path;
+        for (int i = attachment.first_track; i < end && !record_path.empty(); ++i) {
+            if (!m_send_recorders[i]) {
+                unrecorded.push_back(i);
+            }
+        }
+    }
+    if (!unrecorded.empty()) {
+        // the writer threads start outside the lock, as in start_recording
+        vector<unique_ptr<StreamRecorder>> recorders;
+        for (int i : unrecorded) {
+            recorders.push_back(make_unique<StreamRecorder>(i == 0 ? record_path : suffixed_path(record_path, "track" + to_string(i))));
+        }
+        lock_guard<mutex> lock(m_record_mutex);
+        for (size_t n = 0; n < unrecorded.size(); ++n) {
+            if (m_record_path == record_path && !m_send_recorders[unrecorded[n]]) {
+                m_send_recorders[unrecorded[n]] = std::move(recorders[n]);
+            } else {
+                m_finaliser.retire(std::move(recorders[n]));
+            }
+        }
+    }
+    {
+        lock_guard<mutex> lock(m_listener_mutex);
+        attachment.id = m_next_listener++;
+        m_listeners[attachment.id] = { std::move(listener), attachment.first_track, track_count };
+        attachment.owner = m_listeners.begin()->first == attachment.id;
+    }
+
+    for (auto& pc : renegotiate) {
+        if (pc->signalingState() == rtc::PeerConnection::SignalingState::Stable) {
+            pc->setLocalDescription();
+        }
+    }
+    return attachment;
 }
 
-void WebRTCClient::log(const string& message)
+void WebRTCClient::remove_listener(int id)
 {
-    log_callback("[WebRTCClient]: " + message);
+    ListenerEntry entry;
+    {
+        lock_guard<mutex> lock(m_listener_mutex);
+        auto it = m_listeners.find(id);
+        if (it == m_listeners.end()) {
+            return;
+        }
+        entry = std::move(it->second);
+        m_listeners.erase(it);
+    }
+
+    // joins the encoder threads outside m_mutex, send_encoded takes it
+    vector<unique_ptr<TrackEncoder>> encoders;
+    vector<unique_ptr<MatrixSender>> matrix_senders;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (int i = entry.first_track; i < entry.first_track + entry.track_count; ++i) {
+            encoders.push_back(std::move(m_encoders[i]));
+            if (i < static_cast<int>(m_matrix_senders.size())) {
+                matrix_senders.push_back(std::move(m_matrix_senders[i]));
+            }
+        }
+    }
+    encoders.clear();
+    matrix_senders.clear();
 }
 
-void WebRTCClient::dc_send(const string& message)
+// The first listener owns the output of a shared session: the registered
+// matrices are named after the peer alone, so several objects writing them
+// would only repeat each other
+WebRTCClient::ListenerEntry* WebRTCClient::owner()
 {
-    dc_callback(message);
+    return m_listeners.empty() ? nullptr : &m_listeners.begin()->second;
+}
+
+void WebRTCClient::notify_log(const std::string& line)
+{
+    lock_guard<mutex> lock(m_listener_mutex);
+    if (auto entry = owner(); entry && entry->listener.log_callback) {
+        entry->listener.log_callback(line);
+    }
 }
 
+void WebRTCClient::notify_dc(const std::string& message)
+{
+    lock_guard<mutex> lock(m_listener_mutex);
+    for (auto& [id, entry] : m_listeners) {
+        if (entry.listener.dc_callback) {
+            entry.listener.dc_callback(message);
+        }
+    }
+}
+
+void WebRTCClient::notify_video(const std::string& remote_username, const DecodedData& decoded)
+{
+    lock_guard<mutex> lock(m_listener_mutex);
+    if (auto entry = owner(); entry && entry->listener.video_data_callback) {
+        entry->listener.video_data_callback(remote_username, decoded.data, decoded.size, decoded.width, decoded.height);
+    }
+}
+
+void WebRTCClient::notify_matrix(const std::string& remote_username, const matrix_channel::Matrix& matrix)
+{
+    lock_guard<mutex> lock(m_listener_mutex);
+    if (auto entry = owner(); entry && entry->listener.matrix_callback) {
+        entry->listener.matrix_callback(remote_username, matrix);
+    }
+}
+
+// runs fn on the encoders of one listener, or all of them
+template <class Fn>
+void WebRTCClient::for_each_encoder(int listener, Fn fn)
+{
+    int first = 0;
+    int count = static_cast<int>(m_encoders.size());
+    if (listener != AllListeners) {
+        lock_guard<mutex> lock(m_listener_mutex);
+        auto it = m_listeners.find(listener);
+        if (it == m_listeners.end()) {
+            return;
+        }
+        first = it->second.first_track;
+        count = it->second.track_count;
+    }
+    for (int i = first; i < first + count && i < static_cast<int>(m_encoders.size()); ++i) {
+        if (m_encoders[i]) {
+            fn(*m_encoders[i]);
+        }
+    }
+}
+
+WebRTCClient::~WebRTCClient()
+{
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        m_warm_stopping = true;
+    }
+    m_warm_cv.notify_one();
+    if (m_warm_thread.joinable()) {
+        m_warm_thread.join();
+    }
+
+    // encoder threads call back into the client, stop them first. Network
+    // threads reach m_encoders under m_mutex (request_keyframe), so they are
+    // taken out under it and joined outside, where send_encoded can still lock it
+    {
+        vector<unique_ptr<TrackEncoder>> encoders;
+        vector<unique_ptr<MatrixSender>> matrix_senders;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            encoders.swap(m_encoders);
+            matrix_senders.swap(m_matrix_senders);
+        }
+    }
+    disconnect();
+    stop_recording();
+    Logger::instance().removeSink(m_log_sink);
+}
+
+
 // public method can be trigger by Max
 void WebRTCClient::connect(
     const string& url,
     const string& name)
 {
-    log("WebRTCClient::connect()...");
+    if (ws && (ws->readyState() == rtc::WebSocket::State::Open || ws->readyState() == rtc::WebSocket::State::Connecting)) {
+        CLIENT_LOG("WebRTCClient::connect() session already connected");
+        return;
+    }
+    CLIENT_LOG("WebRTCClient::connect()...");
+
+    init_once();
+    if (!ws) {
+        rtc::WebSocket::Configuration config;
+        config.disableTlsVerification = true;
+        ws = std::make_shared<rtc::WebSocket>(config);
+    }
+    if (!m_warm_thread.joinable()) {
+        m_warm_thread = std::thread(&WebRTCClient::warm_run, this);
+    }
     //	std::promise<void> wsPromise;
     //	auto wsFuture = wsPromise.get_future();
 
     string params = "?id=" + urlEncode(localID) + "&username=" + urlEncode(name) + "&role=Jitter";
     string full_url = url + params;
-    log("WebSocket URL is " + full_url);
+    CLIENT_LOG("WebSocket URL is " + full_url);
 
     ws->onOpen([this]() {
-        log("WebSocket opened");
+        CLIENT_LOG("WebSocket opened");
         // wsPromise.set_value();
     });
 
+    // get the pool ready before the first browser offers
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        m_warm_enabled = true;
+    }
+    m_warm_cv.notify_one();
+
     ws->onError([this](std::string s) {
-        log("Websocket onError: " + s);
+        CLIENT_LOG("Websocket onError: " + s);
     });
 
     ws->onClosed([this]() {
-        log("WebSocket closed");
+        CLIENT_LOG("WebSocket closed");
     });
 
     ws->onMessage([this, wws = make_weak_ptr(ws)](auto data) {
@@ -132,36 +403,33 @@ void WebRTCClient::connect(
             // 	createPeerConnection(wws, user_id);
             // }
         } else if (signalingType == "ClientExit") {
+            // a browser that goes away without closing its peer connection
+            // would otherwise stay in the map, with its decoder and threads
             string id = content.at("id");
-            log("Clientexit " + id);
-            for (const auto& [peer_id, conn] : peerConnectionMap) {
-                log("Current peer: " + peer_id);
-            }
-            // removePeerConnection(id);
-            log("current peer size: " + to_string(peerConnectionMap.size()));
+            CLIENT_LOG("Clientexit " + id);
+            removePeerConnection(id);
         } else if (signalingType == "Offer") {
             // lock_guard<mutex> lock(m_mutex);
             string sdp = content.at("sdp");
             string type = content.at("type");
 
-            if (auto jt = peerConnectionMap.find(sender); jt != peerConnectionMap.end()) {
-                std::cout << "Setting remote description: " << type << " from user " << sender << std::endl;
-                jt->second.pc->setRemoteDescription(rtc::Description(sdp, type));
+            if (auto pc = find_peer(sender)) {
+                WLOG_DEBUG("Setting remote description: %s from user %s", type.c_str(), sender.c_str());
+                pc->setRemoteDescription(rtc::Description(sdp, type));
             } else {
 
-                std::cout << "Peer not exist, create and Answering to " + sender << std::endl;
-                shared_ptr<rtc::PeerConnection> pc;
-                pc = createPeerConnection(wws, sender, senderName);
-                pc->setRemoteDescription(rtc::Description(sdp, type));
+                WLOG_DEBUG("Peer not exist, create and Answering to %s", sender.c_str());
+                auto new_pc = createPeerConnection(wws, sender, senderName);
+                new_pc->setRemoteDescription(rtc::Description(sdp, type));
             }
         } else if (signalingType == "Answer") {
             // lock_guard<mutex> lock(m_mutex);
 
-            if (auto jt = peerConnectionMap.find(sender); jt != peerConnectionMap.end()) {
+            if (auto pc = find_peer(sender)) {
                 string sdp = content.at("sdp");
                 string type = content.at("type");
-                std::cout << "Setting remote description: " << type << " from user " << sender << std::endl;
-                jt->second.pc->setRemoteDescription(rtc::Description(sdp, type));
+                WLOG_DEBUG("Setting remote description: %s from user %s", type.c_str(), sender.c_str());
+                pc->setRemoteDescription(rtc::Description(sdp, type));
             }
 
         } else if (signalingType == "Ice") {
@@ -170,11 +438,14 @@ void WebRTCClient::connect(
             if (content.is_object() && content.contains("candidate") && content.contains("sdpMid")) {
                 string candidate = content.at("candidate");
                 string sdpMid = content.at("sdpMid");
-                if (auto jt = peerConnectionMap.find(sender); jt != peerConnectionMap.end()) {
-                    string candidate = content.at("candidate");
-                    string sdpMid = content.at("sdpMid");
-                    std::cout << "add remote candidate from user: " << sender << std::endl;
-                    jt->second.pc->addRemoteCandidate(rtc::Candidate(candidate, sdpMid));
+                if (auto pc = find_peer(sender)) {
+                    rtc::Candidate remote(candidate, sdpMid);
+                    // a trickling browser also sends reflexive and relay candidates, on a LAN they only add checks
+                    if (m_lan_mode && remote.type() != rtc::Candidate::Type::Host) {
+                        return;
+                    }
+                    WLOG_DEBUG("add remote candidate from user: %s", sender.c_str());
+                    pc->addRemoteCandidate(remote);
                 }
             }
         }
@@ -183,35 +454,141 @@ void WebRTCClient::connect(
     try {
         ws->open(full_url);
     } catch (const std::exception& e) {
-        log("WebSocket open error: " + string(e.what()));
+        CLIENT_LOG("WebSocket open error: " + string(e.what()));
     }
 }
 
 void WebRTCClient::disconnect()
 {
-    for (auto& [user_id, conn] : peerConnectionMap) {
+    stop_file();
+
+    // close outside the lock, libdatachannel may call back into removePeerConnection
+    unordered_map<string, ConnectionInfo> connections;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        connections.swap(peerConnectionMap);
+    }
+
+    for (auto& [user_id, conn] : connections) {
         if (conn.decoder) {
             conn.decoder.reset();
         }
 
-        if (conn.video_track) {
-            log("current videotrack closing " + user_id);
-            conn.video_track->close();
+        for (auto& track : conn.video_tracks) {
+            CLIENT_LOG("current videotrack closing " + user_id);
+            // the sender thread may be waiting in the pacer, let it finish so it can be joined
+            if (auto pacer = track_pacer(track)) {
+                pacer->close();
+            }
+            track->close();
         }
         if (conn.pc) {
-            log("current pc closing " + user_id);
+            CLIENT_LOG("current pc closing " + user_id);
             conn.pc->clearStats();
             conn.pc->resetCallbacks();
             conn.pc->close();
         }
     }
-    peerConnectionMap.clear();
-    ws->close();
-    ws->resetCallbacks();
-    log("WebRTCClient::disconnect()");
+    connections.clear();
+    {
+        // recording itself carries on for the peers of the next connection
+        lock_guard<mutex> lock(m_record_mutex);
+        for (auto& [remote_id, recording] : m_peer_recordings) {
+            m_finaliser.retire(std::move(recording.recorder));
+        }
+        m_peer_recordings.clear();
+    }
+    {
+        lock_guard<mutex> lock(m_dump_mutex);
+        for (auto& [remote_id, dump] : m_peer_dumps) {
+            m_finaliser.retire(std::move(dump));
+        }
+        m_peer_dumps.clear();
+    }
+    unordered_map<string, shared_ptr<ShmOutput>> outputs;
+    {
+        // readers see the rings closed, the next connection's peers get new ones
+        lock_guard<mutex> lock(m_shm_mutex);
+        outputs.swap(m_shm_outputs);
+    }
+    outputs.clear();
+    clear_warm_pool();
+    if (ws) {
+        ws->close();
+        ws->resetCallbacks();
+    }
+    CLIENT_LOG("WebRTCClient::disconnect()");
     return;
 }
 
+std::shared_ptr<rtc::PeerConnection> WebRTCClient::find_peer(const std::string& remote_id)
+{
+    lock_guard<mutex> lock(m_mutex);
+    auto it = peerConnectionMap.find(remote_id);
+    return it != peerConnectionMap.end() ? it->second.pc : nullptr;
+}
+
+// the description as an Offer or Answer message
+static void send_description(const weak_ptr<rtc::WebSocket>& wws, const string& remote_id, const rtc::Description& description)
+{
+    string sdp = string(description);
+    std::string type = description.typeString();
+    if (!type.empty()) {
+        type[0] = std::toupper(type[0]);
+    }
+
+    json message = {
+        // { "sender", socket.id },
+        { "target", remote_id },
+        { "signalingType", type },
+        { "content", { { "type", description.typeString() }, { "sdp", sdp } } }
+    };
+
+    if (auto ws = wws.lock()) {
+        ws->send(message.dump());
+    }
+}
+
+rtc::Configuration WebRTCClient::peer_config() const
+{
+    rtc::Configuration config;
+    if (m_lan_mode) {
+        // no STUN or TURN server is configured, so host candidates only, and
+        // every connection on one UDP port instead of a socket and gathering each
+        config.enableIceUdpMux = true;
+        config.portRangeBegin = m_lan_port;
+        config.portRangeEnd = m_lan_port;
+    }
+    return config;
+}
+
+void WebRTCClient::set_lan_mode(bool enabled, uint16_t port)
+{
+    if (enabled == m_lan_mode && port == m_lan_port) {
+        return;
+    }
+    m_lan_mode = enabled;
+    m_lan_port = port;
+    CLIENT_LOG(enabled ? "LAN mode on UDP port " + to_string(port) : "LAN mode off");
+    flush_warm_peers();
+}
+
+// warm peers built with an older configuration are replaced
+void WebRTCClient::flush_warm_peers()
+{
+    vector<WarmPeer> peers;
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        // a peer the warm thread is building right now is dropped as well
+        ++m_warm_generation;
+        peers.swap(m_warm_peers);
+    }
+    m_warm_cv.notify_one();
+    for (auto& peer : peers) {
+        peer.pc->close();
+    }
+}
+
 // handle RTC
 rtc::shared_ptr<rtc::PeerConnection>
 WebRTCClient::createPeerConnection(
@@ -220,11 +597,18 @@ WebRTCClient::createPeerConnection(
     const string& remote_name)
 {
 
-    // rtc::Configuration config;
-    auto pc = make_shared<rtc::PeerConnection>();
+    const int64_t join_us = steady_us();
+
+    WarmPeer warm = take_warm_peer();
+    auto pc = warm.pc ? warm.pc : make_shared<rtc::PeerConnection>(peer_config());
+    const bool lan = m_lan_mode;
 
     // create peer connection callback
-    pc->onLocalCandidate([wws, remote_id](rtc::Candidate rtcCandidate) {
+    pc->onLocalCandidate([wws, remote_id, lan](rtc::Candidate rtcCandidate) {
+        // without trickle the candidates go out inside the description
+        if (lan) {
+            return;
+        }
         string candidate = rtcCandidate.candidate();
         string sdpMid = rtcCandidate.mid();
         json message = {
@@ -238,65 +622,216 @@ WebRTCClient::createPeerConnection(
         }
     });
 
-    pc->onLocalDescription([this, wws, remote_id, pc](rtc::Description description) {
-        string sdp = string(description);
-        std::string type = description.typeString();
-        if (!type.empty()) {
-            type[0] = std::toupper(type[0]);
-        }
-
-        json message = {
-            // { "sender", socket.id },
-            { "target", remote_id },
-            { "signalingType", type },
-            { "content", { { "type", description.typeString() }, { "sdp", sdp } } }
-        };
-
-        if (auto ws = wws.lock()) {
-            ws->send(message.dump());
+    pc->onLocalDescription([wws, remote_id, lan, wpc = make_weak_ptr(pc)](rtc::Description description) {
+        if (lan) {
+            // held back until gathering completes, unless a renegotiation finds it done already
+            auto pc = wpc.lock();
+            if (!pc || pc->gatheringState() != rtc::PeerConnection::GatheringState::Complete) {
+                return;
+            }
+            if (auto local = pc->localDescription()) {
+                description = *local;
+            }
         }
+        send_description(wws, remote_id, description);
     });
 
+    if (lan) {
+        // host candidates on a shared UDP port, gathered in no time
+        pc->onGatheringStateChange([wws, remote_id, wpc = make_weak_ptr(pc)](rtc::PeerConnection::GatheringState state) {
+            if (state != rtc::PeerConnection::GatheringState::Complete) {
+                return;
+            }
+            auto pc = wpc.lock();
+            if (!pc) {
+                return;
+            }
+            if (auto local = pc->localDescription()) {
+                send_description(wws, remote_id, *local);
+            }
+        });
+    }
+
     pc->onStateChange([this, remote_id](rtc::PeerConnection::State state) {
-        if (state == rtc::PeerConnection::State::Closed) {
-            log("remote id closing " + remote_id);
+        if (state == rtc::PeerConnection::State::Connected) {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = peerConnectionMap.find(remote_id);
+            if (it != peerConnectionMap.end() && it->second.connected_us < 0) {
+                it->second.connected_us = steady_us();
+            }
+        }
+        // Failed is final as well, ICE gave up
+        if (state == rtc::PeerConnection::State::Closed || state == rtc::PeerConnection::State::Failed) {
+            CLIENT_LOG("remote id closing " + remote_id);
             removePeerConnection(remote_id);
         }
     });
 
     // std::shared_ptr<rtc::DataChannel> dc;
     pc->onDataChannel([this, remote_id](rtc::shared_ptr<rtc::DataChannel> dc) {
-        auto it = peerConnectionMap.find(remote_id);
-        if (it != peerConnectionMap.end()) {
-            it->second.data_channel = dc;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = peerConnectionMap.find(remote_id);
+            if (it != peerConnectionMap.end()) {
+                it->second.data_channel = dc;
+            }
         }
 
         dc->onOpen([this, remote_id, wdc = make_weak_ptr(dc)]() {
             if (auto dc = wdc.lock()) {
-                log("DataChannel  from " + remote_id + " opened");
+                CLIENT_LOG("DataChannel  from " + remote_id + " opened");
             }
         });
 
         dc->onClosed([this, remote_id]() {
-            log("DataChannel from " + remote_id + " closed");
+            CLIENT_LOG("DataChannel from " + remote_id + " closed");
         });
 
-        dc->onMessage([this](auto data) {
+        dc->onMessage([this, remote_id, wdc = make_weak_ptr(dc)](auto data) {
             if (std::holds_alternative<std::string>(data)) {
-                dc_callback(std::get<std::string>(data));
+                const string& text = std::get<std::string>(data);
+                if (ClockSync::isClockMessage(text)) {
+                    shared_ptr<ClockSync> clock;
+                    {
+                        lock_guard<mutex> lock(m_mutex);
+                        auto it = peerConnectionMap.find(remote_id);
+                        if (it != peerConnectionMap.end()) {
+                            clock = it->second.clock;
+                        }
+                    }
+                    auto dc = wdc.lock();
+                    if (clock && dc) {
+                        const string reply = clock->handle(text);
+                        if (!reply.empty() && dc->isOpen()) {
+                            dc->send(reply);
+                        }
+                    }
+                    return;
+                }
+                notify_dc(text);
             } else {
-                std::cout << "Binary message: " << " received, size=" << std::get<rtc::binary>(data).size() << std::endl;
+                const auto& binary = std::get<rtc::binary>(data);
+                if (!matrix_channel::isMatrixMessage(binary.data(), binary.size())) {
+                    WLOG_DEBUG("Binary message received, size=%zu", binary.size());
+                    return;
+                }
+                shared_ptr<MatrixReceiver> receiver;
+                string remote_name;
+                {
+                    lock_guard<mutex> lock(m_mutex);
+                    auto it = peerConnectionMap.find(remote_id);
+                    if (it != peerConnectionMap.end()) {
+                        receiver = it->second.matrix_receiver;
+                        remote_name = it->second.remote_name;
+                    }
+                }
+                if (receiver && receiver->accept(binary.data(), binary.size())) {
+                    notify_matrix(remote_name, receiver->matrix());
+                }
             }
         });
     });
 
+    // add_listener adds tracks to the peers in the map, so the count is read
+    // and the peer inserted under the same lock. A warm peer may predate
+    // the latest listeners, the count only grows so it is topped up
+    lock_guard<mutex> lock(m_mutex);
+    vector<shared_ptr<rtc::Track>> videoTracks = std::move(warm.video_tracks);
+    for (int i = static_cast<int>(videoTracks.size()); i < std::max<int>(1, m_encoders.size()); ++i) {
+        videoTracks.push_back(add_video_track(pc, i));
+    }
+    for (size_t i = 0; i < videoTracks.size(); ++i) {
+        videoTracks[i]->onOpen([this, i, wtrack = make_weak_ptr(videoTracks[i])]() {
+            CLIENT_LOG("Video track " + to_string(i) + " opened.");
+            // the joiner starts decoding right away instead of at the next GOP
+            request_keyframe(static_cast<int>(i));
+            if (i == 0) {
+                if (auto track = wtrack.lock()) {
+                    track->requestKeyframe();
+                }
+            }
+        });
+    }
+
+    // remote video arrives on the first track
+    auto& videoTrack = videoTracks.front();
+
+    videoTrack->onFrame([this, remote_id, remote_name](rtc::binary data, rtc::FrameInfo info) {
+        shared_ptr<VideoDecoderLibav> decoder;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = peerConnectionMap.find(remote_id);
+            if (it == peerConnectionMap.end())
+                return;
+
+            // each incoming track should have its own decoder
+            if (!it->second.decoder) {
+                it->second.decoder = make_decoder(remote_name);
+            }
+            decoder = it->second.decoder;
+        }
+
+        dump_incoming(remote_id, remote_name, data, info.timestamp);
+        bool decoded_frame = decoder->decodeFrame(data, info.timestamp);
+        auto decoded = decoder->getDecodedData();
+        if (decoded_frame) {
+            notify_video(remote_name, decoded);
+            int64_t capture_us = -1;
+            if (decoded.capture_us >= 0) {
+                capture_us = measure_latency(remote_id, decoded.capture_us);
+            }
+            publish_shm(remote_id, remote_name, decoded, capture_us >= 0 ? capture_us : ClockSync::wallUs());
+
+            int64_t join_us = -1;
+            {
+                lock_guard<mutex> lock(m_mutex);
+                auto it = peerConnectionMap.find(remote_id);
+                if (it != peerConnectionMap.end() && it->second.first_frame_us < 0) {
+                    it->second.first_frame_us = steady_us();
+                    join_us = it->second.join_us;
+                }
+            }
+            if (join_us >= 0) {
+                CLIENT_LOG("first frame from " + remote_name + " " + to_string((steady_us() - join_us) / 1000) + " ms after join");
+            }
+        };
+
+        record_incoming(remote_id, remote_name, data, info.timestamp);
+    });
+
+    ConnectionInfo conn;
+    conn.pc = pc;
+    conn.video_tracks = videoTracks;
+    conn.decoder = make_decoder(remote_name);
+    // a track that dropped frames asks for an IDR only when no regular one came
+    conn.sender = make_shared<PeerSender>(m_send_rate, [this](int index) {
+        request_keyframe(index);
+    });
+    // a warm peer's tracks were built with the rate of that time
+    for (auto& track : videoTracks) {
+        if (auto pacer = track_pacer(track)) {
+            pacer->setRate(m_send_rate);
+        }
+    }
+    conn.remote_name = remote_name;
+    conn.join_us = join_us;
+    peerConnectionMap.emplace(remote_id, std::move(conn));
+
+    return pc;
+}
+
+// All feeds share the peer connection, each on its own mid and SSRC. The first
+// keeps the original mid so a single track client sees no difference.
+std::shared_ptr<rtc::Track> WebRTCClient::add_video_track(const std::shared_ptr<rtc::PeerConnection>& pc, int index)
+{
+    const string mid = index == 0 ? "jitter-media" : "jitter-media-" + to_string(index);
     rtc::Description::Video
-        media("jitter-media", rtc::Description::Direction::SendRecv);
+        media(mid, index == 0 ? rtc::Description::Direction::SendRecv : rtc::Description::Direction::SendOnly);
 
     // add video track
-    const rtc::SSRC ssrc = 42;
+    const rtc::SSRC ssrc = 42 + index;
     const int payloadType = 96;
-    const string cname = "video-send";
+    const string cname = index == 0 ? "video-send" : "video-send-" + to_string(index);
     media.addH264Codec(payloadType);
     media.addSSRC(ssrc, cname);
 
@@ -307,105 +842,863 @@ WebRTCClient::createPeerConnection(
         ssrc, cname, payloadType, rtc::H264RtpPacketizer::ClockRate);
     // create packetizer
     auto packetizer = make_shared<rtc::H264RtpPacketizer>(rtc::NalUnit::Separator::StartSequence, rtpConfig);
-    auto depacketizer = make_shared<rtc::H264RtpDepacketizer>(rtc::NalUnit::Separator::StartSequence);
-
-    packetizer->addToChain(depacketizer);
+    // a receiver that lost the picture asks for an IDR, needed once there is no regular GOP
+    packetizer->addToChain(make_shared<rtc::PliHandler>([this, index]() {
+        WLOG_DEBUG("PLI on track %d", index);
+        request_keyframe(index);
+    }));
+    if (index == 0) {
+        auto depacketizer = make_shared<rtc::H264RtpDepacketizer>(rtc::NalUnit::Separator::StartSequence);
+        packetizer->addToChain(depacketizer);
+        // receiver reports, and the PLI behind requestKeyframe()
+        packetizer->addToChain(make_shared<rtc::RtcpReceivingSession>());
+    }
+    // last, it sends the packets itself
+    packetizer->addToChain(make_shared<PacketPacer>(m_send_rate));
     videoTrack->setMediaHandler(packetizer);
 
-    videoTrack->onOpen([this]() {
-        log("Video track opened.");
-    });
+    return videoTrack;
+}
 
-    videoTrack->onFrame([this, remote_id, remote_name](rtc::binary data, rtc::FrameInfo info) {
+// on the peer's frame thread, right after the frame was handed to the listeners
+int64_t WebRTCClient::measure_latency(const std::string& remote_id, int64_t capture_us)
+{
+    const int64_t now = ClockSync::wallUs();
+    shared_ptr<ClockSync> clock;
+    shared_ptr<LatencyStats> latency;
+    shared_ptr<rtc::DataChannel> ping_channel;
+    {
+        lock_guard<mutex> lock(m_mutex);
         auto it = peerConnectionMap.find(remote_id);
-        if (it == peerConnectionMap.end())
+        if (it == peerConnectionMap.end()) {
+            return -1;
+        }
+        clock = it->second.clock;
+        latency = it->second.latency;
+        // the offset drifts, keep sampling it while video arrives
+        if (now - it->second.last_ping_us >= 2000000 && it->second.data_channel && it->second.data_channel->isOpen()) {
+            it->second.last_ping_us = now;
+            ping_channel = it->second.data_channel;
+        }
+    }
+
+    if (ping_channel) {
+        ping_channel->send(clock->makePing());
+    }
+    if (!clock->hasOffset()) {
+        return -1;
+    }
+    // capture_us is on the sender's clock
+    const int64_t local_capture_us = capture_us - clock->getOffsetUs();
+    latency->add(now - local_capture_us);
+    return local_capture_us;
+}
+
+void WebRTCClient::set_shm_output(const std::string& prefix)
+{
+    unordered_map<string, shared_ptr<ShmOutput>> outputs;
+    {
+        lock_guard<mutex> lock(m_shm_mutex);
+        m_shm_prefix = prefix;
+        outputs.swap(m_shm_outputs);
+    }
+    // readers see the rings closed
+    outputs.clear();
+    if (!prefix.empty()) {
+        CLIENT_LOG("publishing peer video to shared memory /" + prefix + ".<peer>");
+    }
+}
+
+// on the peer's frame thread
+void WebRTCClient::publish_shm(const std::string& remote_id, const std::string& remote_name, const DecodedData& decoded, int64_t timestamp_us)
+{
+    shared_ptr<ShmOutput> output;
+    string created;
+    {
+        // removePeerConnection drops the ring under the same two locks, so a
+        // frame decoded while the peer was being removed cannot bring it back
+        lock_guard<mutex> lock(m_mutex);
+        if (peerConnectionMap.find(remote_id) == peerConnectionMap.end()) {
+            return;
+        }
+        lock_guard<mutex> shm_lock(m_shm_mutex);
+        if (m_shm_prefix.empty()) {
             return;
+        }
+        auto& entry = m_shm_outputs[remote_name];
+        if (!entry) {
+            entry = make_shared<ShmOutput>();
+            entry->ring = make_unique<SharedFrameRing>(shm::ringName(m_shm_prefix, remote_name));
+            created = entry->ring->getName();
+        }
+        output = entry;
+    }
+    if (!created.empty()) {
+        CLIENT_LOG("shared memory ring " + created + " for " + remote_name);
+    }
+
+    lock_guard<mutex> lock(output->mutex);
+    output->ring->write(decoded.data, decoded.width, decoded.height, timestamp_us);
+}
+
+void WebRTCClient::request_keyframe(int index)
+{
+    lock_guard<mutex> lock(m_mutex);
+    // a playing file owns the first track, its next IDR comes with the file;
+    // the encoder would only send its last frame again in between
+    if (index == 0 && m_player && m_player->isPlaying()) {
+        return;
+    }
+    if (index < static_cast<int>(m_encoders.size()) && m_encoders[index]) {
+        m_encoders[index]->requestKeyframe();
+    }
+}
+
+int WebRTCClient::get_track_count() const
+{
+    return static_cast<int>(m_encoders.size());
+}
+
+void WebRTCClient::capture_matrix(const InputFrame& input, int track)
+{
+    if (!ws || !ws->isOpen()) {
+        return;
+    }
+
+    if (track < 0 || track >= static_cast<int>(m_encoders.size()) || !m_encoders[track]) {
+        return;
+    }
+
+    // a playing file owns the first track
+    if (track == 0 && m_player && m_player->isPlaying()) {
+        return;
+    }
 
-        // each incoming track should have its own decoder
-        auto& decoder = it->second.decoder;
-        if (!decoder) {
-            decoder = std::make_unique<VideoDecoderLibav>();
+    // stamp the frame as soon as it reaches us, before anything expensive
+    const int64_t capture_us = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch())
+                                   .count();
+
+    m_encoders[track]->submit(input, capture_us);
+}
+
+void WebRTCClient::send_matrix(const matrix_channel::Info& info, const uint8_t* data, const int64_t* dimstride, int track, int inlet, bool delta)
+{
+    if (!ws || !ws->isOpen()) {
+        return;
+    }
+    if (track < 0 || track >= static_cast<int>(m_encoders.size()) || !m_encoders[track]) {
+        return;
+    }
+    // the track is unique in the session, so it is the stream id on the wire
+    if (track > matrix_channel::MaxStream || inlet < 0 || inlet > matrix_channel::MaxInlet) {
+        WLOG_WARN("[Matrix] track %d, inlet %d do not fit the chunk header, not sent", track, inlet);
+        return;
+    }
+
+    if (track >= static_cast<int>(m_matrix_senders.size()) || !m_matrix_senders[track]) {
+        lock_guard<mutex> lock(m_mutex);
+        m_matrix_senders.resize(std::max<size_t>(m_matrix_senders.size(), track + 1));
+        m_matrix_senders[track] = make_unique<MatrixSender>(track, inlet, [this, track](const matrix_channel::Encoded& encoded) {
+            send_matrix_encoded(track, encoded);
+        });
+    }
+    m_matrix_senders[track]->submit(info, data, dimstride, delta);
+}
+
+// runs on the matrix sender thread of the track
+void WebRTCClient::send_matrix_encoded(int track, const matrix_channel::Encoded& encoded)
+{
+    // a peer that is this far behind skips matrices rather than queueing more
+    static constexpr size_t MaxBufferedBytes = 8 << 20;
+
+    vector<shared_ptr<rtc::DataChannel>> channels;
+    size_t max_message = 256 * 1024;
+    bool need_key = false;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& [id, conn] : peerConnectionMap) {
+            auto& dc = conn.data_channel;
+            if (!dc || !dc->isOpen()) {
+                continue;
+            }
+            const bool synced = conn.matrix_synced.count(track) > 0;
+            if (!encoded.key && !synced) {
+                // joined since the last full matrix
+                need_key = true;
+                continue;
+            }
+            if (dc->bufferedAmount() > MaxBufferedBytes) {
+                conn.matrix_synced.erase(track);
+                need_key = true;
+                continue;
+            }
+            conn.matrix_synced.insert(track);
+            max_message = std::min(max_message, dc->maxMessageSize());
+            channels.push_back(dc);
+        }
+        if (need_key && track < static_cast<int>(m_matrix_senders.size()) && m_matrix_senders[track]) {
+            m_matrix_senders[track]->requestKey();
         }
+    }
+    if (channels.empty()) {
+        return;
+    }
 
-        if (decoder->decodeFrame(data, info.timestamp)) {
-            auto decoded = decoder->getDecodedData();
-            video_data_callback(
-                remote_name,
-                decoded.data,
-                decoded.size,
-                decoded.width,
-                decoded.height);
-        };
-    });
+    // cut once for the smallest limit, the messages are the same for every peer
+    auto messages = matrix_channel::chunks(encoded, max_message);
+    for (auto& dc : channels) {
+        for (auto& message : messages) {
+            if (!dc->isOpen()) {
+                break;
+            }
+            dc->send(message.data(), message.size());
+        }
+    }
+}
 
-    peerConnectionMap.emplace(remote_id,
-        ConnectionInfo {
-            pc,
-            videoTrack,
-            nullptr,
-            std::make_unique<VideoDecoderLibav>() });
+// runs on the encoder thread of the track
+void WebRTCClient::send_encoded(int index, const EncodedFrame& encoded, int width, int height)
+{
+    {
+        lock_guard<mutex> lock(m_record_mutex);
+        if (m_send_recorders[index]) {
+            m_send_recorders[index]->push(encoded.data, encoded.size, encoded.pts, encoded.keyframe, width, height);
+        }
+    }
 
-    return pc;
+    auto targets = open_tracks(index, encoded.keyframe);
+    if (targets.empty()) {
+        return;
+    }
+    // one copy for every peer, each sends it on its own thread
+    auto data = make_shared<const vector<uint8_t>>(encoded.data, encoded.data + encoded.size);
+    for (auto& [sender, track] : targets) {
+        sender->push({ track, data, static_cast<uint32_t>(encoded.pts & 0xFFFFFFFF), index, encoded.keyframe });
+    }
+}
+
+std::vector<WebRTCClient::SendTarget> WebRTCClient::open_tracks(int index, bool keyframe)
+{
+    vector<SendTarget> targets;
+    lock_guard<mutex> lock(m_mutex);
+    targets.reserve(peerConnectionMap.size());
+    for (auto& [user_id, conn] : peerConnectionMap) {
+        if (index < static_cast<int>(conn.video_tracks.size()) && conn.video_tracks[index]->isOpen()) {
+            targets.push_back({ conn.sender, conn.video_tracks[index] });
+            if (keyframe && index == 0 && conn.first_keyframe_sent_us < 0) {
+                conn.first_keyframe_sent_us = steady_us();
+            }
+        }
+    }
+    return targets;
+}
+
+void WebRTCClient::play_file(const std::string& path, bool loop)
+{
+    if (!m_player) {
+        // request_keyframe looks at the player from network threads
+        lock_guard<mutex> lock(m_mutex);
+        m_player = make_unique<FilePlayer>(
+            [this](const uint8_t* data, size_t size, int64_t pts, bool keyframe) {
+                send_playback_frame(data, size, pts, keyframe);
+            },
+            [this](const string& message) {
+                CLIENT_LOG(message);
+            });
+    }
+    m_player->stop();
+    m_gop_cache.clear();
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& [user_id, conn] : peerConnectionMap) {
+            conn.playback_synced = false;
+        }
+    }
+    m_player->start(path, loop);
+}
+
+void WebRTCClient::stop_file()
+{
+    if (m_player) {
+        m_player->stop();
+    }
+    m_gop_cache.clear();
 }
 
-void WebRTCClient::capture_matrix(uint8_t* data, int width, int height, int planes)
+void WebRTCClient::set_loop(bool loop)
 {
-    if (!ws->isOpen()) {
+    if (m_player) {
+        m_player->setLoop(loop);
+    }
+}
+
+// runs on the player thread
+void WebRTCClient::send_playback_frame(const uint8_t* data, size_t size, int64_t pts, bool keyframe)
+{
+    if (keyframe) {
+        m_gop_cache.clear();
+    }
+    // only worth keeping once there is a keyframe to start from
+    if (keyframe || !m_gop_cache.empty()) {
+        m_gop_cache.push_back({ vector<uint8_t>(data, data + size), static_cast<uint32_t>(pts & 0xFFFFFFFF) });
+    }
+
+    vector<tuple<shared_ptr<PeerSender>, shared_ptr<rtc::Track>, bool>> targets;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& [user_id, conn] : peerConnectionMap) {
+            if (conn.video_tracks.empty() || !conn.video_tracks.front()->isOpen())
+                continue;
+            // a late joiner gets the current GOP from its keyframe in one go
+            bool catch_up = !conn.playback_synced && !m_gop_cache.empty();
+            targets.push_back({ conn.sender, conn.video_tracks.front(), catch_up });
+            if (catch_up) {
+                conn.playback_synced = true;
+            }
+        }
+    }
+    if (targets.empty()) {
         return;
     }
 
-    if (!m_encoder) {
-        m_encoder = make_unique<VideoEncoderLibav>(width, height);
-    } else if (m_encoder->getWidth() != width || m_encoder->getHeight() != height) {
-        m_encoder->reinit(width, height);
+    auto frame = make_shared<const vector<uint8_t>>(data, data + size);
+    for (auto& [sender, track, catch_up] : targets) {
+        if (catch_up) {
+            // the cache already ends with this frame, the token bucket spreads the burst
+            for (size_t i = 0; i < m_gop_cache.size(); ++i) {
+                auto& cached = m_gop_cache[i];
+                sender->push({ track, make_shared<const vector<uint8_t>>(cached.first), cached.second, 0, i == 0 });
+            }
+        } else {
+            sender->push({ track, frame, static_cast<uint32_t>(pts & 0xFFFFFFFF), 0, keyframe });
+        }
+    }
+}
+
+void WebRTCClient::set_max_fps(double fps, int listener)
+{
+    for_each_encoder(listener, [fps](TrackEncoder& encoder) { encoder.setMaxFps(fps); });
+}
+
+void WebRTCClient::set_send_dim(int width, int height, int listener)
+{
+    for_each_encoder(listener, [width, height](TrackEncoder& encoder) { encoder.setSendDim(width, height); });
+}
+
+void WebRTCClient::set_scale_quality(ScaleQuality quality, int listener)
+{
+    for_each_encoder(listener, [quality](TrackEncoder& encoder) { encoder.setScaleQuality(quality); });
+}
+
+void WebRTCClient::set_intra_refresh(bool enabled, int listener)
+{
+    for_each_encoder(listener, [enabled](TrackEncoder& encoder) { encoder.setIntraRefresh(enabled); });
+}
+
+void WebRTCClient::set_decode_quality(DecodeQuality quality)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_decode_quality = quality;
+    {
+        // warm decoders opened at the old default are replaced in the background
+        lock_guard<mutex> warm_lock(m_warm_mutex);
+        m_warm_quality = quality;
     }
+    m_warm_cv.notify_one();
+    for (auto& [user_id, conn] : peerConnectionMap) {
+        if (conn.decoder) {
+            conn.decoder->setQuality(decode_quality_for(conn.remote_name));
+        }
+    }
+}
 
-    m_encoder->encodeFrame(data);
-    auto encoded = m_encoder->getEncodedData();
+void WebRTCClient::set_peer_decode_quality(const std::string& remote_name, DecodeQuality quality)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_peer_decode_quality[remote_name] = quality;
+    for (auto& [user_id, conn] : peerConnectionMap) {
+        if (conn.decoder && conn.remote_name == remote_name) {
+            conn.decoder->setQuality(quality);
+        }
+    }
+}
 
+void WebRTCClient::set_peer_priority(const std::string& remote_name, FramePool::Priority priority)
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_peer_priority[remote_name] = priority;
     for (auto& [user_id, conn] : peerConnectionMap) {
-        if (!conn.video_track || !conn.video_track->isOpen())
+        if (conn.decoder && conn.remote_name == remote_name) {
+            conn.decoder->setPriority(priority);
+        }
+    }
+}
+
+void WebRTCClient::set_memory_budget(size_t bytes)
+{
+    FramePool::instance().setBudget(bytes);
+}
+
+// call with m_mutex held
+DecodeQuality WebRTCClient::decode_quality_for(const std::string& remote_name) const
+{
+    auto it = m_peer_decode_quality.find(remote_name);
+    return it != m_peer_decode_quality.end() ? it->second : m_decode_quality;
+}
+
+// call with m_mutex held
+std::shared_ptr<VideoDecoderLibav> WebRTCClient::make_decoder(const std::string& remote_name)
+{
+    const DecodeQuality quality = decode_quality_for(remote_name);
+    shared_ptr<VideoDecoderLibav> decoder;
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        auto it = std::find_if(m_warm_decoders.begin(), m_warm_decoders.end(), [quality](const shared_ptr<VideoDecoderLibav>& warm) {
+            return warm->getQuality() == quality;
+        });
+        if (it != m_warm_decoders.end()) {
+            decoder = std::move(*it);
+            m_warm_decoders.erase(it);
+        }
+    }
+    m_warm_cv.notify_one();
+    if (!decoder) {
+        decoder = make_shared<VideoDecoderLibav>(quality);
+    }
+    if (auto it = m_peer_priority.find(remote_name); it != m_peer_priority.end()) {
+        decoder->setPriority(it->second);
+    }
+    return decoder;
+}
+
+// runs on m_warm_thread, building happens outside the locks so a join never waits for it
+void WebRTCClient::warm_run()
+{
+    unique_lock<mutex> lock(m_warm_mutex);
+    while (true) {
+        auto warm_decoders = [this]() {
+            return std::count_if(m_warm_decoders.begin(), m_warm_decoders.end(), [this](const shared_ptr<VideoDecoderLibav>& decoder) {
+                return decoder->getQuality() == m_warm_quality;
+            });
+        };
+        m_warm_cv.wait(lock, [&]() {
+            return m_warm_stopping
+                || (m_warm_enabled && (static_cast<int>(m_warm_peers.size()) < m_warm_target || warm_decoders() < m_warm_target));
+        });
+        if (m_warm_stopping) {
+            break;
+        }
+
+        const bool need_peer = static_cast<int>(m_warm_peers.size()) < m_warm_target;
+        const bool need_decoder = warm_decoders() < m_warm_target;
+        const DecodeQuality quality = m_warm_quality;
+        const uint64_t generation = m_warm_generation;
+        // decoders for an old default are never taken, make room for new ones
+        vector<shared_ptr<VideoDecoderLibav>> stale;
+        for (auto it = m_warm_decoders.begin(); it != m_warm_decoders.end();) {
+            if ((*it)->getQuality() != quality) {
+                stale.push_back(std::move(*it));
+                it = m_warm_decoders.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        lock.unlock();
+        stale.clear();
+
+        WarmPeer peer;
+        if (need_peer) {
+            int count;
+            {
+                lock_guard<mutex> encoders_lock(m_mutex);
+                count = std::max<int>(1, m_encoders.size());
+            }
+            peer.pc = make_shared<rtc::PeerConnection>(peer_config());
+            for (int i = 0; i < count; ++i) {
+                peer.video_tracks.push_back(add_video_track(peer.pc, i));
+            }
+        }
+        // avcodec_open2 and the hardware device are the slow part of a join
+        shared_ptr<VideoDecoderLibav> decoder;
+        if (need_decoder) {
+            decoder = make_shared<VideoDecoderLibav>(quality);
+        }
+
+        lock.lock();
+        // disconnect may have emptied the pool in the meantime, or a
+        // configuration change flushed it while the peer was built
+        if (peer.pc && (!m_warm_enabled || generation != m_warm_generation)) {
+            lock.unlock();
+            peer.pc->close();
+            peer.pc.reset();
+            lock.lock();
+        }
+        if (!m_warm_enabled) {
             continue;
+        }
+        if (peer.pc) {
+            m_warm_peers.push_back(std::move(peer));
+        }
+        if (decoder) {
+            m_warm_decoders.push_back(std::move(decoder));
+        }
+    }
+}
 
-        if (encoded.size > 0) {
-            conn.video_track->sendFrame(
-                reinterpret_cast<const rtc::byte*>(encoded.data),
-                static_cast<uint32_t>(encoded.size),
-                static_cast<uint32_t>(encoded.pts & 0xFFFFFFFF));
+WebRTCClient::WarmPeer WebRTCClient::take_warm_peer()
+{
+    WarmPeer peer;
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        if (!m_warm_peers.empty()) {
+            peer = std::move(m_warm_peers.back());
+            m_warm_peers.pop_back();
         }
     }
+    m_warm_cv.notify_one();
+    return peer;
 }
 
-void WebRTCClient::removePeerConnection(const std::string& remote_id)
+void WebRTCClient::clear_warm_pool()
 {
+    vector<WarmPeer> peers;
+    vector<shared_ptr<VideoDecoderLibav>> decoders;
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        m_warm_enabled = false;
+        ++m_warm_generation;
+        peers.swap(m_warm_peers);
+        decoders.swap(m_warm_decoders);
+    }
+    for (auto& peer : peers) {
+        peer.pc->close();
+    }
+}
 
-    auto it = peerConnectionMap.find(remote_id);
-    if (it == peerConnectionMap.end())
+void WebRTCClient::set_warm_pool(int count)
+{
+    vector<WarmPeer> peers;
+    vector<shared_ptr<VideoDecoderLibav>> decoders;
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        m_warm_target = std::max(0, count);
+        while (static_cast<int>(m_warm_peers.size()) > m_warm_target) {
+            peers.push_back(std::move(m_warm_peers.back()));
+            m_warm_peers.pop_back();
+        }
+        while (static_cast<int>(m_warm_decoders.size()) > m_warm_target) {
+            decoders.push_back(std::move(m_warm_decoders.back()));
+            m_warm_decoders.pop_back();
+        }
+    }
+    m_warm_cv.notify_one();
+    for (auto& peer : peers) {
+        peer.pc->close();
+    }
+}
+
+void WebRTCClient::set_send_rate(double bits_per_second)
+{
+    bits_per_second = std::max(0.0, bits_per_second);
+    if (bits_per_second == m_send_rate) {
         return;
+    }
+    m_send_rate = bits_per_second;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& [user_id, conn] : peerConnectionMap) {
+            conn.sender->setRate(m_send_rate);
+            for (auto& track : conn.video_tracks) {
+                if (auto pacer = track_pacer(track)) {
+                    pacer->setRate(m_send_rate);
+                }
+            }
+        }
+    }
+}
+
+std::string WebRTCClient::get_stats()
+{
+    const int64_t now = steady_us();
+    // ms since join, null until it happened
+    auto since_join = [](int64_t join_us, int64_t at_us) -> json {
+        return at_us < 0 ? json() : json((at_us - join_us) / 1000);
+    };
+
+    json peers = json::object();
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& [user_id, conn] : peerConnectionMap) {
+            peers[user_id] = {
+                { "name", conn.remote_name },
+                { "connected_ms", since_join(conn.join_us, conn.connected_us) },
+                { "first_keyframe_sent_ms", since_join(conn.join_us, conn.first_keyframe_sent_us) },
+                { "first_frame_ms", since_join(conn.join_us, conn.first_frame_us) },
+                { "age_ms", (now - conn.join_us) / 1000 }
+            };
+            if (conn.sender) {
+                const auto send = conn.sender->getStats();
+                peers[user_id]["send"] = {
+                    { "queued_frames", send.queued_frames },
+                    { "queued_bytes", send.queued_bytes },
+                    { "sent_frames", send.sent_frames },
+                    { "dropped_frames", send.dropped_frames }
+                };
+            }
+            if (conn.clock->hasOffset()) {
+                const auto summary = conn.latency->summary();
+                peers[user_id]["clock_offset_ms"] = conn.clock->getOffsetUs() / 1000.0;
+                peers[user_id]["clock_rtt_ms"] = conn.clock->getRttUs() / 1000.0;
+                peers[user_id]["latency"] = {
+                    { "frames", summary.count },
+                    { "mean_ms", summary.mean_ms },
+                    { "p50_ms", summary.p50_ms },
+                    { "p95_ms", summary.p95_ms },
+                    { "max_ms", summary.max_ms }
+                };
+            }
+        }
+    }
 
-    if (it != peerConnectionMap.end()) {
-        auto& conn = it->second;
+    json stats = { { "peers", peers } };
+    {
+        lock_guard<mutex> lock(m_warm_mutex);
+        stats["warm_peers"] = m_warm_peers.size();
+        stats["warm_decoders"] = m_warm_decoders.size();
+    }
+    return stats.dump();
+}
 
-        if (conn.pc) {
-            conn.pc->close();
-            conn.pc.reset();
+void WebRTCClient::start_recording(const std::string& path)
+{
+    stop_recording();
+
+    // the track count only changes on this thread, the writer threads start outside the lock
+    vector<unique_ptr<StreamRecorder>> recorders(m_send_recorders.size());
+    for (size_t i = 0; i < recorders.size(); ++i) {
+        recorders[i] = make_unique<StreamRecorder>(i == 0 ? path : suffixed_path(path, "track" + to_string(i)));
+    }
+
+    {
+        lock_guard<mutex> lock(m_record_mutex);
+        m_record_path = path;
+        for (size_t i = 0; i < m_send_recorders.size(); ++i) {
+            m_send_recorders[i] = std::move(recorders[i]);
+        }
+    }
+    // a recorder starts at a keyframe, which intra refresh would not send on its own
+    for (size_t i = 0; i < recorders.size(); ++i) {
+        request_keyframe(static_cast<int>(i));
+    }
+    CLIENT_LOG("recording to " + path);
+}
+
+void WebRTCClient::stop_recording()
+{
+    {
+        lock_guard<mutex> lock(m_record_mutex);
+        if (m_record_path.empty()) {
+            return;
+        }
+        m_record_path.clear();
+        // recorders flush and finalize their files on the finaliser thread
+        for (auto& recorder : m_send_recorders) {
+            m_finaliser.retire(std::move(recorder));
         }
+        for (auto& [remote_id, recording] : m_peer_recordings) {
+            m_finaliser.retire(std::move(recording.recorder));
+        }
+        m_peer_recordings.clear();
+    }
+    CLIENT_LOG("recording stopped");
+}
 
-        if (conn.decoder) {
-            conn.decoder.reset();
+std::string WebRTCClient::suffixed_path(const std::string& path, const std::string& suffix)
+{
+    string name = suffix;
+    for (auto& c : name) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') {
+            c = '_';
+        }
+    }
+
+    size_t slash = path.find_last_of("/\\");
+    size_t dot = path.find_last_of('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return path + "-" + name;
+    }
+    return path.substr(0, dot) + "-" + name + path.substr(dot);
+}
+
+void WebRTCClient::record_incoming(
+    const std::string& remote_id,
+    const std::string& remote_name,
+    const rtc::binary& data,
+    uint32_t timestamp)
+{
+    string path;
+    {
+        lock_guard<mutex> lock(m_record_mutex);
+        if (m_record_path.empty()) {
+            return;
+        }
+        if (auto it = m_peer_recordings.find(remote_id); it == m_peer_recordings.end()) {
+            path = suffixed_path(m_record_path, remote_name);
+        }
+    }
+
+    // the first frame starts the writer thread, outside the lock
+    unique_ptr<StreamRecorder> created;
+    if (!path.empty()) {
+        created = make_unique<StreamRecorder>(path);
+    }
+
+    lock_guard<mutex> lock(m_record_mutex);
+    if (created) {
+        // recording stopped or restarted meanwhile, or another frame got there first
+        if (m_record_path.empty() || suffixed_path(m_record_path, remote_name) != path || m_peer_recordings.count(remote_id)) {
+            m_finaliser.retire(std::move(created));
+        } else {
+            m_peer_recordings[remote_id].recorder = std::move(created);
+        }
+    }
+    auto it = m_peer_recordings.find(remote_id);
+    if (it == m_peer_recordings.end()) {
+        return;
+    }
+
+    auto& recording = it->second;
+    auto bytes = reinterpret_cast<const uint8_t*>(data.data());
+    // the coded size, the decoder may have scaled its output down
+    int width = 0;
+    int height = 0;
+    h264::spsSize(bytes, data.size(), width, height);
+    recording.recorder->push(
+        bytes,
+        data.size(),
+        recording.clock.unwrap(timestamp),
+        h264::isKeyframe(bytes, data.size()),
+        width,
+        height);
+}
+
+void WebRTCClient::set_frame_dump(const std::string& path)
+{
+    {
+        lock_guard<mutex> lock(m_dump_mutex);
+        m_dump_path = path;
+        // the writers drain their queues on the finaliser thread
+        for (auto& [remote_id, dump] : m_peer_dumps) {
+            m_finaliser.retire(std::move(dump));
         }
+        m_peer_dumps.clear();
+    }
+    CLIENT_LOG(path.empty() ? "frame dump stopped" : "dumping received frames to " + path);
+}
 
-        if (conn.video_track) {
-            conn.video_track.reset();
+// on the peer's frame thread, before decoding so a frame that crashes the decoder is in the file
+void WebRTCClient::dump_incoming(const std::string& remote_id, const std::string& remote_name, const rtc::binary& data, uint32_t timestamp)
+{
+    string path;
+    {
+        lock_guard<mutex> lock(m_dump_mutex);
+        if (m_dump_path.empty()) {
+            return;
+        }
+        if (!m_peer_dumps.count(remote_id)) {
+            path = suffixed_path(m_dump_path, remote_name);
         }
+    }
 
-        if (conn.data_channel) {
-            conn.data_channel.reset();
+    // the first frame starts the writer thread, outside the lock
+    unique_ptr<FrameDumpWriter> created;
+    if (!path.empty()) {
+        created = make_unique<FrameDumpWriter>(path);
+    }
+
+    lock_guard<mutex> lock(m_dump_mutex);
+    if (created) {
+        // dumping stopped or restarted meanwhile, or another frame got there first
+        if (m_dump_path.empty() || suffixed_path(m_dump_path, remote_name) != path || m_peer_dumps.count(remote_id)) {
+            m_finaliser.retire(std::move(created));
+        } else {
+            m_peer_dumps[remote_id] = std::move(created);
         }
+    }
+    auto it = m_peer_dumps.find(remote_id);
+    if (it == m_peer_dumps.end()) {
+        return;
+    }
+    it->second->push(reinterpret_cast<const uint8_t*>(data.data()), data.size(), timestamp, steady_us());
+}
+
+void WebRTCClient::set_static_skip(bool enabled, int listener)
+{
+    for_each_encoder(listener, [enabled](TrackEncoder& encoder) { encoder.setStaticSkip(enabled); });
+}
 
+void WebRTCClient::removePeerConnection(const std::string& remote_id)
+{
+    ConnectionInfo conn;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = peerConnectionMap.find(remote_id);
+        if (it == peerConnectionMap.end())
+            return;
+        conn = std::move(it->second);
         peerConnectionMap.erase(it);
+    }
+
+    if (conn.pc) {
+        conn.pc->close();
+        conn.pc.reset();
+    }
+
+    if (conn.decoder) {
+        conn.decoder.reset();
+    }
+
+    // the sender thread may be waiting in the pacer, let it finish so it can be joined
+    for (auto& track : conn.video_tracks) {
+        if (auto pacer = track_pacer(track)) {
+            pacer->close();
+        }
+    }
+    conn.video_tracks.clear();
 
-        log("pc connection closed");
-        log("Remove peer from map for id: " + remote_id);
+    if (conn.data_channel) {
+        conn.data_channel.reset();
+    }
+
+    {
+        // a peer that left removes its ring, unless another one of that name still sends
+        lock_guard<mutex> lock(m_mutex);
+        bool name_in_use = std::any_of(peerConnectionMap.begin(), peerConnectionMap.end(), [&conn](const auto& entry) {
+            return entry.second.remote_name == conn.remote_name;
+        });
+        if (!name_in_use) {
+            lock_guard<mutex> shm_lock(m_shm_mutex);
+            m_shm_outputs.erase(conn.remote_name);
+        }
     }
+
+    {
+        lock_guard<mutex> lock(m_record_mutex);
+        if (auto rt = m_peer_recordings.find(remote_id); rt != m_peer_recordings.end()) {
+            m_finaliser.retire(std::move(rt->second.recorder));
+            m_peer_recordings.erase(rt);
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(m_dump_mutex);
+        if (auto dt = m_peer_dumps.find(remote_id); dt != m_peer_dumps.end()) {
+            m_finaliser.retire(std::move(dt->second));
+            m_peer_dumps.erase(dt);
+        }
+    }
+
+    CLIENT_LOG("pc connection closed");
+    CLIENT_LOG("Remove peer from map for id: " + remote_id);
 }
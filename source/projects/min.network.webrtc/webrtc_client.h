@@ -1,5 +1,10 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <mutex>
+#include <set>
+#include <thread>
 
 #include "rtc/rtc.hpp"
 #include <rtc/websocket.hpp>
@@ -8,41 +13,161 @@
 #include <nlohmann/json.hpp>
 #include "videoencoder_libav.h"
 #include "videodecoder_libav.h"
+#include "track_encoder.h"
+#include "stream_recorder.h"
+#include "frame_dump.h"
+#include "finaliser.h"
+#include "file_player.h"
+#include "clock_sync.h"
+#include "shm_ring.h"
+#include "matrix_channel.h"
+#include "peer_sender.h"
+#include "logger.h"
 
 class WebRTCClient {
 
 public:
+    using VideoCallback = std::function<void(
+        const std::string& remote_username,
+        const uint8_t* argb,
+        size_t size,
+        int width,
+        int height)>;
+
+    using MatrixCallback = std::function<void(
+        const std::string& remote_username,
+        const matrix_channel::Matrix& matrix)>;
+
+    // one user of a client, callbacks arrive on network threads
+    struct Listener {
+        std::function<void(const std::string&)> log_callback;
+        std::function<void(const std::string&)> dc_callback;
+        VideoCallback video_data_callback;
+        MatrixCallback matrix_callback;
+    };
+
+    struct Attachment {
+        int id;
+        int first_track; // the listener's tracks are first_track .. first_track + track_count - 1
+        int track_count;
+        bool owner; // the first listener, it gets the remote output
+    };
+
+    static constexpr int AllListeners = -1;
+
+    WebRTCClient();
+    // a client with a single listener
     WebRTCClient(
         std::function<void(const std::string&)> log_callback,
         std::function<void(const std::string&)> dc_callback,
-        std::function<void(
-            const std::string& remote_username,
-            const uint8_t* argb,
-            size_t size,
-            int width,
-            int height)> video_data_callback);
+        VideoCallback video_data_callback,
+        int track_count = 1);
 
     ~WebRTCClient();
 
+    // clients with the same session name share the WebSocket and peer connections,
+    // an empty name always gives a new client
+    static std::shared_ptr<WebRTCClient> acquire_session(const std::string& session);
+
+    // adds track_count outgoing tracks, reusing the slots of removed listeners
+    // where it can; existing peers get any new tracks by renegotiation.
+    // Remote video, matrices and log lines go to the first listener only,
+    // DataChannel messages to all of them
+    Attachment add_listener(Listener listener, int track_count);
+    // stops the listener's encoders and callbacks, its tracks stay in the
+    // connections until the next listener takes them over
+    void remove_listener(int id);
+
+    // a shared session connects once, later calls are ignored while it is open
     void connect(const std::string& url, const std::string& name);
     void disconnect();
-    void capture_matrix(uint8_t* argb_data, int width, int height, int planes);
+    int get_track_count() const;
+    // track selects the outgoing video track, frames are encoded on that track's thread
+    void capture_matrix(const InputFrame& input, int track = 0);
+    // sends the matrix losslessly over the DataChannel instead of the video
+    // track, compressed and, with delta, as the change to the previous one.
+    // track is the stream id on the wire, unique in a shared session; inlet,
+    // 0 to 255, names the matrix on the receiving side
+    void send_matrix(const matrix_channel::Info& info, const uint8_t* data, const int64_t* dimstride, int track = 0, int inlet = 0, bool delta = true);
+    // encoder settings apply to the listener's tracks
+    void set_max_fps(double fps, int listener = AllListeners);
+    void set_static_skip(bool enabled, int listener = AllListeners);
+    // 0 keeps the input size, a single 0 keeps the input aspect ratio
+    void set_send_dim(int width, int height, int listener = AllListeners);
+    void set_scale_quality(ScaleQuality quality, int listener = AllListeners);
+    // rolling intra refresh with capped frame sizes instead of an IDR every second,
+    // IDRs are still sent when a peer joins or asks with a PLI
+    void set_intra_refresh(bool enabled, int listener = AllListeners);
+
+    // the link rate video is paced at per peer, both the frames leaving its
+    // queue and the packets of each frame; 0 sends unpaced. Applies to
+    // connected peers right away
+    void set_send_rate(double bits_per_second);
+
+    // for venues where every peer is on the same LAN: host candidates only, all
+    // connections on one UDP port, and no trickle ICE, the answer carries the
+    // candidates so a browser connects after a single offer/answer exchange.
+    // Applies to peers joining afterwards
+    void set_lan_mode(bool enabled, uint16_t port);
+
+    // decode cost of incoming video, the per peer setting wins over the default
+    void set_decode_quality(DecodeQuality quality);
+    void set_peer_decode_quality(const std::string& remote_name, DecodeQuality quality);
+    // which peers are degraded first when the shared frame pool is over budget
+    void set_peer_priority(const std::string& remote_name, FramePool::Priority priority);
+    // bytes for decoded frames across all clients in the process, 0 for no limit
+    static void set_memory_budget(size_t bytes);
+
+    // peer connections and decoders kept ready for the next joining browsers,
+    // filled in the background while connected. 0 builds them on join
+    void set_warm_pool(int count);
+
+    // per peer join timings, capture to display latency of received video
+    // and the warm pool, as a JSON object
+    std::string get_stats();
+
+    // also publish each peer's decoded frames to the shared memory ring
+    // /<prefix>.<peer name> for other processes, see SharedFrameReader. An
+    // empty prefix stops publishing
+    void set_shm_output(const std::string& prefix);
+
+    // remux the first sent stream to path, further tracks to path-track<n> and
+    // each received stream to path-<peer>, the container follows the extension (.mp4, .mkv, .mov).
+    // Tracks added while recording are recorded from their first frame
+    void start_recording(const std::string& path);
+    void stop_recording();
+
+    // write each received stream, still undecoded, to path-<peer> for
+    // webrtc_replay; an empty path stops
+    void set_frame_dump(const std::string& path);
+
+    // stream an H264 file on the first track as is, capture_matrix to it is ignored while playing
+    void play_file(const std::string& path, bool loop);
+    void stop_file();
+    void set_loop(bool loop);
 
 private:
     std::mutex m_mutex;
-    // max callbacks
-    std::function<void(const std::string&)> log_callback;
-    std::function<void(const std::string&)> dc_callback;
-    std::function<void(
-        const std::string& remote_username,
-        const uint8_t* data,
-        size_t size,
-        int width,
-        int height)>
-        video_data_callback;
 
-    void log(const std::string& message);
-    void dc_send(const std::string& message);
+    // max callbacks, invoked under m_listener_mutex so remove_listener waits for them
+    struct ListenerEntry {
+        Listener listener;
+        int first_track;
+        int track_count;
+    };
+    std::mutex m_listener_mutex;
+    std::map<int, ListenerEntry> m_listeners;
+    int m_next_listener = 1;
+    ListenerEntry* owner(); // under m_listener_mutex
+
+    void notify_log(const std::string& line);
+    void notify_dc(const std::string& message);
+    void notify_video(const std::string& remote_username, const DecodedData& decoded);
+    void notify_matrix(const std::string& remote_username, const matrix_channel::Matrix& matrix);
+    template <class Fn>
+    void for_each_encoder(int listener, Fn fn);
+
+    int m_log_sink = 0;
     // static std::string generate_simple_id();
 
     // rtc members
@@ -59,13 +184,123 @@ private:
     void removePeerConnection(
         const std::string& user_id);
 
+    std::shared_ptr<rtc::PeerConnection> find_peer(const std::string& remote_id);
+    // tracks at index that can take a frame right now, collected under m_mutex
+    // with their peer's sender; marks the peers that get their first keyframe
+    using SendTarget = std::pair<std::shared_ptr<PeerSender>, std::shared_ptr<rtc::Track>>;
+    std::vector<SendTarget> open_tracks(int index, bool keyframe = false);
+    std::atomic<double> m_send_rate { 10e6 };
+
+    // peer connection configuration, changed from the Max thread
+    std::atomic<bool> m_lan_mode { false };
+    std::atomic<uint16_t> m_lan_port { 50000 };
+    rtc::Configuration peer_config() const;
+    void flush_warm_peers();
+    std::shared_ptr<rtc::Track> add_video_track(const std::shared_ptr<rtc::PeerConnection>& pc, int index);
+    // asks the encoder of the track for an IDR, from a network thread
+    void request_keyframe(int index);
+
     struct ConnectionInfo {
         std::shared_ptr<rtc::PeerConnection> pc;
-        std::shared_ptr<rtc::Track> video_track;
+        // one per outgoing feed, the first one also carries the remote video
+        std::vector<std::shared_ptr<rtc::Track>> video_tracks;
         std::shared_ptr<rtc::DataChannel> data_channel;
-        std::unique_ptr<VideoDecoderLibav> decoder;
+        std::shared_ptr<VideoDecoderLibav> decoder;
+        // the peer's paced send queue, shared so frames are pushed outside m_mutex
+        std::shared_ptr<PeerSender> sender;
+        // has been sent the cached GOP of the playing file
+        bool playback_synced = false;
+        std::string remote_name;
+        // steady clock us, the others are -1 until they happen
+        int64_t join_us = 0;
+        int64_t connected_us = -1;
+        int64_t first_keyframe_sent_us = -1;
+        int64_t first_frame_us = -1;
+        // capture to display latency, needs the sender's capture time SEI and a clock offset
+        std::shared_ptr<ClockSync> clock = std::make_shared<ClockSync>();
+        std::shared_ptr<LatencyStats> latency = std::make_shared<LatencyStats>();
+        int64_t last_ping_us = 0;
+        // tracks whose previous matrix the peer has, so it can take a delta
+        std::set<int> matrix_synced;
+        std::shared_ptr<MatrixReceiver> matrix_receiver = std::make_shared<MatrixReceiver>();
     };
+    // the capture time on our clock, -1 until the offset is known
+    int64_t measure_latency(const std::string& remote_id, int64_t capture_us);
 
+    // guarded by m_mutex, frames are sent from outside the lock
     std::unordered_map<std::string, ConnectionInfo> peerConnectionMap;
-    std::unique_ptr<VideoEncoderLibav> m_encoder;
+
+    // guarded by m_mutex
+    DecodeQuality m_decode_quality = DecodeQuality::Full;
+    std::unordered_map<std::string, DecodeQuality> m_peer_decode_quality; // by remote name
+    std::unordered_map<std::string, FramePool::Priority> m_peer_priority; // by remote name
+    DecodeQuality decode_quality_for(const std::string& remote_name) const;
+    std::shared_ptr<VideoDecoderLibav> make_decoder(const std::string& remote_name);
+
+    // Warm pool. A peer connection is built with its tracks and media handlers
+    // but no callbacks, those need the remote id and are set when it is taken.
+    // Decoders are opened at the default quality.
+    struct WarmPeer {
+        std::shared_ptr<rtc::PeerConnection> pc;
+        std::vector<std::shared_ptr<rtc::Track>> video_tracks;
+    };
+    std::mutex m_warm_mutex;
+    std::condition_variable m_warm_cv;
+    std::vector<WarmPeer> m_warm_peers;
+    std::vector<std::shared_ptr<VideoDecoderLibav>> m_warm_decoders;
+    int m_warm_target = 2;
+    DecodeQuality m_warm_quality = DecodeQuality::Full; // m_decode_quality, readable without m_mutex
+    bool m_warm_enabled = false; // while connected
+    uint64_t m_warm_generation = 0; // bumped when pooled peers no longer match the configuration
+    bool m_warm_stopping = false;
+    std::thread m_warm_thread;
+    void warm_run();
+    WarmPeer take_warm_peer();
+    void clear_warm_pool();
+
+    // closes recorders and dump writers off the calling thread
+    Finaliser m_finaliser;
+
+    // recording, guarded by m_record_mutex since frames arrive on network threads
+    struct PeerRecording {
+        std::unique_ptr<StreamRecorder> recorder;
+        RtpTimestampUnwrapper clock;
+    };
+    std::mutex m_record_mutex;
+    std::string m_record_path;
+    std::vector<std::unique_ptr<StreamRecorder>> m_send_recorders; // per track
+    std::unordered_map<std::string, PeerRecording> m_peer_recordings;
+
+    // shared memory output, by remote name; the entry mutex keeps one writer per ring
+    struct ShmOutput {
+        std::mutex mutex;
+        std::unique_ptr<SharedFrameRing> ring;
+    };
+    std::mutex m_shm_mutex;
+    std::string m_shm_prefix;
+    std::unordered_map<std::string, std::shared_ptr<ShmOutput>> m_shm_outputs;
+    void publish_shm(const std::string& remote_id, const std::string& remote_name, const DecodedData& decoded, int64_t timestamp_us);
+
+    // file passthrough
+    std::unique_ptr<FilePlayer> m_player;
+    std::vector<std::pair<std::vector<uint8_t>, uint32_t>> m_gop_cache; // player thread only
+    void send_playback_frame(const uint8_t* data, size_t size, int64_t pts, bool keyframe);
+
+    // frame dumps by remote id, guarded by m_dump_mutex
+    std::mutex m_dump_mutex;
+    std::string m_dump_path;
+    std::unordered_map<std::string, std::unique_ptr<FrameDumpWriter>> m_peer_dumps;
+    void dump_incoming(const std::string& remote_id, const std::string& remote_name, const rtc::binary& data, uint32_t timestamp);
+
+    static std::string suffixed_path(const std::string& path, const std::string& suffix);
+    void record_incoming(const std::string& remote_id, const std::string& remote_name, const rtc::binary& data, uint32_t timestamp);
+
+    // outgoing feeds by track, a detached listener leaves empty slots. Only
+    // the Max thread changes the vector, under m_mutex
+    std::vector<std::unique_ptr<TrackEncoder>> m_encoders;
+    void send_encoded(int index, const EncodedFrame& encoded, int width, int height);
+
+    // matrices over the DataChannel by track, created on first use; changed like m_encoders
+    std::vector<std::unique_ptr<MatrixSender>> m_matrix_senders;
+    void send_matrix_encoded(int track, const matrix_channel::Encoded& encoded);
 };
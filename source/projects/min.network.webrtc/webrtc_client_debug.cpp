@@ -64,6 +64,7 @@ int main()
     };
     size_t dim_idx = 0;
     auto last_switch = std::chrono::steady_clock::now();
+    auto last_stats = last_switch;
 
     int width = dims[dim_idx].first;
     int height = dims[dim_idx].second;
@@ -86,6 +87,11 @@ int main()
             last_switch = now;
             // std::cout << "[Debug] Switch to " << width << "x" << height << std::endl;
         }
+        // join timings and capture to display latency per peer
+        if (std::chrono::duration_cast<std::chrono::seconds>(now - last_stats).count() >= 5) {
+            std::cout << "[stats]: " << client.get_stats() << std::endl;
+            last_stats = now;
+        }
 
         std::this_thread::sleep_for(std::chrono::milliseconds(33));
         uint8_t r = dis(gen);
@@ -98,7 +104,7 @@ int main()
             argb_data[i + 3] = b;
         }
 
-        client.capture_matrix(argb_data.data(), width, height, planes);
+        client.capture_matrix({ argb_data.data(), width, height, width * planes, InputFormat::ARGB });
     }
 
     if (input_thread.joinable()) {
@@ -0,0 +1,141 @@
+// Replays a frame dump (the dump message of min.network.webrtc) through the
+// decoder and the ARGB conversion without any network, as a decode benchmark
+// or to reproduce a stream that misbehaved in the field.
+//
+//   webrtc_replay <file.mnwd> [--realtime] [--quality full|reduced|preview] [--loops n]
+#include "frame_dump.h"
+#include "videodecoder_libav.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static void usage()
+{
+    std::cerr << "usage: webrtc_replay <file.mnwd> [--realtime] [--quality full|reduced|preview] [--loops n]" << std::endl;
+}
+
+// FNV-1a over the decoded pictures, equal across runs when decoding is
+// deterministic (software decode; hardware decoders may differ in the last bits)
+static uint64_t hash_frame(uint64_t hash, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static double percentile(std::vector<int64_t> samples, double p)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t index = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index] / 1000.0;
+}
+
+int main(int argc, char** argv)
+{
+    std::string path;
+    bool realtime = false;
+    int loops = 1;
+    DecodeQuality quality = DecodeQuality::Full;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--realtime") {
+            realtime = true;
+        } else if (arg == "--loops" && i + 1 < argc) {
+            loops = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--quality" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (value == "full") {
+                quality = DecodeQuality::Full;
+            } else if (value == "reduced") {
+                quality = DecodeQuality::Reduced;
+            } else if (value == "preview") {
+                quality = DecodeQuality::Preview;
+            } else {
+                usage();
+                return 1;
+            }
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (path.empty()) {
+        usage();
+        return 1;
+    }
+
+    FrameDumpReader reader;
+    if (!reader.open(path)) {
+        std::cerr << "cannot read frame dump " << path << std::endl;
+        return 1;
+    }
+
+    VideoDecoderLibav decoder(quality);
+    frame_dump::Record record;
+    std::vector<uint8_t> output; // stands in for the Max matrix the ARGB is copied to
+    std::vector<int64_t> decode_us;
+    uint64_t frames = 0, decoded = 0, bytes = 0;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    int width = 0, height = 0;
+
+    const auto start = Clock::now();
+    for (int loop = 0; loop < loops; ++loop) {
+        reader.rewind();
+        const auto loop_start = Clock::now();
+        int64_t first_arrival = -1;
+
+        while (reader.next(record)) {
+            if (realtime) {
+                // keep the recorded arrival spacing, network jitter included
+                if (first_arrival < 0) {
+                    first_arrival = record.arrival_us;
+                }
+                std::this_thread::sleep_until(loop_start + std::chrono::microseconds(record.arrival_us - first_arrival));
+            }
+
+            std::vector<std::byte> binary(record.data.size());
+            std::memcpy(binary.data(), record.data.data(), record.data.size());
+
+            const auto before = Clock::now();
+            bool ok = decoder.decodeFrame(binary, record.timestamp);
+            if (ok) {
+                auto data = decoder.getDecodedData();
+                output.assign(data.data, data.data + data.size);
+                hash = hash_frame(hash, output.data(), output.size());
+                width = data.width;
+                height = data.height;
+                ++decoded;
+            }
+            decode_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - before).count());
+            ++frames;
+            bytes += record.data.size();
+        }
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (frames == 0) {
+        std::cerr << "no frames in " << path << std::endl;
+        return 1;
+    }
+
+    std::cout << "frames in:   " << frames << " (" << bytes / 1024 << " KiB)" << std::endl;
+    std::cout << "decoded:     " << decoded << " at " << width << "x" << height << std::endl;
+    std::cout << "wall time:   " << seconds << " s, " << (seconds > 0 ? decoded / seconds : 0) << " fps" << std::endl;
+    std::cout << "decode ms:   p50 " << percentile(decode_us, 0.5) << ", p95 " << percentile(decode_us, 0.95)
+              << ", max " << percentile(decode_us, 1.0) << std::endl;
+    std::cout << "output hash: " << std::hex << hash << std::dec << std::endl;
+    return 0;
+}
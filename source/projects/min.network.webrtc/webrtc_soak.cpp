@@ -0,0 +1,482 @@
+// Peer churn soak test. A WebRTCClient sends video through an in-process
+// SignalingServer while simulated browsers (libdatachannel offerers, like the
+// web page: a DataChannel and a receive-only video track) join, wait for the
+// first frame and leave, thousands of times. Time to connected and to first
+// frame, RSS, open file descriptors and threads are sampled along the way;
+// the run fails when a resource keeps growing or setup gets slower.
+//
+//   webrtc_soak [--cycles n] [--warmup n] [--sample n] [--timeout ms] [--csv file]
+//               [--max-rss-growth-mb mb] [--max-fd-growth n] [--max-thread-growth n]
+#include "webrtc_client.h"
+#include "signaling_server.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <libproc.h>
+#include <unistd.h>
+#endif
+
+using Clock = std::chrono::steady_clock;
+using json = nlohmann::json;
+
+static std::atomic<bool> g_should_exit { false };
+
+static void signal_handler(int signal)
+{
+    if (signal == SIGINT) {
+        g_should_exit = true;
+    }
+}
+
+static double ms_since(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// the whole process: the client, the server and the simulated browsers
+struct Resources {
+    double rss_mb = -1;
+    long fds = -1;
+    long threads = -1;
+};
+
+static Resources sample_resources()
+{
+    Resources resources;
+#if defined(__linux__)
+    long pages_total = 0, pages_resident = 0;
+    if (FILE* statm = fopen("/proc/self/statm", "r")) {
+        if (fscanf(statm, "%ld %ld", &pages_total, &pages_resident) == 2) {
+            resources.rss_mb = pages_resident * static_cast<double>(sysconf(_SC_PAGESIZE)) / (1024 * 1024);
+        }
+        fclose(statm);
+    }
+    if (DIR* dir = opendir("/proc/self/fd")) {
+        resources.fds = 0;
+        while (readdir(dir)) {
+            ++resources.fds;
+        }
+        closedir(dir);
+        // ".", ".." and the directory itself
+        resources.fds -= 3;
+    }
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("Threads:", 0) == 0) {
+            resources.threads = std::stol(line.substr(8));
+        }
+    }
+#elif defined(__APPLE__)
+    proc_taskinfo info;
+    if (proc_pidinfo(getpid(), PROC_PIDTASKINFO, 0, &info, sizeof(info)) == sizeof(info)) {
+        resources.rss_mb = info.pti_resident_size / (1024.0 * 1024.0);
+        resources.threads = info.pti_threadnum;
+    }
+    int bytes = proc_pidinfo(getpid(), PROC_PIDLISTFDS, 0, nullptr, 0);
+    if (bytes > 0) {
+        std::vector<proc_fdinfo> fds(bytes / PROC_PIDLISTFD_SIZE);
+        bytes = proc_pidinfo(getpid(), PROC_PIDLISTFDS, 0, fds.data(), bytes);
+        resources.fds = bytes / PROC_PIDLISTFD_SIZE;
+    }
+#endif
+    return resources;
+}
+
+// One simulated browser: joins the signaling server, offers to the Max
+// client and waits for its video.
+class SoakPeer {
+public:
+    struct Result {
+        bool ok = false;
+        double connected_ms = -1;
+        double first_frame_ms = -1;
+        std::string error;
+    };
+
+    SoakPeer(const std::string& url, int number)
+        : id("soak-" + std::to_string(number))
+        , url(url + "?id=" + id + "&username=" + id + "&role=Browser")
+    {
+    }
+
+    ~SoakPeer()
+    {
+        // callbacks capture this, reset waits for one still running
+        for (auto& channel : std::vector<std::shared_ptr<rtc::Channel>> { track, dc, ws }) {
+            if (channel) {
+                channel->resetCallbacks();
+            }
+        }
+        if (pc) {
+            pc->resetCallbacks();
+            pc->close();
+        }
+        if (ws) {
+            ws->close();
+        }
+    }
+
+    Result join(std::chrono::milliseconds timeout)
+    {
+        start = Clock::now();
+        ws = std::make_shared<rtc::WebSocket>();
+        ws->onMessage([this](rtc::message_variant data) {
+            if (std::holds_alternative<std::string>(data)) {
+                onSignal(std::get<std::string>(data));
+            }
+        });
+        ws->open(url);
+
+        Result result;
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!cv.wait_for(lock, timeout, [this] { return (connected && framed) || !error.empty(); })) {
+            result.error = !connected ? "not connected" : "no frame";
+        } else {
+            result.error = error;
+        }
+        result.ok = result.error.empty();
+        if (connected) {
+            result.connected_ms = ms_since(start, connected_at);
+        }
+        if (framed) {
+            result.first_frame_ms = ms_since(start, framed_at);
+        }
+        return result;
+    }
+
+    // graceful: the peer connection closes before the page goes, otherwise
+    // the signaling socket drops first as when a tab is closed
+    void leave(bool graceful)
+    {
+        if (graceful) {
+            if (pc) {
+                pc->close();
+            }
+            ws->close();
+        } else {
+            ws->close();
+            if (pc) {
+                pc->close();
+            }
+        }
+    }
+
+private:
+    void fail(const std::string& message)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error.empty()) {
+            error = message;
+        }
+        cv.notify_all();
+    }
+
+    void signal(const json& message)
+    {
+        if (ws && ws->isOpen()) {
+            ws->send(message.dump());
+        }
+    }
+
+    void onSignal(const std::string& text)
+    {
+        json message = json::parse(text, nullptr, false);
+        if (message.is_discarded()) {
+            return;
+        }
+        const std::string type = message.value("signalingType", "");
+        const json& content = message["content"];
+
+        if (type == "Clients") {
+            for (auto& client : content) {
+                if (client["properties"].value("role", "") == "Jitter") {
+                    offer(client.value("id", ""));
+                    return;
+                }
+            }
+            fail("no Max client on the server");
+        } else if ((type == "Answer" || type == "Offer") && pc) {
+            // Max renegotiates with an Offer of its own, the answer is automatic
+            pc->setRemoteDescription(rtc::Description(content.value("sdp", ""), content.value("type", "")));
+        } else if (type == "Ice" && pc) {
+            pc->addRemoteCandidate(rtc::Candidate(content.value("candidate", ""), content.value("sdpMid", "")));
+        }
+    }
+
+    void offer(const std::string& target)
+    {
+        pc = std::make_shared<rtc::PeerConnection>();
+        pc->onLocalDescription([this, target](rtc::Description description) {
+            std::string type = description.typeString();
+            type[0] = static_cast<char>(std::toupper(type[0]));
+            signal({ { "target", target },
+                { "signalingType", type },
+                { "content", { { "type", description.typeString() }, { "sdp", std::string(description) } } } });
+        });
+        pc->onLocalCandidate([this, target](rtc::Candidate candidate) {
+            signal({ { "target", target },
+                { "signalingType", "Ice" },
+                { "content", { { "candidate", candidate.candidate() }, { "sdpMid", candidate.mid() } } } });
+        });
+        pc->onStateChange([this](rtc::PeerConnection::State state) {
+            if (state == rtc::PeerConnection::State::Connected) {
+                std::lock_guard<std::mutex> lock(mutex);
+                connected = true;
+                connected_at = Clock::now();
+                cv.notify_all();
+            } else if (state == rtc::PeerConnection::State::Failed) {
+                fail("connection failed");
+            }
+        });
+
+        // the mid of the Max side's first track, so its video is offered to us
+        rtc::Description::Video media("jitter-media", rtc::Description::Direction::RecvOnly);
+        media.addH264Codec(96);
+        track = pc->addTrack(media);
+        auto depacketizer = std::make_shared<rtc::H264RtpDepacketizer>(rtc::NalUnit::Separator::StartSequence);
+        depacketizer->addToChain(std::make_shared<rtc::RtcpReceivingSession>());
+        track->setMediaHandler(depacketizer);
+        track->onFrame([this](rtc::binary, rtc::FrameInfo) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!framed) {
+                framed = true;
+                framed_at = Clock::now();
+                cv.notify_all();
+            }
+        });
+
+        // as the web page, creating the channel starts the negotiation
+        dc = pc->createDataChannel("min-network-datachannel");
+    }
+
+    const std::string id;
+    const std::string url;
+
+    std::shared_ptr<rtc::WebSocket> ws;
+    std::shared_ptr<rtc::PeerConnection> pc;
+    std::shared_ptr<rtc::Track> track;
+    std::shared_ptr<rtc::DataChannel> dc;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    Clock::time_point start, connected_at, framed_at;
+    bool connected = false;
+    bool framed = false;
+    std::string error;
+};
+
+// median of a window, robust to a single slow cycle or a GC-like RSS blip
+template <class T>
+static double median(std::vector<T> values)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return static_cast<double>(values[values.size() / 2]);
+}
+
+static void usage()
+{
+    std::cerr << "usage: webrtc_soak [--cycles n] [--warmup n] [--sample n] [--timeout ms] [--csv file]\n"
+                 "                   [--max-rss-growth-mb mb] [--max-fd-growth n] [--max-thread-growth n]"
+              << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    int cycles = 1000;
+    int warmup = 20; // caches, pools and lazily started threads settle first
+    int sample_every = 10;
+    int timeout_ms = 10000;
+    double max_rss_growth_mb = 32;
+    long max_fd_growth = 8;
+    long max_thread_growth = 4;
+    std::string csv_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : "0"; };
+        if (arg == "--cycles") {
+            cycles = std::max(1, std::atoi(value()));
+        } else if (arg == "--warmup") {
+            warmup = std::max(0, std::atoi(value()));
+        } else if (arg == "--sample") {
+            sample_every = std::max(1, std::atoi(value()));
+        } else if (arg == "--timeout") {
+            timeout_ms = std::max(100, std::atoi(value()));
+        } else if (arg == "--csv") {
+            csv_path = value();
+        } else if (arg == "--max-rss-growth-mb") {
+            max_rss_growth_mb = std::atof(value());
+        } else if (arg == "--max-fd-growth") {
+            max_fd_growth = std::atol(value());
+        } else if (arg == "--max-thread-growth") {
+            max_thread_growth = std::atol(value());
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    std::signal(SIGINT, signal_handler);
+    Logger::setLevel(LogLevel::Warning);
+
+    SignalingServer server;
+    SignalingServer::Options options;
+    options.bind_address = "127.0.0.1";
+    if (!server.start(options)) {
+        std::cerr << "cannot start the signaling server" << std::endl;
+        return 1;
+    }
+    const std::string url = "ws://127.0.0.1:" + std::to_string(server.getPort()) + "/ws";
+
+    WebRTCClient client([](const std::string&) {}, [](const std::string&) {}, nullptr);
+    client.set_static_skip(false);
+    client.connect(url, "Soak#Max");
+
+    // a moving picture so every frame is encoded and sent
+    std::atomic<bool> feeding { true };
+    std::thread feeder([&]() {
+        const int width = 320, height = 240;
+        std::vector<uint8_t> argb(width * height * 4);
+        for (uint8_t n = 0; feeding; ++n) {
+            std::fill(argb.begin(), argb.end(), n);
+            client.capture_matrix({ argb.data(), width, height, width * 4, InputFormat::ARGB });
+            std::this_thread::sleep_for(std::chrono::milliseconds(33));
+        }
+    });
+
+    std::ofstream csv;
+    if (!csv_path.empty()) {
+        csv.open(csv_path);
+        csv << "cycle,connected_ms,first_frame_ms,rss_mb,fds,threads" << std::endl;
+    }
+
+    struct Sample {
+        int cycle;
+        Resources resources;
+    };
+    std::vector<Sample> samples;
+    std::vector<double> connected_ms, first_frame_ms;
+    int failures = 0, lingering = 0;
+
+    for (int cycle = 0; cycle < cycles && !g_should_exit; ++cycle) {
+        SoakPeer::Result result;
+        {
+            SoakPeer peer(url, cycle);
+            result = peer.join(std::chrono::milliseconds(timeout_ms));
+            peer.leave(cycle % 2 == 0);
+        }
+
+        // the client must have let go of the peer, through ClientExit or the closed connection
+        bool removed = false;
+        const auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (!removed && Clock::now() < deadline) {
+            removed = json::parse(client.get_stats())["peers"].empty() && server.getClientCount() == 1;
+            if (!removed) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+
+        if (!result.ok) {
+            ++failures;
+            std::cerr << "cycle " << cycle << ": " << result.error << std::endl;
+        } else if (cycle >= warmup) {
+            connected_ms.push_back(result.connected_ms);
+            first_frame_ms.push_back(result.first_frame_ms);
+        }
+        if (!removed) {
+            ++lingering;
+            std::cerr << "cycle " << cycle << ": peer still held after leaving" << std::endl;
+        }
+
+        if (cycle >= warmup && (cycle - warmup) % sample_every == 0) {
+            Sample sample { cycle, sample_resources() };
+            samples.push_back(sample);
+            std::cout << "cycle " << cycle
+                      << "  connected " << result.connected_ms << " ms"
+                      << "  first frame " << result.first_frame_ms << " ms"
+                      << "  rss " << sample.resources.rss_mb << " MB"
+                      << "  fds " << sample.resources.fds
+                      << "  threads " << sample.resources.threads << std::endl;
+            if (csv.is_open()) {
+                csv << cycle << "," << result.connected_ms << "," << result.first_frame_ms << ","
+                    << sample.resources.rss_mb << "," << sample.resources.fds << "," << sample.resources.threads << std::endl;
+            }
+        }
+    }
+
+    feeding = false;
+    feeder.join();
+    client.disconnect();
+    server.stop();
+
+    // compare the start and the end of the run, a window on each side
+    bool failed = failures > 0 || lingering > 0;
+    const size_t window = std::max<size_t>(1, samples.size() / 10);
+    if (samples.size() >= 2 * window) {
+        auto window_median = [&](size_t begin, auto field) {
+            std::vector<double> values;
+            for (size_t i = begin; i < begin + window; ++i) {
+                values.push_back(field(samples[i].resources));
+            }
+            return median(values);
+        };
+        struct Check {
+            const char* name;
+            double (*field)(const Resources&);
+            double limit;
+        };
+        const Check checks[] = {
+            { "rss MB", [](const Resources& r) { return r.rss_mb; }, max_rss_growth_mb },
+            { "fds", [](const Resources& r) { return static_cast<double>(r.fds); }, static_cast<double>(max_fd_growth) },
+            { "threads", [](const Resources& r) { return static_cast<double>(r.threads); }, static_cast<double>(max_thread_growth) },
+        };
+        for (auto& check : checks) {
+            const double first = window_median(0, check.field);
+            const double last = window_median(samples.size() - window, check.field);
+            const bool grew = first >= 0 && last - first > check.limit;
+            std::cout << check.name << ": " << first << " -> " << last << (grew ? "  GROWING" : "") << std::endl;
+            failed = failed || grew;
+        }
+    } else {
+        std::cout << "too few samples for the growth checks, run more cycles" << std::endl;
+    }
+
+    // setup time, the late cycles may not be much slower than the early ones
+    auto report = [&](const char* name, const std::vector<double>& values) {
+        if (values.size() < 20) {
+            return;
+        }
+        const size_t window = values.size() / 10;
+        const double first = median(std::vector<double>(values.begin(), values.begin() + window));
+        const double last = median(std::vector<double>(values.end() - window, values.end()));
+        std::vector<double> sorted = values;
+        std::sort(sorted.begin(), sorted.end());
+        const bool slower = last > 2 * first + 50;
+        std::cout << name << ": p50 " << sorted[sorted.size() / 2] << " ms, p95 " << sorted[sorted.size() * 95 / 100]
+                  << " ms, max " << sorted.back() << " ms, first/last tenth " << first << " -> " << last << " ms"
+                  << (slower ? "  SLOWER" : "") << std::endl;
+        failed = failed || slower;
+    };
+    report("time to connected", connected_ms);
+    report("time to first frame", first_frame_ms);
+
+    std::cout << "failed cycles: " << failures << ", peers not released: " << lingering << std::endl;
+    std::cout << (failed ? "FAIL" : "PASS") << std::endl;
+    return failed ? 1 : 0;
+}